@@ -0,0 +1,312 @@
+#include "approx_classifier.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include "sampler.h"
+#include <ppu-lv2.h>
+#include <sys/file.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define APPROX_MAGIC 0x41505832 /* "APX2", the header carries the row format */
+#define KMEANS_CHUNK 256        /* rows per assignment task */
+
+static void* approx_alloc(size_t size, int tag) {
+    void* ptr = ps3_malloc_tagged(size, tag);
+    if (!ptr) {
+        fprintf(stderr, "Failed to allocate approximate classifier\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/* Precision of the classifier rows the clusters are built from */
+static int rows_format(TransformerWeights* weights) {
+    if (weights->token_embedding_q8) {
+        return APPROX_ROWS_Q8;
+    }
+    return weights->token_embedding_table_f16 ? APPROX_ROWS_FP16 : APPROX_ROWS_FP32;
+}
+
+static void alloc_index(ApproxClassifier* ac, int vocab_size, int dim, int n_clusters) {
+    ac->vocab_size = vocab_size;
+    ac->dim = dim;
+    ac->n_clusters = n_clusters;
+    ac->n_probe = n_clusters < APPROX_PROBE ? n_clusters : APPROX_PROBE;
+    ac->centroids = (float*)approx_alloc((size_t)n_clusters * dim * sizeof(float), MEM_WEIGHTS);
+    ac->offsets = (int*)approx_alloc((n_clusters + 1) * sizeof(int), MEM_WEIGHTS);
+    ac->members = (int*)approx_alloc(vocab_size * sizeof(int), MEM_WEIGHTS);
+    ac->scores = (float*)approx_alloc(n_clusters * sizeof(float), MEM_ACTIVATIONS);
+    ac->order = (int*)approx_alloc(n_clusters * sizeof(int), MEM_ACTIVATIONS);
+    ac->candidates = (int*)approx_alloc(vocab_size * sizeof(int), MEM_ACTIVATIONS);
+}
+
+static void normalize(float* v, int n) {
+    float ss = 0.0f;
+    int i;
+    for (i = 0; i < n; i++) {
+        ss += v[i] * v[i];
+    }
+    if (ss > 0.0f) {
+        ss = 1.0f / sqrtf(ss);
+        for (i = 0; i < n; i++) {
+            v[i] *= ss;
+        }
+    }
+}
+
+/* Assignment step: one task per pool thread, each claiming chunks of rows until
+ * none are left. Task w works in scratch slice w, allocated once per build. With
+ * unit centroids the best cluster by dot product doesn't depend on the row's
+ * norm, so rows are used as is. */
+typedef struct {
+    ApproxClassifier* ac;
+    TransformerWeights* weights;
+    int* assignment;
+    float* scratch;          /* per task: a row (dim,) and its scores (n_clusters,) */
+    int n_chunks;
+    volatile int next_chunk;
+} KMeansJob;
+
+static void assign_task(void* ctx, int w) {
+    KMeansJob* job = (KMeansJob*)ctx;
+    ApproxClassifier* ac = job->ac;
+    float* row = job->scratch + (size_t)w * (ac->dim + ac->n_clusters);
+    float* scores = row + ac->dim;
+    int chunk, first, last, r;
+
+    while ((chunk = __sync_fetch_and_add(&job->next_chunk, 1)) < job->n_chunks) {
+        first = chunk * KMEANS_CHUNK;
+        last = first + KMEANS_CHUNK < ac->vocab_size ? first + KMEANS_CHUNK : ac->vocab_size;
+        for (r = first; r < last; r++) {
+            embedding_row(job->weights, r, ac->dim, row);
+            matmul(scores, row, ac->centroids, ac->dim, ac->n_clusters);
+            job->assignment[r] = sample_argmax(scores, ac->n_clusters);
+        }
+    }
+}
+
+void approx_classifier_build(ApproxClassifier* ac, Transformer* transformer, int n_clusters, int iterations) {
+    Config* config = &transformer->model.config;
+    int dim = config->dim;
+    int vocab_size = config->vocab_size;
+    int n_tasks = thread_pool_size(transformer->state.pool);
+    KMeansJob job;
+    int* counts;
+    float* row;
+    int it, c, r, i;
+
+    if (n_clusters > vocab_size) {
+        n_clusters = vocab_size;
+    }
+    alloc_index(ac, vocab_size, dim, n_clusters);
+    ac->rows_format = rows_format(&transformer->model.weights);
+    job.ac = ac;
+    job.weights = &transformer->model.weights;
+    job.assignment = (int*)approx_alloc(vocab_size * sizeof(int), MEM_OTHER);
+    job.scratch = (float*)approx_alloc((size_t)n_tasks * (dim + n_clusters) * sizeof(float), MEM_OTHER);
+    job.n_chunks = (vocab_size + KMEANS_CHUNK - 1) / KMEANS_CHUNK;
+    counts = (int*)approx_alloc(n_clusters * sizeof(int), MEM_OTHER);
+    row = (float*)approx_alloc(dim * sizeof(float), MEM_OTHER);
+
+    /* seed with evenly spaced rows */
+    for (c = 0; c < n_clusters; c++) {
+        embedding_row(&transformer->model.weights, (int)((long long)c * vocab_size / n_clusters), dim,
+                      ac->centroids + (size_t)c * dim);
+        normalize(ac->centroids + (size_t)c * dim, dim);
+    }
+
+    for (it = 0; ; it++) {
+        job.next_chunk = 0;
+        thread_pool_run(transformer->state.pool, n_tasks, assign_task, &job);
+        if (it == iterations) {
+            break;
+        }
+
+        /* update: mean direction of the members; an empty cluster keeps its centroid */
+        memset(counts, 0, n_clusters * sizeof(int));
+        for (r = 0; r < vocab_size; r++) {
+            counts[job.assignment[r]]++;
+        }
+        for (c = 0; c < n_clusters; c++) {
+            if (counts[c] > 0) {
+                memset(ac->centroids + (size_t)c * dim, 0, dim * sizeof(float));
+            }
+        }
+        for (r = 0; r < vocab_size; r++) {
+            float* centroid = ac->centroids + (size_t)job.assignment[r] * dim;
+            embedding_row(&transformer->model.weights, r, dim, row);
+            normalize(row, dim);
+            for (i = 0; i < dim; i++) {
+                centroid[i] += row[i];
+            }
+        }
+        for (c = 0; c < n_clusters; c++) {
+            normalize(ac->centroids + (size_t)c * dim, dim);
+        }
+    }
+
+    /* group the token ids by cluster */
+    memset(counts, 0, n_clusters * sizeof(int));
+    for (r = 0; r < vocab_size; r++) {
+        counts[job.assignment[r]]++;
+    }
+    ac->offsets[0] = 0;
+    for (c = 0; c < n_clusters; c++) {
+        ac->offsets[c + 1] = ac->offsets[c] + counts[c];
+        counts[c] = ac->offsets[c];
+    }
+    for (r = 0; r < vocab_size; r++) {
+        ac->members[counts[job.assignment[r]]++] = r;
+    }
+
+    ps3_free(row);
+    ps3_free(counts);
+    ps3_free(job.scratch);
+    ps3_free(job.assignment);
+}
+
+/* 1 if all size bytes went out */
+static int write_all(int fd, const void* data, size_t size) {
+    uint64_t written;
+    return sysLv2FsWrite(fd, data, size, &written) == 0 && written == size;
+}
+
+int approx_classifier_save(const ApproxClassifier* ac, const char* path) {
+    int32_t header[5];
+    int fd;
+    int ok;
+
+    if (sysLv2FsOpen(path, SYS_O_WRONLY | SYS_O_CREAT | SYS_O_TRUNC, &fd, 0, NULL, 0) != 0) {
+        return 0;
+    }
+    header[0] = APPROX_MAGIC;
+    header[1] = ac->vocab_size;
+    header[2] = ac->dim;
+    header[3] = ac->n_clusters;
+    header[4] = ac->rows_format;
+    ok = write_all(fd, header, sizeof(header));
+    ok = ok && write_all(fd, ac->centroids, (size_t)ac->n_clusters * ac->dim * sizeof(float));
+    ok = ok && write_all(fd, ac->offsets, (ac->n_clusters + 1) * sizeof(int));
+    ok = ok && write_all(fd, ac->members, ac->vocab_size * sizeof(int));
+    sysLv2FsClose(fd);
+    if (!ok) {
+        /* don't leave a truncated index for the next start to find */
+        sysLv2FsUnlink(path);
+    }
+    return ok;
+}
+
+int approx_classifier_load(ApproxClassifier* ac, Transformer* transformer, const char* path) {
+    Config* config = &transformer->model.config;
+    size_t size, expected;
+    int32_t header[5];
+    char* file;
+    char* cursor;
+    int n_clusters, c, r;
+
+    file = ps3_read_file(path, &size);
+    if (!file) {
+        return 0;
+    }
+    if (size < sizeof(header)) {
+        ps3_free(file);
+        return 0;
+    }
+    memcpy(header, file, sizeof(header));
+    n_clusters = header[3];
+    if (header[0] != APPROX_MAGIC || header[1] != config->vocab_size || header[2] != config->dim
+        || n_clusters < 1 || n_clusters > config->vocab_size
+        || header[4] != rows_format(&transformer->model.weights)) {
+        ps3_free(file);
+        return 0;
+    }
+    expected = sizeof(header) + (size_t)n_clusters * config->dim * sizeof(float)
+             + (n_clusters + 1) * sizeof(int) + config->vocab_size * sizeof(int);
+    if (size != expected) {
+        ps3_free(file);
+        return 0;
+    }
+
+    alloc_index(ac, config->vocab_size, config->dim, n_clusters);
+    ac->rows_format = header[4];
+    cursor = file + sizeof(header);
+    memcpy(ac->centroids, cursor, (size_t)n_clusters * config->dim * sizeof(float));
+    cursor += (size_t)n_clusters * config->dim * sizeof(float);
+    memcpy(ac->offsets, cursor, (n_clusters + 1) * sizeof(int));
+    cursor += (n_clusters + 1) * sizeof(int);
+    memcpy(ac->members, cursor, config->vocab_size * sizeof(int));
+    ps3_free(file);
+
+    /* a truncated or stale file must not send forward out of the table */
+    for (c = 0; c < n_clusters; c++) {
+        if (ac->offsets[c] < 0 || ac->offsets[c + 1] < ac->offsets[c]) break;
+    }
+    for (r = 0; r < config->vocab_size; r++) {
+        if (ac->members[r] < 0 || ac->members[r] >= config->vocab_size) break;
+    }
+    if (c < n_clusters || ac->offsets[0] != 0 || ac->offsets[n_clusters] != config->vocab_size
+        || r < config->vocab_size) {
+        approx_classifier_free(ac);
+        return 0;
+    }
+    return 1;
+}
+
+void approx_classifier_open(ApproxClassifier* ac, Transformer* transformer, const char* path) {
+    if (approx_classifier_load(ac, transformer, path)) {
+        return;
+    }
+    approx_classifier_build(ac, transformer, APPROX_CLUSTERS, APPROX_KMEANS_ITERS);
+    if (!approx_classifier_save(ac, path)) {
+        fprintf(stderr, "couldn't save classifier index to %s\n", path);
+    }
+}
+
+void approx_classifier_free(ApproxClassifier* ac) {
+    ps3_free(ac->centroids);
+    ps3_free(ac->offsets);
+    ps3_free(ac->members);
+    ps3_free(ac->scores);
+    ps3_free(ac->order);
+    ps3_free(ac->candidates);
+    memset(ac, 0, sizeof(ApproxClassifier));
+}
+
+int approx_classifier_candidates(ApproxClassifier* ac, Transformer* transformer) {
+    int n_probe = ac->n_probe < ac->n_clusters ? ac->n_probe : ac->n_clusters;
+    int n = 0;
+    int c, i, j, best;
+
+    matmul(ac->scores, transformer->state.x, ac->centroids, ac->dim, ac->n_clusters);
+
+    /* partial selection sort: n_probe is small next to n_clusters. Empty clusters
+     * don't count towards it, so there is always at least one candidate. */
+    for (c = 0; c < ac->n_clusters; c++) {
+        ac->order[c] = c;
+    }
+    for (i = 0; i < ac->n_clusters && (i < n_probe || n == 0); i++) {
+        best = i;
+        for (j = i + 1; j < ac->n_clusters; j++) {
+            if (ac->scores[ac->order[j]] > ac->scores[ac->order[best]]) {
+                best = j;
+            }
+        }
+        c = ac->order[best];
+        ac->order[best] = ac->order[i];
+        ac->order[i] = c;
+
+        memcpy(ac->candidates + n, ac->members + ac->offsets[c],
+               (ac->offsets[c + 1] - ac->offsets[c]) * sizeof(int));
+        n += ac->offsets[c + 1] - ac->offsets[c];
+    }
+    return n;
+}
+
+float* forward_approx(Transformer* transformer, ApproxClassifier* ac, int token, int pos, int* n_candidates) {
+    forward_rows(transformer, token, pos, NULL, 0);
+    *n_candidates = approx_classifier_candidates(ac, transformer);
+    return classify_rows(transformer, ac->candidates, *n_candidates);
+}
@@ -0,0 +1,56 @@
+#ifndef __APPROX_CLASSIFIER_H__
+#define __APPROX_CLASSIFIER_H__
+
+#include "transformer.h"
+
+/* Vocabulary clusters and how many of them are scored per token by default */
+#define APPROX_CLUSTERS 256
+#define APPROX_PROBE 16
+#define APPROX_KMEANS_ITERS 8
+
+/* Precision of the classifier rows an index was built from */
+#define APPROX_ROWS_FP32 0
+#define APPROX_ROWS_FP16 1
+#define APPROX_ROWS_Q8   2
+
+/* Two-stage classifier: the rows of the embedding/classifier table are grouped
+ * offline into clusters around unit-length centroids. Per token the centroids
+ * are scored against the final hidden state and only the rows of the n_probe
+ * best clusters get exact logits. Meant for greedy and small top-k decoding,
+ * where tokens outside those clusters would not be picked anyway. */
+typedef struct {
+    int vocab_size;
+    int dim;
+    int n_clusters;
+    int n_probe;          /* clusters scored exactly per token */
+    int rows_format;      /* APPROX_ROWS_*, the rows the clusters were built from */
+    float* centroids;     /* (n_clusters, dim) */
+    int* offsets;         /* (n_clusters + 1,) start of each cluster in members */
+    int* members;         /* (vocab_size,) token ids grouped by cluster */
+    /* scratch */
+    float* scores;        /* (n_clusters,) */
+    int* order;           /* (n_clusters,) */
+    int* candidates;      /* (vocab_size,) ids of the rows scored for the last token */
+} ApproxClassifier;
+
+/* Spherical k-means over the classifier rows, run on the transformer's worker pool */
+void approx_classifier_build(ApproxClassifier* ac, Transformer* transformer, int n_clusters, int iterations);
+
+/* The index is saved next to the model so the clustering only runs once.
+ * Save deletes the file again if any write fails. Load returns 0 if the file
+ * is missing or was built for another model or another row precision. */
+int approx_classifier_save(const ApproxClassifier* ac, const char* path);
+int approx_classifier_load(ApproxClassifier* ac, Transformer* transformer, const char* path);
+
+/* Load the index from path, or build and save it */
+void approx_classifier_open(ApproxClassifier* ac, Transformer* transformer, const char* path);
+void approx_classifier_free(ApproxClassifier* ac);
+
+/* Collect the rows of the n_probe best clusters for the hidden state of the last
+ * forward into ac->candidates, returning how many there are */
+int approx_classifier_candidates(ApproxClassifier* ac, Transformer* transformer);
+
+/* forward() with the two-stage classifier: logits[i] belongs to ac->candidates[i] */
+float* forward_approx(Transformer* transformer, ApproxClassifier* ac, int token, int pos, int* n_candidates);
+
+#endif /* __APPROX_CLASSIFIER_H__ */
@@ -0,0 +1,149 @@
+#include "batch.h"
+#include "memory_utils.h"
+#include <ppu-lv2.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_WRITE_BUFFER (64*1024)
+
+/* Buffered output so thousands of short stories don't turn into thousands of tiny writes */
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t used;
+    int failed;
+} BatchWriter;
+
+static void writer_flush(BatchWriter* w) {
+    uint64_t written;
+    if (w->used > 0 && !w->failed) {
+        if (sysLv2FsWrite(w->fd, w->buffer, w->used, &written) != 0 || written != w->used) {
+            fprintf(stderr, "Failed to write batch output\n");
+            w->failed = 1;
+        }
+    }
+    w->used = 0;
+}
+
+static void writer_emit(const char* piece, void* userdata) {
+    BatchWriter* w = (BatchWriter*)userdata;
+    size_t len = strlen(piece);
+
+    if (w->used + len > BATCH_WRITE_BUFFER) {
+        writer_flush(w);
+    }
+    if (len > BATCH_WRITE_BUFFER) {
+        return;
+    }
+    memcpy(w->buffer + w->used, piece, len);
+    w->used += len;
+}
+
+/* Split off the next '|' separated field, or return NULL if there is none */
+static char* next_field(char** cursor) {
+    char* field = *cursor;
+    char* bar = strchr(field, '|');
+    if (!bar) {
+        return NULL;
+    }
+    *bar = '\0';
+    *cursor = bar + 1;
+    return field;
+}
+
+int run_batch(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler,
+              const char* prompts_path, const char* output_path, int default_steps,
+              BatchProgressFn progress, void* userdata, BatchStats* stats) {
+    BatchWriter writer;
+    GenerateStats gen;
+    char* prompts;
+    char* line;
+    char* end;
+    char* prompt;
+    char* fields[3];
+    char header[64];
+    float default_temperature = sampler->temperature;
+    unsigned long long default_seed = sampler->rng_state;
+    int steps;
+    int index = 0;
+    int ret;
+    int i;
+    size_t len;
+
+    memset(stats, 0, sizeof(BatchStats));
+
+    prompts = ps3_read_file(prompts_path, NULL);
+    if (!prompts) {
+        fprintf(stderr, "couldn't load %s\n", prompts_path);
+        return 0;
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    ret = sysLv2FsOpen(output_path, SYS_O_WRONLY | SYS_O_CREAT | SYS_O_TRUNC, &writer.fd, 0, NULL, 0);
+    writer.buffer = (char*)ps3_malloc(BATCH_WRITE_BUFFER);
+    if (ret != 0 || !writer.buffer) {
+        fprintf(stderr, "couldn't open %s\n", output_path);
+        if (ret == 0) sysLv2FsClose(writer.fd);
+        if (writer.buffer) ps3_free(writer.buffer);
+        ps3_free(prompts);
+        return 0;
+    }
+
+    for (line = prompts; line && *line; line = end ? end + 1 : NULL) {
+        end = strchr(line, '\n');
+        if (end) *end = '\0';
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+        if (len == 0) {
+            continue;
+        }
+
+        /* optional "steps|temperature|seed|" prefix */
+        prompt = line;
+        for (i = 0; i < 3; i++) {
+            fields[i] = next_field(&prompt);
+            if (!fields[i]) break;
+        }
+        if (i < 3) {
+            prompt = line;
+            /* next_field cut the line; put the separators back */
+            while (i-- > 0) fields[i][strlen(fields[i])] = '|';
+            fields[0] = fields[1] = fields[2] = NULL;
+        }
+
+        steps = (fields[0] && fields[0][0]) ? atoi(fields[0]) : default_steps;
+        sampler->temperature = (fields[1] && fields[1][0]) ? (float)atof(fields[1]) : default_temperature;
+        sampler->rng_state = (fields[2] && fields[2][0]) ? strtoull(fields[2], NULL, 10) : default_seed + index;
+        if (sampler->rng_state == 0) {
+            sampler->rng_state = 1; /* xorshift would stay at zero forever */
+        }
+
+        snprintf(header, sizeof(header), "### %d\n", index);
+        writer_emit(header, &writer);
+        if (generate(transformer, tokenizer, sampler, prompt, steps, NULL, NULL, writer_emit, &writer, &gen)) {
+            stats->n_prompts++;
+            stats->n_positions += gen.n_prompt_tokens - 1 + gen.n_generated;
+            stats->n_generated += gen.n_generated;
+            stats->total_us += gen.total_us;
+        } else {
+            stats->n_failed++;
+        }
+        writer_emit("\n\n", &writer);
+
+        if (progress) {
+            progress(index, prompt, &gen, userdata);
+        }
+        index++;
+    }
+
+    writer_flush(&writer);
+    sysLv2FsClose(writer.fd);
+    ps3_free(writer.buffer);
+    ps3_free(prompts);
+
+    sampler->temperature = default_temperature;
+    sampler->rng_state = default_seed;
+    return !writer.failed;
+}
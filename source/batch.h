@@ -0,0 +1,28 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdint.h>
+#include "generate.h"
+
+/* Aggregate numbers for a whole batch job */
+typedef struct {
+    int n_prompts;          /* prompts that produced a story */
+    int n_failed;           /* prompts that encoded to nothing */
+    long long n_positions;  /* forward passes run, prompt + generated */
+    long long n_generated;  /* sampled tokens */
+    uint64_t total_us;      /* generation time, excluding the one-off model load */
+} BatchStats;
+
+/* Called after every prompt so the caller can show progress */
+typedef void (*BatchProgressFn)(int index, const char* prompt, const GenerateStats* stats, void* userdata);
+
+/* Generate a story for every line of prompts_path with the already loaded model
+ * and write them to output_path. A line is either a bare prompt or
+ * "steps|temperature|seed|prompt" where empty fields keep the defaults
+ * (default_steps, the sampler's temperature, and the sampler's seed + line number).
+ * Returns 1 on success, 0 if either file could not be opened. */
+int run_batch(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler,
+              const char* prompts_path, const char* output_path, int default_steps,
+              BatchProgressFn progress, void* userdata, BatchStats* stats);
+
+#endif /* __BATCH_H__ */
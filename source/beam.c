@@ -0,0 +1,236 @@
+#include "beam.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    float score;   /* summed log-probability with this token appended */
+    int parent;    /* beam it extends */
+    int token;
+} BeamCandidate;
+
+/* Insert c into best[0..*n), kept sorted by descending score and capped at k */
+static void keep_best(BeamCandidate* best, int* n, int k, BeamCandidate c) {
+    int i;
+
+    if (*n == k && c.score <= best[k - 1].score) {
+        return;
+    }
+    i = *n < k ? (*n)++ : k - 1;
+    while (i > 0 && best[i - 1].score < c.score) {
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i] = c;
+}
+
+/* log of the softmax denominator, so logit - log_normalizer() is the log-probability */
+static float log_normalizer(const float* logits, int n) {
+    float max_val = logits[0];
+    float sum = 0.0f;
+    int i;
+
+    for (i = 1; i < n; i++) {
+        if (logits[i] > max_val) {
+            max_val = logits[i];
+        }
+    }
+    for (i = 0; i < n; i++) {
+        sum += expf(logits[i] - max_val);
+    }
+    return max_val + logf(sum);
+}
+
+int beam_search(Transformer* transformer, Tokenizer* tokenizer, const char* prompt, int steps, int width,
+                EmitFn emit, void* userdata, BeamStats* stats) {
+    Config* p = &transformer->model.config;
+    TransformerWeights* w = &transformer->model.weights;
+    RunState seqs[BEAM_MAX_WIDTH];
+    BeamCandidate local[2 * BEAM_MAX_WIDTH];
+    BeamCandidate top[2 * BEAM_MAX_WIDTH];
+    BeamCandidate chosen[BEAM_MAX_WIDTH];
+    BeamCandidate c;
+    float scores[BEAM_MAX_WIDTH];
+    int cur[BEAM_MAX_WIDTH];
+    int positions[BEAM_MAX_WIDTH];  /* every beam is at pos */
+    KVPool* pool;
+    int* prompt_tokens;
+    int* history;          /* one row of len_cap tokens per live beam */
+    int* next_history;
+    int* best_tokens;      /* best hypothesis that has ended so far */
+    int* tables;           /* block tables of the next beams, built before the old ones are dropped */
+    int* swap;
+    float norm, best_score = 0.0f;
+    int have_best = 0, best_len = 0;
+    int len_cap, n_table, n_live, n_next, n_top, n_local, pos, b, i, k, t, held;
+    char* piece;
+    uint64_t start;
+
+    memset(stats, 0, sizeof(BeamStats));
+    if (steps > p->seq_len) {
+        steps = p->seq_len;
+    }
+    if (width < 1) {
+        width = 1;
+    }
+    if (width > BEAM_MAX_WIDTH) {
+        width = BEAM_MAX_WIDTH;
+    }
+
+    /* Encode the prompt; +3 for '\0', BOS and the dummy prefix */
+    prompt_tokens = (int*)ps3_malloc((strlen(prompt) + 3) * sizeof(int));
+    if (!prompt_tokens) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    encode(tokenizer, (char*)prompt, 1, 0, prompt_tokens, &stats->n_prompt_tokens);
+    if (stats->n_prompt_tokens < 1 || steps < 1) {
+        ps3_free(prompt_tokens);
+        return 0;
+    }
+    if (stats->n_prompt_tokens > steps) {
+        stats->n_prompt_tokens = steps;
+    }
+
+    /* enough blocks for every beam to hold a full private cache, plus one copy each */
+    len_cap = steps + 1;
+    n_table = (steps + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    pool = kv_pool_create(p->n_layers, p->n_kv_heads, p->dim / p->n_heads, width * (n_table + 1));
+    history = (int*)ps3_malloc(width * len_cap * sizeof(int));
+    next_history = (int*)ps3_malloc(width * len_cap * sizeof(int));
+    best_tokens = (int*)ps3_malloc(len_cap * sizeof(int));
+    tables = (int*)ps3_malloc(width * n_table * sizeof(int));
+    if (!pool || !history || !next_history || !best_tokens || !tables) {
+        fprintf(stderr, "Failed to allocate beam search buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    malloc_run_state_batch(seqs, p, pool, width);
+    /* the beams take turns in attention, so they can all borrow the transformer's workers */
+    for (b = 0; b < width; b++) {
+        seqs[b].pool = transformer->state.pool;
+        seqs[b].specialized = transformer->state.specialized;
+    }
+
+    /* prefill the prompt once, as the only beam */
+    start = ps3_time_us();
+    for (pos = 0; pos < stats->n_prompt_tokens - 1; pos++) {
+        forward_impl_rows(p, w, &seqs[0], prompt_tokens[pos], pos, NULL, 0);
+    }
+    stats->prefill_us = ps3_time_us() - start;
+    memcpy(history, prompt_tokens, stats->n_prompt_tokens * sizeof(int));
+    cur[0] = prompt_tokens[stats->n_prompt_tokens - 1];
+    scores[0] = 0.0f;
+    n_live = 1;
+
+    ps3_mem_hot_begin();
+    while (pos < steps) {
+        for (b = 0; b < n_live; b++) {
+            positions[b] = pos;
+        }
+        forward_impl_batch(p, w, seqs, cur, positions, n_live);
+        stats->n_steps++;
+        pos++;
+
+        /* the best extensions over all beams; twice the width so that beams
+         * ending here still leave `width` to carry on */
+        n_top = 0;
+        for (b = 0; b < n_live; b++) {
+            norm = log_normalizer(seqs[b].logits, p->vocab_size);
+            n_local = 0;
+            for (t = 0; t < p->vocab_size; t++) {
+                c.score = scores[b] + seqs[b].logits[t] - norm;
+                c.parent = b;
+                c.token = t;
+                keep_best(local, &n_local, 2 * width, c);
+            }
+            for (i = 0; i < n_local; i++) {
+                keep_best(top, &n_top, 2 * width, local[i]);
+            }
+        }
+
+        n_next = 0;
+        for (i = 0; i < n_top && n_next < width; i++) {
+            if (top[i].token == 1 || top[i].token == 2) {  /* BOS or EOS ends the hypothesis */
+                if (!have_best || top[i].score > best_score) {
+                    have_best = 1;
+                    best_score = top[i].score;
+                    best_len = pos;
+                    memcpy(best_tokens, history + top[i].parent * len_cap, pos * sizeof(int));
+                }
+            } else {
+                chosen[n_next++] = top[i];
+            }
+        }
+        /* scores only go down as hypotheses grow, so nothing live can beat a finished one above it */
+        if (n_next == 0 || (have_best && best_score >= chosen[0].score)) {
+            n_live = 0;
+            break;
+        }
+
+        /* the next beams take their parents' blocks and histories by reference */
+        for (i = 0; i < n_next; i++) {
+            b = chosen[i].parent;
+            for (k = 0; k < n_table; k++) {
+                tables[i * n_table + k] = seqs[b].kv_blocks[k];
+                if (seqs[b].kv_blocks[k] >= 0) {
+                    kv_block_ref(pool, seqs[b].kv_blocks[k]);
+                }
+            }
+            memcpy(next_history + i * len_cap, history + b * len_cap, pos * sizeof(int));
+            next_history[i * len_cap + pos] = chosen[i].token;
+            cur[i] = chosen[i].token;
+        }
+        for (b = 0; b < n_live; b++) {
+            kv_cache_reset(&seqs[b]);
+        }
+        for (i = 0; i < n_next; i++) {
+            memcpy(seqs[i].kv_blocks, tables + i * n_table, n_table * sizeof(int));
+            scores[i] = chosen[i].score;
+        }
+        swap = history;
+        history = next_history;
+        next_history = swap;
+        n_live = n_next;
+
+        held = n_live * ((pos + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE);
+        if (held > stats->kv_blocks_unshared) {
+            stats->kv_blocks_unshared = held;
+        }
+    }
+    ps3_mem_hot_end();
+
+    /* out of room: the best live beam competes with the best finished one */
+    if (n_live > 0 && (!have_best || scores[0] > best_score)) {
+        have_best = 1;
+        best_score = scores[0];
+        best_len = pos + 1;
+        memcpy(best_tokens, history, best_len * sizeof(int));
+    }
+    stats->total_us = ps3_time_us() - start;
+    stats->kv_blocks_peak = kv_pool_peak_blocks(pool);
+    stats->n_generated = best_len - stats->n_prompt_tokens;
+    stats->score = best_score;
+
+    for (i = 1; i < best_len; i++) {
+        piece = decode(tokenizer, best_tokens[i - 1], best_tokens[i]);
+        if (piece) {
+            emit(piece, userdata);
+        }
+    }
+
+    for (b = 0; b < width; b++) {
+        seqs[b].pool = NULL;
+    }
+    free_run_state_batch(seqs, width);
+    kv_pool_destroy(pool);
+    ps3_free(tables);
+    ps3_free(best_tokens);
+    ps3_free(next_history);
+    ps3_free(history);
+    ps3_free(prompt_tokens);
+    return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef __BEAM_H__
+#define __BEAM_H__
+
+#include <stdint.h>
+#include "transformer.h"
+#include "tokenizer.h"
+#include "generate.h"
+#include "gemv.h"
+
+/* Widest beam; one batched step reads the weights once for all of them */
+#define BEAM_MAX_WIDTH GEMV_MAX_BATCH
+
+/* Counters for one beam_search() call */
+typedef struct {
+    int n_prompt_tokens;     /* tokens in the encoded prompt (including BOS) */
+    int n_generated;         /* tokens of the winning hypothesis after the prompt */
+    int n_steps;             /* batched forward steps */
+    float score;             /* summed log-probability of the generated tokens */
+    int kv_blocks_peak;      /* most KV blocks in use at once */
+    int kv_blocks_unshared;  /* most the live beams would have held with a cache each */
+    uint64_t prefill_us;
+    uint64_t total_us;       /* prefill included */
+} BeamStats;
+
+/* Deterministic beam search: keep the `width` most likely continuations of the
+ * prompt and return the one with the highest summed log-probability, ending at
+ * BOS/EOS or after `steps` positions. The prompt is prefilled once; every step
+ * then advances all live beams in one batched forward pass, so each weight
+ * matrix is read once per step rather than once per beam. Beams live in a
+ * paged KV cache: a beam that extends another's hypothesis takes over its
+ * blocks by reference, and only the block being written is copied when two
+ * beams diverge inside it. The prompt and the winning continuation are emitted
+ * once the search ends. Returns 0 if the prompt encoded to nothing. */
+int beam_search(Transformer* transformer, Tokenizer* tokenizer, const char* prompt, int steps, int width,
+                EmitFn emit, void* userdata, BeamStats* stats);
+
+#endif /* __BEAM_H__ */
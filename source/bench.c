@@ -0,0 +1,1174 @@
+#include "bench.h"
+#include "thread_utils.h"
+#include "math_utils.h"
+#include "gemv.h"
+#include "memory_utils.h"
+#include "sampler.h"
+#include "beam.h"
+#include "pipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BENCH_BUCKETS 8
+#define BENCH_Q8_STEPS 256
+#define BENCH_Q8_SEED 1234ull
+#define BENCH_FOLD_STEPS 64
+#define BENCH_FP16_STEPS 64
+#define BENCH_EXP_STEPS 64
+#define BENCH_EXP_SAMPLES 1000000  /* points per accuracy sweep */
+#define BENCH_PAGES_STEPS 128
+#define BENCH_APPROX_STEPS 64
+#define BENCH_CONSTRAINT_STEPS 64
+#define BENCH_TOPK 10
+#define BENCH_TILED_STEPS 32
+#define BENCH_SPECIALIZED_STEPS 64
+#define BENCH_SPECIALIZED_ROUNDS 3
+#define BENCH_PAGED_STEPS 128
+#define BENCH_KV_BUDGET (64*1024*1024)
+#define BENCH_SESSION_STEPS 64
+#define BENCH_MAX_SESSIONS 4
+#define BENCH_BEAM_STEPS 32
+#define BENCH_BEAM_WIDTH 4
+#define BENCH_PIPELINE_SEQS 4
+#define BENCH_PIPELINE_STEPS 32
+
+void bench_attention_scaling(Transformer* transformer, EmitFn emit, void* userdata) {
+    ThreadPool* pool = transformer->state.pool;
+    int seq_len = transformer->model.config.seq_len;
+    int bucket_len = (seq_len + BENCH_BUCKETS - 1) / BENCH_BUCKETS;
+    uint64_t latency[2][BENCH_BUCKETS];
+    uint64_t start;
+    char line[128];
+    int run, pos, b, n;
+
+    memset(latency, 0, sizeof(latency));
+
+    /* run 0 is serial, run 1 uses the pool; the token doesn't matter for timing */
+    for (run = 0; run < 2; run++) {
+        transformer->state.pool = run ? pool : NULL;
+        for (pos = 0; pos < seq_len; pos++) {
+            start = ps3_time_us();
+            forward(transformer, 3 + pos % 256, pos);
+            latency[run][pos / bucket_len] += ps3_time_us() - start;
+        }
+    }
+    transformer->state.pool = pool;
+
+    snprintf(line, sizeof(line), "\nPer-token latency, 1 vs %d threads:", thread_pool_size(pool));
+    emit(line, userdata);
+    for (b = 0; b < BENCH_BUCKETS && b * bucket_len < seq_len; b++) {
+        n = (b + 1) * bucket_len <= seq_len ? bucket_len : seq_len - b * bucket_len;
+        snprintf(line, sizeof(line), "\npos %4d-%4d: %7.2f ms  %7.2f ms  (%.2fx)",
+                 b * bucket_len, b * bucket_len + n - 1,
+                 latency[0][b] / (1000.0 * n), latency[1][b] / (1000.0 * n),
+                 latency[1][b] > 0 ? latency[0][b] / (double)latency[1][b] : 0.0);
+        emit(line, userdata);
+    }
+}
+
+/* Compare other against reference over `steps` positions, both fed the
+ * reference's greedy continuation: argmax agreement and the largest logit
+ * difference, reported under label. With ref_name and other_name set, the
+ * per-token latency of both over the same positions is reported too. */
+static void compare_models(Transformer* reference, Transformer* other, int steps, const char* label,
+                           const char* ref_name, const char* other_name, EmitFn emit, void* userdata) {
+    int vocab_size = reference->model.config.vocab_size;
+    float* logits;
+    float* other_logits;
+    float d, max_diff = 0.0f, max_logit = 0.0f;
+    int token = 1, next, same_argmax = 0;
+    int pos, i;
+    uint64_t start, ref_us, other_us;
+    char line[160];
+
+    logits = (float*)malloc(vocab_size * sizeof(float));
+    if (!logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (pos = 0; pos < steps; pos++) {
+        memcpy(logits, forward(reference, token, pos), vocab_size * sizeof(float));
+        other_logits = forward(other, token, pos);
+        for (i = 0; i < vocab_size; i++) {
+            d = logits[i] - other_logits[i];
+            if (d < 0.0f) d = -d;
+            if (d > max_diff) max_diff = d;
+            d = logits[i] < 0.0f ? -logits[i] : logits[i];
+            if (d > max_logit) max_logit = d;
+        }
+        next = sample_argmax(logits, vocab_size);
+        if (sample_argmax(other_logits, vocab_size) == next) {
+            same_argmax++;
+        }
+        token = next;
+    }
+    snprintf(line, sizeof(line), "\n%s: %d/%d argmax match, max logit diff %.5f (max |logit| %.2f)",
+             label, same_argmax, steps, max_diff, max_logit);
+    emit(line, userdata);
+    free(logits);
+
+    if (!ref_name || !other_name) {
+        return;
+    }
+    /* per-token latency over the same positions again */
+    start = ps3_time_us();
+    for (pos = 0; pos < steps; pos++) {
+        forward(reference, 1, pos);
+    }
+    ref_us = ps3_time_us() - start;
+    start = ps3_time_us();
+    for (pos = 0; pos < steps; pos++) {
+        forward(other, 1, pos);
+    }
+    other_us = ps3_time_us() - start;
+    snprintf(line, sizeof(line), "\nper token: %.2f ms %s, %.2f ms %s (%.2fx)",
+             ref_us / (1000.0 * steps), ref_name, other_us / (1000.0 * steps), other_name,
+             other_us > 0 ? ref_us / (double)other_us : 0.0);
+    emit(line, userdata);
+}
+
+void bench_embedding_q8(Transformer* reference, Transformer* quantized, EmitFn emit, void* userdata) {
+    Config* config = &reference->model.config;
+    int steps = config->seq_len < BENCH_Q8_STEPS ? config->seq_len : BENCH_Q8_STEPS;
+    Sampler ref_sampler, q8_sampler;
+    float* logits;
+    int ref_token = 1, q8_token = 1;
+    int same_sampled = 0, first_divergence = -1;
+    int pos, i, ref_next, q8_next;
+    uint64_t start, fp32_us, q8_us;
+    size_t fp32_bytes, q8_bytes;
+    char line[160];
+
+    logits = (float*)malloc(config->vocab_size * sizeof(float));
+    if (!logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* free-running generation from BOS, both sides drawing the same coins */
+    build_sampler(&ref_sampler, config->vocab_size, 1.0f, 0.9f, BENCH_Q8_SEED);
+    build_sampler(&q8_sampler, config->vocab_size, 1.0f, 0.9f, BENCH_Q8_SEED);
+    for (pos = 0; pos < steps; pos++) {
+        ref_next = sample(&ref_sampler, forward(reference, ref_token, pos));
+        q8_next = sample(&q8_sampler, forward(quantized, q8_token, pos));
+        if (ref_next == q8_next) {
+            same_sampled++;
+        } else if (first_divergence < 0) {
+            first_divergence = pos;
+        }
+        ref_token = ref_next;
+        q8_token = q8_next;
+    }
+    free_sampler(&ref_sampler);
+    free_sampler(&q8_sampler);
+
+    fp32_bytes = (size_t)config->vocab_size * config->dim * sizeof(float);
+    q8_bytes = (size_t)config->vocab_size * (config->dim + sizeof(float));
+    snprintf(line, sizeof(line), "\nint8 embedding table: %.1f MB vs %.1f MB fp32",
+             q8_bytes / (1024.0 * 1024.0), fp32_bytes / (1024.0 * 1024.0));
+    emit(line, userdata);
+    snprintf(line, sizeof(line), "\nfixed seed: %d/%d sampled tokens match, first divergence at %d",
+             same_sampled, steps, first_divergence);
+    emit(line, userdata);
+
+    compare_models(reference, quantized, steps, "teacher-forced", NULL, NULL, emit, userdata);
+
+    /* the classifier alone, on the last hidden state */
+    start = ps3_time_us();
+    for (i = 0; i < 8; i++) {
+        matmul(logits, reference->state.x, reference->model.weights.token_embedding_table, config->dim, config->vocab_size);
+    }
+    fp32_us = ps3_time_us() - start;
+    start = ps3_time_us();
+    for (i = 0; i < 8; i++) {
+        matmul_q8(logits, quantized->state.x, quantized->model.weights.token_embedding_q8,
+                  quantized->model.weights.token_embedding_scale, config->dim, config->vocab_size);
+    }
+    q8_us = ps3_time_us() - start;
+    snprintf(line, sizeof(line), "\nclassifier: %.2f ms fp32, %.2f ms int8 (%.2fx)",
+             fp32_us / 8000.0, q8_us / 8000.0, q8_us > 0 ? fp32_us / (double)q8_us : 0.0);
+    emit(line, userdata);
+
+    free(logits);
+}
+
+void bench_folded_norms(Transformer* reference, Transformer* folded, EmitFn emit, void* userdata) {
+    int seq_len = reference->model.config.seq_len;
+
+    compare_models(reference, folded, seq_len < BENCH_FOLD_STEPS ? seq_len : BENCH_FOLD_STEPS,
+                   "folded norms", "with norms", "folded", emit, userdata);
+}
+
+void bench_fp16(Transformer* reference, Transformer* half, EmitFn emit, void* userdata) {
+    int seq_len = reference->model.config.seq_len;
+
+    compare_models(reference, half, seq_len < BENCH_FP16_STEPS ? seq_len : BENCH_FP16_STEPS,
+                   "fp16 weights", "fp32", "fp16", emit, userdata);
+}
+
+/* Greedy decode from BOS for `steps` positions; returns the elapsed time */
+static uint64_t greedy_decode(Transformer* transformer, int steps, int* tokens) {
+    int vocab_size = transformer->model.config.vocab_size;
+    int token = 1, pos;
+    uint64_t start = ps3_time_us();
+
+    for (pos = 0; pos < steps; pos++) {
+        token = sample_argmax(forward(transformer, token, pos), vocab_size);
+        tokens[pos] = token;
+    }
+    return ps3_time_us() - start;
+}
+
+static const char* page_kind_name(const void* ptr) {
+    static const char* names[PAGE_KINDS] = { "heap", "64K", "1M" };
+    return ptr ? names[ps3_page_kind(ptr)] : "-";
+}
+
+void bench_large_pages(Transformer* small, Transformer* large, EmitFn emit, void* userdata) {
+    Model* m = &large->model;
+    int steps = m->config.seq_len < BENCH_PAGES_STEPS ? m->config.seq_len : BENCH_PAGES_STEPS;
+    int* small_tokens;
+    int* large_tokens;
+    MemStats mem;
+    uint64_t small_us, large_us;
+    int pos, same = 1;
+    char line[200];
+
+    small_tokens = (int*)malloc(steps * sizeof(int));
+    large_tokens = (int*)malloc(steps * sizeof(int));
+    if (!small_tokens || !large_tokens) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* once each to warm up, then timed */
+    greedy_decode(small, steps, small_tokens);
+    greedy_decode(large, steps, large_tokens);
+    small_us = greedy_decode(small, steps, small_tokens);
+    large_us = greedy_decode(large, steps, large_tokens);
+    for (pos = 0; pos < steps; pos++) {
+        if (small_tokens[pos] != large_tokens[pos]) {
+            same = 0;
+        }
+    }
+
+    ps3_mem_stats(&mem);
+    snprintf(line, sizeof(line), "\nlarge pages: weights fp32 %s, fp16 %s, q8 %s, KV %s (%.1f MB 1M, %.1f MB 64K, %.1f MB heap)",
+             page_kind_name(m->data), page_kind_name(m->data_f16), page_kind_name(m->data_q8),
+             page_kind_name(large->state.key_cache), mem.page_bytes[PAGES_1M] / 1048576.0,
+             mem.page_bytes[PAGES_64K] / 1048576.0, mem.page_bytes[PAGES_HEAP] / 1048576.0);
+    emit(line, userdata);
+    snprintf(line, sizeof(line), "\ndecode: %.2f tok/s 4K pages, %.2f tok/s large pages (%.2fx), tokens %s",
+             small_us > 0 ? steps * 1e6 / small_us : 0.0, large_us > 0 ? steps * 1e6 / large_us : 0.0,
+             large_us > 0 ? small_us / (double)large_us : 0.0, same ? "match" : "differ");
+    emit(line, userdata);
+
+    free(small_tokens);
+    free(large_tokens);
+}
+
+/* Max relative error of exp_fast against double precision exp over [lo, hi] */
+static double exp_fast_error(double lo, double hi) {
+    double worst = 0.0, x, ref, err;
+    int i;
+    for (i = 0; i <= BENCH_EXP_SAMPLES; i++) {
+        x = lo + (hi - lo) * i / BENCH_EXP_SAMPLES;
+        ref = exp((double)(float)x);
+        err = fabs(exp_fast((float)x) - ref) / ref;
+        if (err > worst) worst = err;
+    }
+    return worst;
+}
+
+/* Max relative error of the fast SiLU (as swiglu computes it) against double precision */
+static double silu_fast_error(double lo, double hi) {
+    double worst = 0.0, x, ref, err;
+    float v;
+    int i;
+    for (i = 0; i <= BENCH_EXP_SAMPLES; i++) {
+        x = (double)(float)(lo + (hi - lo) * i / BENCH_EXP_SAMPLES);
+        if (x == 0.0) continue;
+        ref = x / (1.0 + exp(-x));
+        v = (float)x;
+        v = v / (1.0f + exp_fast(v < -80.0f ? 80.0f : -v));
+        err = fabs(v - ref) / fabs(ref);
+        if (err > worst) worst = err;
+    }
+    return worst;
+}
+
+void bench_fast_exp(Transformer* transformer, EmitFn emit, void* userdata) {
+    Config* config = &transformer->model.config;
+    int steps = config->seq_len < BENCH_EXP_STEPS ? config->seq_len : BENCH_EXP_STEPS;
+    int saved = exp_mode;
+    ThreadPool* pool = transformer->state.pool;
+    Session fast;             /* a cache of its own for the fast passes */
+    ExpRange range;
+    double softmax_lo;
+    float* logits;
+    float* fast_logits;
+    float d, max_diff = 0.0f;
+    int token = 1, next, same_argmax = 0;
+    int pos, i;
+    uint64_t start, exact_us, fast_us;
+    char line[200];
+
+    logits = (float*)malloc(config->vocab_size * sizeof(float));
+    if (!logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* teacher-forced on the exact greedy continuation, recording the
+     * arguments the exponential gets (serially, the recording isn't thread safe) */
+    session_init(&fast, &transformer->model, NULL, 0.0f, 0.9f, 1ull);
+    transformer->state.pool = NULL;
+    exp_range_begin();
+    for (pos = 0; pos < steps; pos++) {
+        set_exp_mode(EXP_EXACT);
+        memcpy(logits, forward(transformer, token, pos), config->vocab_size * sizeof(float));
+        set_exp_mode(EXP_FAST);
+        fast_logits = model_forward(&transformer->model, &fast, token, pos);
+        for (i = 0; i < config->vocab_size; i++) {
+            d = logits[i] - fast_logits[i];
+            if (d < 0.0f) d = -d;
+            if (d > max_diff) max_diff = d;
+        }
+        next = sample_argmax(logits, config->vocab_size);
+        if (sample_argmax(fast_logits, config->vocab_size) == next) {
+            same_argmax++;
+        }
+        token = next;
+    }
+    exp_range_end(&range);
+    transformer->state.pool = pool;
+    session_free(&fast);
+
+    set_exp_mode(EXP_EXACT);
+    start = ps3_time_us();
+    for (pos = 0; pos < steps; pos++) {
+        forward(transformer, 1, pos);
+    }
+    exact_us = ps3_time_us() - start;
+    set_exp_mode(EXP_FAST);
+    start = ps3_time_us();
+    for (pos = 0; pos < steps; pos++) {
+        forward(transformer, 1, pos);
+    }
+    fast_us = ps3_time_us() - start;
+    set_exp_mode(saved);
+
+    snprintf(line, sizeof(line), "\nfast exp: %d/%d argmax match, max logit diff %.5f", same_argmax, steps, max_diff);
+    emit(line, userdata);
+    /* exp_fast clamps below -87, where the relative error stops meaning anything */
+    softmax_lo = range.softmax_min < -87.0f ? -87.0 : range.softmax_min;
+    snprintf(line, sizeof(line), "\nexp_fast max rel error %.2e on softmax args [%.1f, 0] (%.2e over [-87, 88]),"
+             " silu %.2e on [%.1f, %.1f]", exp_fast_error(softmax_lo, 0.0), softmax_lo, exp_fast_error(-87.0, 88.0),
+             silu_fast_error(range.silu_min, range.silu_max), range.silu_min, range.silu_max);
+    emit(line, userdata);
+    snprintf(line, sizeof(line), "\nper token: %.2f ms expf, %.2f ms exp_fast (%.2fx)",
+             exact_us / (1000.0 * steps), fast_us / (1000.0 * steps),
+             fast_us > 0 ? exact_us / (double)fast_us : 0.0);
+    emit(line, userdata);
+
+    free(logits);
+}
+
+/* ids of the k largest of n values, best first; k is small */
+static void top_k(const float* values, const int* ids, int n, int k, int* out) {
+    float best[BENCH_TOPK];
+    int filled = 0;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        if (filled == k && values[i] <= best[k - 1]) {
+            continue;
+        }
+        j = filled < k ? filled++ : k - 1;
+        while (j > 0 && best[j - 1] < values[i]) {
+            best[j] = best[j - 1];
+            out[j] = out[j - 1];
+            j--;
+        }
+        best[j] = values[i];
+        out[j] = ids ? ids[i] : i;
+    }
+}
+
+void bench_approx_classifier(Transformer* transformer, ApproxClassifier* ac, EmitFn emit, void* userdata) {
+    static const int probes[] = { 4, 8, 16, 32 };
+    Config* config = &transformer->model.config;
+    int steps = config->seq_len < BENCH_APPROX_STEPS ? config->seq_len : BENCH_APPROX_STEPS;
+    int saved_probe = ac->n_probe;
+    int exact_top[BENCH_TOPK], approx_top[BENCH_TOPK];
+    int* all_rows;
+    float* exact;
+    uint64_t start, exact_us, approx_us;
+    long long hits1, hits10, scored;
+    int p, pos, token, n, i, j;
+    char line[160];
+
+    all_rows = (int*)malloc(config->vocab_size * sizeof(int));
+    exact = (float*)malloc(config->vocab_size * sizeof(float));
+    if (!all_rows || !exact) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < config->vocab_size; i++) {
+        all_rows[i] = i;
+    }
+
+    snprintf(line, sizeof(line), "\nTwo-stage classifier, %d clusters, %d steps:", ac->n_clusters, steps);
+    emit(line, userdata);
+    for (p = 0; p < (int)(sizeof(probes) / sizeof(probes[0])) && probes[p] <= ac->n_clusters; p++) {
+        ac->n_probe = probes[p];
+        hits1 = hits10 = scored = 0;
+        exact_us = approx_us = 0;
+        token = 1;
+        for (pos = 0; pos < steps; pos++) {
+            /* only the classifiers are timed, both on the same hidden state */
+            forward_rows(transformer, token, pos, NULL, 0);
+            start = ps3_time_us();
+            classify_rows(transformer, all_rows, config->vocab_size);
+            exact_us += ps3_time_us() - start;
+            memcpy(exact, transformer->state.logits, config->vocab_size * sizeof(float));
+
+            start = ps3_time_us();
+            n = approx_classifier_candidates(ac, transformer);
+            classify_rows(transformer, ac->candidates, n);
+            approx_us += ps3_time_us() - start;
+            scored += n;
+
+            top_k(exact, NULL, config->vocab_size, BENCH_TOPK, exact_top);
+            top_k(transformer->state.logits, ac->candidates, n, n < BENCH_TOPK ? n : BENCH_TOPK, approx_top);
+            hits1 += n > 0 && approx_top[0] == exact_top[0];
+            for (i = 0; i < BENCH_TOPK && i < n; i++) {
+                for (j = 0; j < BENCH_TOPK; j++) {
+                    if (approx_top[i] == exact_top[j]) {
+                        hits10++;
+                        break;
+                    }
+                }
+            }
+            token = exact_top[0];  /* greedy continuation of the exact model */
+        }
+        snprintf(line, sizeof(line), "\nprobe %2d: recall@1 %.3f  recall@%d %.3f  rows %5lld  %.3f ms vs %.3f ms (%.2fx)",
+                 probes[p], hits1 / (double)steps, BENCH_TOPK, hits10 / (double)(steps * BENCH_TOPK),
+                 scored / steps, approx_us / (1000.0 * steps), exact_us / (1000.0 * steps),
+                 approx_us > 0 ? exact_us / (double)approx_us : 0.0);
+        emit(line, userdata);
+    }
+    ac->n_probe = saved_probe;
+
+    free(exact);
+    free(all_rows);
+}
+
+/* Forward BENCH_TILED_STEPS positions; returns the time and keeps the last logits */
+static uint64_t tiled_run(Transformer* transformer, float* logits) {
+    int steps = transformer->model.config.seq_len < BENCH_TILED_STEPS ? transformer->model.config.seq_len : BENCH_TILED_STEPS;
+    uint64_t start = ps3_time_us();
+    int pos;
+
+    for (pos = 0; pos < steps; pos++) {
+        forward(transformer, 3 + pos, pos);
+    }
+    memcpy(logits, transformer->state.logits, transformer->model.config.vocab_size * sizeof(float));
+    return ps3_time_us() - start;
+}
+
+void bench_tiled(Transformer* transformer, EmitFn emit, void* userdata) {
+    static const int tile_kb[] = { 16, 32, 64, 96 };
+    int steps = transformer->model.config.seq_len < BENCH_TILED_STEPS ? transformer->model.config.seq_len : BENCH_TILED_STEPS;
+    int vocab_size = transformer->model.config.vocab_size;
+    TiledEngine* saved = transformer->state.tiled;
+    TiledEngine* engine;
+    TiledStats stats;
+    float* reference;
+    float* logits;
+    float diff, max_diff;
+    uint64_t direct_us, us;
+    int k, buffering, i;
+    char line[160];
+
+    reference = (float*)malloc(vocab_size * sizeof(float));
+    logits = (float*)malloc(vocab_size * sizeof(float));
+    if (!reference || !logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    transformer->state.tiled = NULL;
+    direct_us = tiled_run(transformer, reference);
+    snprintf(line, sizeof(line), "\nTiled execution, %d KB local store: in place %.2f ms/token",
+             LOCAL_STORE_SIZE / 1024, direct_us / (1000.0 * steps));
+    emit(line, userdata);
+
+    for (buffering = 0; buffering < 2; buffering++) {
+        for (k = 0; k < (int)(sizeof(tile_kb) / sizeof(tile_kb[0])); k++) {
+            engine = tiled_engine_create(tile_kb[k] * 1024, buffering);
+            if (!engine) {
+                emit("\nError: could not start the copy thread", userdata);
+                continue;
+            }
+            transformer->state.tiled = engine;
+            us = tiled_run(transformer, logits);
+            tiled_stats(engine, &stats);
+            transformer->state.tiled = NULL;
+            tiled_engine_destroy(engine);
+
+            max_diff = 0.0f;
+            for (i = 0; i < vocab_size; i++) {
+                diff = logits[i] - reference[i];
+                if (diff < 0.0f) diff = -diff;
+                if (diff > max_diff) max_diff = diff;
+            }
+            snprintf(line, sizeof(line), "\n%s %3d KB: %.2f ms/token, %llu tiles/token, waiting %4.1f%%, diff %g",
+                     buffering ? "double" : "single", tile_kb[k], us / (1000.0 * steps),
+                     (unsigned long long)(stats.n_tiles / steps),
+                     stats.total_us > 0 ? 100.0 * stats.wait_us / stats.total_us : 0.0, max_diff);
+            emit(line, userdata);
+        }
+    }
+    transformer->state.tiled = saved;
+
+    free(logits);
+    free(reference);
+}
+
+static float max_abs_diff(const float* a, const float* b, int n) {
+    float diff, max_diff = 0.0f;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        diff = a[i] - b[i];
+        if (diff < 0.0f) diff = -diff;
+        if (diff > max_diff) max_diff = diff;
+    }
+    return max_diff;
+}
+
+/* Forward positions [0, steps) with the specialized pass on or off, best of
+ * BENCH_SPECIALIZED_ROUNDS; returns the time and keeps the last logits */
+static uint64_t specialized_run(Transformer* transformer, int specialized, int steps, float* logits) {
+    uint64_t start, us, best = 0;
+    int round, pos;
+
+    transformer->state.specialized = specialized;
+    for (round = 0; round < BENCH_SPECIALIZED_ROUNDS; round++) {
+        start = ps3_time_us();
+        for (pos = 0; pos < steps; pos++) {
+            forward(transformer, 3 + pos, pos);
+        }
+        us = ps3_time_us() - start;
+        if (round == 0 || us < best) {
+            best = us;
+        }
+    }
+    memcpy(logits, transformer->state.logits, transformer->model.config.vocab_size * sizeof(float));
+    return best;
+}
+
+void bench_specialized(Transformer* transformer, EmitFn emit, void* userdata) {
+    Config* config = &transformer->model.config;
+    int steps = config->seq_len < BENCH_SPECIALIZED_STEPS ? config->seq_len : BENCH_SPECIALIZED_STEPS;
+    int format = transformer->model.weights.wq_f16 ? GEMV_FP16 : GEMV_FP32;
+    int saved = transformer->state.specialized;
+    TiledEngine* tiled = transformer->state.tiled;
+    float* reference;
+    float* logits;
+    uint64_t generic_us, specialized_us;
+    char line[200];
+
+    if (!forward_has_specialization(config)) {
+        snprintf(line, sizeof(line), "\nNo specialized forward for %d/%d/%d/%d",
+                 config->dim, config->hidden_dim, config->n_heads, config->n_kv_heads);
+        emit(line, userdata);
+        return;
+    }
+    reference = (float*)malloc(config->vocab_size * sizeof(float));
+    logits = (float*)malloc(config->vocab_size * sizeof(float));
+    if (!reference || !logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the specialized passes read the weights in place */
+    transformer->state.tiled = NULL;
+    generic_us = specialized_run(transformer, 0, steps, reference);
+    specialized_us = specialized_run(transformer, 1, steps, logits);
+    transformer->state.specialized = saved;
+    transformer->state.tiled = tiled;
+
+    snprintf(line, sizeof(line), "\nSpecialized %d/%d/%d/%d forward (%s/%s kernels): %.2f ms/token vs %.2f ms generic"
+             " (%.2fx), diff %g", config->dim, config->hidden_dim, config->n_heads, config->n_kv_heads,
+             gemv_kernel_name(format, config->dim, config->dim),
+             gemv_kernel_name(format, config->dim, config->hidden_dim),
+             specialized_us / (1000.0 * steps), generic_us / (1000.0 * steps),
+             specialized_us > 0 ? generic_us / (double)specialized_us : 0.0,
+             max_abs_diff(logits, reference, config->vocab_size));
+    emit(line, userdata);
+
+    free(logits);
+    free(reference);
+}
+
+/* Decode positions [from, to) with the tokens tiled_run uses; the last logits go to logits */
+static uint64_t paged_run(Transformer* transformer, int from, int to, float* logits) {
+    uint64_t start = ps3_time_us();
+    int pos;
+
+    for (pos = from; pos < to; pos++) {
+        forward(transformer, 3 + pos, pos);
+    }
+    memcpy(logits, transformer->state.logits, transformer->model.config.vocab_size * sizeof(float));
+    return ps3_time_us() - start;
+}
+
+/* A paged RunState that borrows the transformer's workers and settings */
+static void paged_state(Transformer* transformer, RunState* s, KVPool* pool) {
+    malloc_run_state_shared(s, &transformer->model.config, pool, transformer->state.pool);
+    s->tiled = transformer->state.tiled;
+    s->specialized = transformer->state.specialized;
+}
+
+static void free_paged_state(RunState* s) {
+    s->pool = NULL;
+    s->tiled = NULL;
+    free_run_state(s);
+}
+
+void bench_paged_kv(Transformer* transformer, EmitFn emit, void* userdata) {
+    Config* config = &transformer->model.config;
+    int head_size = config->dim / config->n_heads;
+    int kv_dim = head_size * config->n_kv_heads;
+    int steps = config->seq_len < BENCH_PAGED_STEPS ? config->seq_len : BENCH_PAGED_STEPS;
+    int shared = steps / 2 + KV_BLOCK_SIZE / 2;  /* ends mid-block, so the fork copies one */
+    int seq_blocks = (steps + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    size_t full_bytes = 2 * (size_t)config->n_layers * config->seq_len * kv_dim * sizeof(float);
+    RunState contiguous = transformer->state;
+    RunState paged, forked;
+    KVPool* pool;
+    float* reference;
+    float* logits;
+    int* held;
+    uint64_t contiguous_us, paged_us;
+    unsigned long long rng = 1234ull;
+    int n_held, n_seqs, len, need, k, b, avg, lo;
+    char line[192];
+
+    reference = (float*)malloc(config->vocab_size * sizeof(float));
+    logits = (float*)malloc(config->vocab_size * sizeof(float));
+    if (!reference || !logits) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    if (shared >= steps) {
+        shared = steps / 2;
+    }
+
+    pool = kv_pool_create(config->n_layers, config->n_kv_heads, head_size, 2 * seq_blocks);
+    if (!pool) {
+        emit("\nError: could not allocate the KV pool", userdata);
+        free(logits);
+        free(reference);
+        return;
+    }
+    paged_state(transformer, &paged, pool);
+    paged_state(transformer, &forked, pool);
+
+    contiguous_us = paged_run(transformer, 0, steps, reference);
+    transformer->state = paged;
+    paged_us = paged_run(transformer, 0, steps, logits);
+    snprintf(line, sizeof(line), "\nPaged KV cache, %d positions per block: %.2f ms/token vs %.2f ms contiguous, diff %g",
+             KV_BLOCK_SIZE, paged_us / (1000.0 * steps), contiguous_us / (1000.0 * steps),
+             max_abs_diff(logits, reference, config->vocab_size));
+    emit(line, userdata);
+
+    /* a second sequence with the same first `shared` tokens only computes the rest */
+    kv_cache_share(&forked, &paged, shared);
+    transformer->state = forked;
+    paged_us = paged_run(transformer, shared, steps, logits);
+    snprintf(line, sizeof(line), "\nShared prefix of %d: %d of %d positions computed, %d blocks for both sequences "
+             "instead of %d, diff %g", shared, steps - shared, steps, kv_pool_peak_blocks(pool), 2 * seq_blocks,
+             max_abs_diff(logits, reference, config->vocab_size));
+    emit(line, userdata);
+    transformer->state = contiguous;
+    free_paged_state(&forked);
+    free_paged_state(&paged);
+    kv_pool_destroy(pool);
+
+    /* capacity: lengths uniform around avg within [1, seq_len], sequences admitted until the pool runs dry */
+    pool = kv_pool_create_bytes(config->n_layers, config->n_kv_heads, head_size, BENCH_KV_BUDGET);
+    if (!pool) {
+        emit("\nError: could not allocate the KV pool", userdata);
+        free(logits);
+        free(reference);
+        return;
+    }
+    held = (int*)malloc(kv_pool_total_blocks(pool) * sizeof(int));
+    if (!held) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(line, sizeof(line), "\nSequences in %d MB of KV cache, %d contiguous (%d positions each):",
+             BENCH_KV_BUDGET / (1024 * 1024), (int)(BENCH_KV_BUDGET / full_bytes), config->seq_len);
+    emit(line, userdata);
+    for (k = 8; k >= 1; k /= 2) {
+        avg = config->seq_len / k;
+        lo = 2 * avg - config->seq_len > 1 ? 2 * avg - config->seq_len : 1;
+        n_held = 0;
+        n_seqs = 0;
+        while (1) {
+            rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+            len = lo + (int)((rng >> 33) % (unsigned long long)(2 * (avg - lo) + 1));
+            need = (len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+            if (need > kv_pool_free_blocks(pool)) {
+                break;
+            }
+            for (b = 0; b < need; b++) {
+                held[n_held++] = kv_block_alloc(pool);
+            }
+            n_seqs++;
+        }
+        snprintf(line, sizeof(line), "\navg length %4d: %4d paged (%.2fx, max/avg %.2f)", avg, n_seqs,
+                 BENCH_KV_BUDGET / full_bytes > 0 ? n_seqs / (double)(BENCH_KV_BUDGET / full_bytes) : 0.0,
+                 config->seq_len / (double)avg);
+        emit(line, userdata);
+        for (b = 0; b < n_held; b++) {
+            kv_block_release(pool, held[b]);
+        }
+    }
+    free(held);
+    kv_pool_destroy(pool);
+    free(logits);
+    free(reference);
+}
+
+typedef struct {
+    Model* model;
+    Session session;
+    int steps;
+    int* tokens;             /* sampled continuation of BOS */
+} SessionJob;
+
+static void session_thread(void* arg) {
+    SessionJob* job = (SessionJob*)arg;
+    float* logits;
+    int pos, token = 1;
+
+    for (pos = 0; pos < job->steps; pos++) {
+        logits = model_forward(job->model, &job->session, token, pos);
+        token = sample(&job->session.sampler, logits);
+        job->tokens[pos] = token;
+    }
+}
+
+void bench_sessions(Transformer* transformer, EmitFn emit, void* userdata) {
+    Model* model = &transformer->model;
+    Config* config = &model->config;
+    int steps = config->seq_len < BENCH_SESSION_STEPS ? config->seq_len : BENCH_SESSION_STEPS;
+    int seq_blocks = (steps + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    SessionJob jobs[BENCH_MAX_SESSIONS];
+    sys_ppu_thread_t threads[BENCH_MAX_SESSIONS];
+    int* reference;
+    KVPool* pool;
+    SessionMemory mem;
+    uint64_t start, elapsed;
+    int n, i, started, mismatches;
+    char line[192];
+
+    pool = kv_pool_create(config->n_layers, config->n_kv_heads, config->dim / config->n_heads,
+                          BENCH_MAX_SESSIONS * seq_blocks);
+    reference = (int*)malloc(BENCH_MAX_SESSIONS * steps * sizeof(int));
+    if (!reference) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!pool) {
+        emit("\nError: could not allocate the KV pool", userdata);
+        free(reference);
+        return;
+    }
+    for (i = 0; i < BENCH_MAX_SESSIONS; i++) {
+        jobs[i].model = model;
+        jobs[i].steps = steps;
+        jobs[i].tokens = (int*)malloc(steps * sizeof(int));
+        if (!jobs[i].tokens) {
+            fprintf(stderr, "Failed to allocate benchmark buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* reference continuations, one session at a time on this thread */
+    for (i = 0; i < BENCH_MAX_SESSIONS; i++) {
+        session_init(&jobs[i].session, model, pool, 1.0f, 0.9f, 1000ull + i);
+        session_thread(&jobs[i]);
+        memcpy(reference + i * steps, jobs[i].tokens, steps * sizeof(int));
+        session_free(&jobs[i].session);
+    }
+
+    snprintf(line, sizeof(line), "\nSessions over one copy of the weights, %d tokens each:", steps);
+    emit(line, userdata);
+    for (n = 1; n <= BENCH_MAX_SESSIONS; n *= 2) {
+        for (i = 0; i < n; i++) {
+            session_init(&jobs[i].session, model, pool, 1.0f, 0.9f, 1000ull + i);
+        }
+        start = ps3_time_us();
+        started = 0;
+        for (i = 0; i < n; i++) {
+            if (!ps3_thread_create(&threads[i], session_thread, &jobs[i], "llama_session")) {
+                break;
+            }
+            started++;
+        }
+        /* whatever could not get a thread runs here */
+        for (i = started; i < n; i++) {
+            session_thread(&jobs[i]);
+        }
+        for (i = 0; i < started; i++) {
+            ps3_thread_join(threads[i]);
+        }
+        elapsed = ps3_time_us() - start;
+
+        mismatches = 0;
+        for (i = 0; i < n; i++) {
+            mismatches += memcmp(jobs[i].tokens, reference + i * steps, steps * sizeof(int)) != 0;
+        }
+        session_memory(model, &jobs[0].session, &mem);
+        snprintf(line, sizeof(line), "\n%d session%s: %.2f tok/s total, %d KB per session "
+                 "(%d activations, %d KV, %d sampler), %d differ from serial",
+                 n, n > 1 ? "s" : "", elapsed > 0 ? n * steps * 1000000.0 / elapsed : 0.0,
+                 (int)(mem.total / 1024), (int)(mem.activations / 1024), (int)(mem.kv_cache / 1024),
+                 (int)(mem.sampler / 1024), mismatches);
+        emit(line, userdata);
+        for (i = 0; i < n; i++) {
+            session_free(&jobs[i].session);
+        }
+    }
+
+    for (i = 0; i < BENCH_MAX_SESSIONS; i++) {
+        free(jobs[i].tokens);
+    }
+    kv_pool_destroy(pool);
+    free(reference);
+}
+
+static void discard_piece(const char* piece, void* userdata) {
+}
+
+/* Positions [0, steps) for every sequence, batched or one forward each; returns the time taken */
+static uint64_t batch_run(Transformer* transformer, RunState* seqs, int batch, int steps, int batched) {
+    Config* config = &transformer->model.config;
+    TransformerWeights* weights = &transformer->model.weights;
+    int tokens[BEAM_MAX_WIDTH];
+    int positions[BEAM_MAX_WIDTH];
+    uint64_t start;
+    int pos, b;
+
+    for (b = 0; b < batch; b++) {
+        kv_cache_reset(&seqs[b]);
+    }
+    start = ps3_time_us();
+    for (pos = 0; pos < steps; pos++) {
+        for (b = 0; b < batch; b++) {
+            tokens[b] = 3 + pos + 7 * b;
+            positions[b] = pos;
+        }
+        if (batched) {
+            forward_impl_batch(config, weights, seqs, tokens, positions, batch);
+        } else {
+            for (b = 0; b < batch; b++) {
+                forward_impl(config, weights, &seqs[b], tokens[b], pos);
+            }
+        }
+    }
+    return ps3_time_us() - start;
+}
+
+void bench_beam(Transformer* transformer, Tokenizer* tokenizer, EmitFn emit, void* userdata) {
+    Config* config = &transformer->model.config;
+    int steps = config->seq_len < BENCH_BEAM_STEPS ? config->seq_len : BENCH_BEAM_STEPS;
+    int seq_blocks = (steps + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    RunState seqs[BEAM_MAX_WIDTH];
+    KVPool* pool;
+    BeamStats stats;
+    float* reference;
+    uint64_t batched_us, separate_us;
+    float diff, max_diff;
+    int batch, b;
+    char line[192];
+
+    reference = (float*)malloc(BEAM_MAX_WIDTH * config->vocab_size * sizeof(float));
+    if (!reference) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    pool = kv_pool_create(config->n_layers, config->n_kv_heads, config->dim / config->n_heads,
+                          BEAM_MAX_WIDTH * seq_blocks);
+    if (!pool) {
+        emit("\nError: could not allocate the KV pool", userdata);
+        free(reference);
+        return;
+    }
+
+    emit("\nBatched decoding step against one forward per sequence:", userdata);
+    for (batch = 1; batch <= BEAM_MAX_WIDTH; batch *= 2) {
+        malloc_run_state_batch(seqs, config, pool, batch);
+        separate_us = batch_run(transformer, seqs, batch, steps, 0);
+        memcpy(reference, seqs[0].logits, batch * config->vocab_size * sizeof(float));
+        batched_us = batch_run(transformer, seqs, batch, steps, 1);
+        max_diff = 0.0f;
+        for (b = 0; b < batch; b++) {
+            diff = max_abs_diff(seqs[b].logits, reference + b * config->vocab_size, config->vocab_size);
+            if (diff > max_diff) {
+                max_diff = diff;
+            }
+        }
+        snprintf(line, sizeof(line), "\n%d sequences: %.2f ms/step batched vs %.2f ms separate (%.2fx), diff %g",
+                 batch, batched_us / (1000.0 * steps), separate_us / (1000.0 * steps),
+                 batched_us > 0 ? separate_us / (double)batched_us : 0.0, max_diff);
+        emit(line, userdata);
+        free_run_state_batch(seqs, batch);
+    }
+    kv_pool_destroy(pool);
+    free(reference);
+
+    if (beam_search(transformer, tokenizer, "Once upon a time", 2 * steps, BENCH_BEAM_WIDTH,
+                    discard_piece, NULL, &stats)) {
+        snprintf(line, sizeof(line), "\nBeam search, width %d: %d tokens, log-prob %.2f, %.2f ms/step, "
+                 "peak %d KV blocks (%d without sharing)", BENCH_BEAM_WIDTH, stats.n_generated, stats.score,
+                 stats.n_steps > 0 ? (stats.total_us - stats.prefill_us) / (1000.0 * stats.n_steps) : 0.0,
+                 stats.kv_blocks_peak, stats.kv_blocks_unshared);
+        emit(line, userdata);
+    }
+}
+
+typedef struct {
+    int vocab_size;
+    int steps;
+    int produced[BENCH_PIPELINE_SEQS];   /* tokens picked so far per sequence */
+    int* tokens;                         /* (BENCH_PIPELINE_SEQS, steps) */
+} PipelineBench;
+
+/* Greedy, so every strategy has to pick the same tokens */
+static int pipeline_next(void* userdata, int seq, float* logits) {
+    PipelineBench* b = (PipelineBench*)userdata;
+    int token = sample_argmax(logits, b->vocab_size);
+
+    b->tokens[seq * b->steps + b->produced[seq]] = token;
+    return ++b->produced[seq] < b->steps ? token : -1;
+}
+
+/* The same sequences one position at a time on this thread, round robin */
+static uint64_t round_robin_run(Model* model, Session* sessions, PipelineBench* b) {
+    int token[BENCH_PIPELINE_SEQS];
+    uint64_t start = ps3_time_us();
+    int pos, i;
+
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        token[i] = 1;
+    }
+    for (pos = 0; pos < b->steps; pos++) {
+        for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+            token[i] = pipeline_next(b, i, model_forward(model, &sessions[i], token[i], pos));
+        }
+    }
+    return ps3_time_us() - start;
+}
+
+void bench_pipeline(Transformer* transformer, EmitFn emit, void* userdata) {
+    Model* model = &transformer->model;
+    Config* config = &model->config;
+    Session sessions[BENCH_PIPELINE_SEQS];
+    int start_tokens[BENCH_PIPELINE_SEQS];
+    int start_pos[BENCH_PIPELINE_SEQS];
+    PipelineBench b;
+    PipelineStats stats;
+    KVPool* pool;
+    int* reference;
+    uint64_t serial_us, split_us;
+    int n_stages, i, s;
+    size_t bytes;
+    char line[256];
+    char range[48];
+    int pos;
+
+    memset(&b, 0, sizeof(b));
+    b.vocab_size = config->vocab_size;
+    b.steps = config->seq_len < BENCH_PIPELINE_STEPS ? config->seq_len : BENCH_PIPELINE_STEPS;
+    bytes = BENCH_PIPELINE_SEQS * b.steps * sizeof(int);
+    b.tokens = (int*)malloc(bytes);
+    reference = (int*)malloc(bytes);
+    if (!b.tokens || !reference) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    pool = kv_pool_create(config->n_layers, config->n_kv_heads, config->dim / config->n_heads,
+                          BENCH_PIPELINE_SEQS * ((b.steps + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE));
+    if (!pool) {
+        emit("\nError: could not allocate the KV pool", userdata);
+        free(reference);
+        free(b.tokens);
+        return;
+    }
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        session_init(&sessions[i], model, pool, 0.0f, 0.9f, 1ull);
+        start_tokens[i] = 1;
+        start_pos[i] = 0;
+    }
+
+    snprintf(line, sizeof(line), "\n%d sequences of %d tokens, greedy:", BENCH_PIPELINE_SEQS, b.steps);
+    emit(line, userdata);
+
+    /* one thread, after an untimed pass to fault in the weights and caches */
+    round_robin_run(model, sessions, &b);
+    memset(b.produced, 0, sizeof(b.produced));
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        kv_cache_reset(&sessions[i].state);
+    }
+    serial_us = round_robin_run(model, sessions, &b);
+    memcpy(reference, b.tokens, bytes);
+    snprintf(line, sizeof(line), "\nserial: %.2f tok/s", BENCH_PIPELINE_SEQS * b.steps * 1e6 / serial_us);
+    emit(line, userdata);
+
+    /* every matmul and attention split across the transformer's workers */
+    memset(b.produced, 0, sizeof(b.produced));
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        kv_cache_reset(&sessions[i].state);
+        sessions[i].state.pool = transformer->state.pool;
+        sessions[i].state.row_split = 1;
+    }
+    split_us = round_robin_run(model, sessions, &b);
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        sessions[i].state.pool = NULL;
+        sessions[i].state.row_split = 0;
+    }
+    snprintf(line, sizeof(line), "\nrow split over %d threads: %.2f tok/s (%.2fx serial)%s",
+             thread_pool_size(transformer->state.pool), BENCH_PIPELINE_SEQS * b.steps * 1e6 / split_us,
+             split_us > 0 ? serial_us / (double)split_us : 0.0,
+             memcmp(b.tokens, reference, bytes) ? ", tokens differ" : "");
+    emit(line, userdata);
+
+    /* the layers cut into stages, sequences flowing through them */
+    for (n_stages = 2; n_stages <= PIPELINE_MAX_STAGES; n_stages++) {
+        memset(b.produced, 0, sizeof(b.produced));
+        for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+            kv_cache_reset(&sessions[i].state);
+        }
+        if (!pipeline_run(model, sessions, BENCH_PIPELINE_SEQS, start_tokens, start_pos, n_stages,
+                          pipeline_next, &b, &stats)) {
+            emit("\nError: could not start the pipeline stages", userdata);
+            break;
+        }
+        if (stats.n_stages < n_stages) {
+            break;  /* fewer layers than stages */
+        }
+        pos = snprintf(line, sizeof(line), "\n%d-stage pipeline: %.2f tok/s (%.2fx serial, %.2fx row split)%s:",
+                       stats.n_stages, stats.n_tokens * 1e6 / stats.total_us,
+                       stats.total_us > 0 ? serial_us / (double)stats.total_us : 0.0,
+                       stats.total_us > 0 ? split_us / (double)stats.total_us : 0.0,
+                       memcmp(b.tokens, reference, bytes) ? ", tokens differ" : "");
+        for (s = 0; s < stats.n_stages && pos < (int)sizeof(line); s++) {
+            if (stats.first_layer[s] < stats.first_layer[s + 1]) {
+                snprintf(range, sizeof(range), "layers %d-%d%s", stats.first_layer[s], stats.first_layer[s + 1] - 1,
+                         s == stats.n_stages - 1 ? " +cls" : "");
+            } else {
+                snprintf(range, sizeof(range), "cls");
+            }
+            pos += snprintf(line + pos, sizeof(line) - pos, " [%s %d%% busy]", range,
+                            (int)(100 * stats.busy_us[s] / (stats.total_us > 0 ? stats.total_us : 1)));
+        }
+        emit(line, userdata);
+    }
+
+    for (i = 0; i < BENCH_PIPELINE_SEQS; i++) {
+        session_free(&sessions[i]);
+    }
+    kv_pool_destroy(pool);
+    free(reference);
+    free(b.tokens);
+}
+
+/* Greedy generate() from the bench prompt; returns ms/token and how many tokens were sampled */
+static double constraint_run(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler, int steps,
+                             const Constraint* constraint, int* n_generated) {
+    GenerateStats stats;
+
+    if (!generate(transformer, tokenizer, sampler, "Once upon a time", steps, constraint, NULL,
+                  discard_piece, NULL, &stats) || stats.n_generated == 0) {
+        *n_generated = 0;
+        return 0.0;
+    }
+    *n_generated = stats.n_generated;
+    return stats.total_us / (1000.0 * (stats.n_prompt_tokens - 1 + stats.n_generated));
+}
+
+void bench_constraint(Transformer* transformer, Tokenizer* tokenizer, EmitFn emit, void* userdata) {
+    static const char* words[] = {
+        "the", "a", "and", "was", "he", "she", "they", "to", "with", "in", "on", "big", "little",
+        "happy", "sad", "dog", "cat", "girl", "boy", "tree", "ball", "play", "played", "saw", "said",
+        "day", "friend", "friends", "very", "it", "is", "had", "went", "park", "sun", ".", ",", "!"
+    };
+    Config* config = &transformer->model.config;
+    int steps = config->seq_len < BENCH_CONSTRAINT_STEPS ? config->seq_len : BENCH_CONSTRAINT_STEPS;
+    Constraint constraint;
+    Sampler sampler;
+    int* all_rows;
+    uint64_t start, full_us, allowed_us;
+    double free_ms, constrained_ms;
+    int free_n, constrained_n;
+    int pos, token, i;
+    char line[160];
+
+    all_rows = (int*)malloc(config->vocab_size * sizeof(int));
+    if (!all_rows) {
+        fprintf(stderr, "Failed to allocate benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < config->vocab_size; i++) {
+        all_rows[i] = i;
+    }
+    constraint_init(&constraint, config->vocab_size);
+    constraint_set_words(&constraint, tokenizer, words, sizeof(words) / sizeof(words[0]));
+    build_sampler(&sampler, config->vocab_size, 0.0f, 0.9f, BENCH_Q8_SEED);
+
+    /* the classifier alone, both on the same hidden state */
+    full_us = allowed_us = 0;
+    token = 1;
+    for (pos = 0; pos < steps; pos++) {
+        forward_rows(transformer, token, pos, NULL, 0);
+        start = ps3_time_us();
+        classify_rows(transformer, all_rows, config->vocab_size);
+        full_us += ps3_time_us() - start;
+        start = ps3_time_us();
+        classify_rows(transformer, constraint.allowed, constraint.n_allowed);
+        allowed_us += ps3_time_us() - start;
+        token = sample_sparse(&sampler, transformer->state.logits, constraint.allowed, constraint.n_allowed);
+        if (token == 2) {
+            token = 1;
+        }
+    }
+
+    /* whole tokens through generate(), with and without the constraint */
+    free_ms = constraint_run(transformer, tokenizer, &sampler, steps, NULL, &free_n);
+    constrained_ms = constraint_run(transformer, tokenizer, &sampler, steps, &constraint, &constrained_n);
+
+    snprintf(line, sizeof(line), "\nConstrained decoding, %d of %d tokens allowed, %d steps:",
+             constraint.n_allowed, config->vocab_size, steps);
+    emit(line, userdata);
+    snprintf(line, sizeof(line), "\nclassifier: %.3f ms constrained vs %.3f ms full (%.2fx)",
+             allowed_us / (1000.0 * steps), full_us / (1000.0 * steps),
+             allowed_us > 0 ? full_us / (double)allowed_us : 0.0);
+    emit(line, userdata);
+    snprintf(line, sizeof(line), "\ngenerate: %.2f ms/token constrained (%d tokens) vs %.2f ms unconstrained (%d tokens)",
+             constrained_ms, constrained_n, free_ms, free_n);
+    emit(line, userdata);
+
+    free_sampler(&sampler);
+    constraint_free(&constraint);
+    free(all_rows);
+}
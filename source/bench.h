@@ -0,0 +1,77 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "transformer.h"
+#include "generate.h"
+#include "approx_classifier.h"
+#include "tokenizer.h"
+
+/* Per-token forward latency against position, with attention run serially and
+ * across the worker pool. Report lines are passed to emit. */
+void bench_attention_scaling(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* Quality and speed of the int8 embedding/classifier table: `quantized` must be
+ * the same checkpoint as `reference` loaded with WEIGHTS_EMBEDDING_Q8. Compares
+ * fixed-seed sampled tokens, teacher-forced argmax agreement and classifier time. */
+void bench_embedding_q8(Transformer* reference, Transformer* quantized, EmitFn emit, void* userdata);
+
+/* Norm weights folded into the matrices: `folded` must be the same checkpoint
+ * and format as `reference` loaded with WEIGHTS_FOLD_NORMS. Compares
+ * teacher-forced logits and argmax, and per-token latency. */
+void bench_folded_norms(Transformer* reference, Transformer* folded, EmitFn emit, void* userdata);
+
+/* fp16 weight storage against fp32: `half` must be the same checkpoint as
+ * `reference` loaded with WEIGHTS_FP16 instead of WEIGHTS_FP32. Compares
+ * teacher-forced logits and argmax, and per-token latency. */
+void bench_fp16(Transformer* reference, Transformer* half, EmitFn emit, void* userdata);
+
+/* Decode speed with the weights and KV cache on large pages: `small` must be
+ * the same checkpoint and format as `large`, loaded with large pages off.
+ * Reports tok/s for both, whether the greedy tokens match and which pages
+ * each buffer landed on. */
+void bench_large_pages(Transformer* small, Transformer* large, EmitFn emit, void* userdata);
+
+/* exp_fast against expf on the whole model: teacher-forced logits and argmax
+ * agreement, the relative error over the range of arguments those passes gave
+ * the exponential, and per-token latency in both modes */
+void bench_fast_exp(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* Two-stage classifier against the exact one along a greedy continuation:
+ * top-1/top-10 recall and classifier time for a few n_probe settings */
+void bench_approx_classifier(Transformer* transformer, ApproxClassifier* ac, EmitFn emit, void* userdata);
+
+/* Decoding restricted to a small word list against the full vocabulary: the
+ * classifier time per token for both row sets, then ms/token through
+ * generate() with and without the constraint */
+void bench_constraint(Transformer* transformer, Tokenizer* tokenizer, EmitFn emit, void* userdata);
+
+/* Per-token latency with the weights read in place against the tiled engine at
+ * a few tile sizes, single and double buffered, with the time spent waiting on
+ * transfers and a check that the logits are unchanged */
+void bench_tiled(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* Per-token latency of the compile-time specialized forward pass for this
+ * model's shape against the generic one, with a check that the logits match */
+void bench_specialized(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* Paged KV cache against the contiguous one: per-token latency and a logits
+ * check, a second sequence that shares the first one's prefix blocks, and how
+ * many sequences of a few average lengths fit in the same KV budget */
+void bench_paged_kv(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* Up to four sessions decoding at once on their own threads against one Model:
+ * total tok/s, each session's memory, and a check that every session samples
+ * the same tokens as when it runs alone */
+void bench_sessions(Transformer* transformer, EmitFn emit, void* userdata);
+
+/* A batched decoding step for 1-8 sequences against one forward per sequence,
+ * with a check that the logits match, then a beam search with its KV block
+ * use against what the beams would need without sharing */
+void bench_beam(Transformer* transformer, Tokenizer* tokenizer, EmitFn emit, void* userdata);
+
+/* Steady-state decode throughput for a few greedy sequences: one thread,
+ * every matmul split by rows over the worker pool, and the layer pipeline at
+ * 2-4 stages with each stage's layers and utilization */
+void bench_pipeline(Transformer* transformer, EmitFn emit, void* userdata);
+
+#endif /* __BENCH_H__ */
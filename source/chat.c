@@ -0,0 +1,149 @@
+#include "chat.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void chat_session_init(ChatSession* s, Transformer* transformer, Tokenizer* tokenizer,
+                       Sampler* sampler, const char* system_prompt) {
+    memset(s, 0, sizeof(ChatSession));
+    s->transformer = transformer;
+    s->tokenizer = tokenizer;
+    s->sampler = sampler;
+    s->system_prompt = system_prompt;
+    chat_session_reset(s);
+}
+
+void chat_session_free(ChatSession* s) {
+    memset(s, 0, sizeof(ChatSession));
+}
+
+void chat_session_reset(ChatSession* s) {
+    s->pos = 0;
+    s->n_keep = 1; /* the BOS of the first turn */
+    s->pending_token = -1;
+    s->n_turns = 0;
+}
+
+/* Make room for `needed` more positions. Rather than re-prefilling a truncated
+ * transcript we drop the oldest half of the discardable history in one shift,
+ * which costs a single pass over the cache and keeps per-token latency flat. */
+static int ensure_room(ChatSession* s, int needed) {
+    int seq_len = s->transformer->model.config.seq_len;
+    int n_discard;
+
+    if (s->pos + needed <= seq_len) {
+        return 0;
+    }
+    n_discard = (s->pos - s->n_keep) / 2;
+    if (s->pos - n_discard + needed > seq_len) {
+        n_discard = s->pos + needed - seq_len;
+    }
+    if (n_discard > s->pos - s->n_keep) {
+        n_discard = s->pos - s->n_keep;
+    }
+    kv_cache_shift(&s->transformer->model.config, &s->transformer->state, s->n_keep, n_discard, s->pos);
+    s->pos -= n_discard;
+    return n_discard;
+}
+
+void chat_session_turn(ChatSession* s, const char* user_text, int max_reply,
+                       EmitFn emit, void* userdata, ChatTurnStats* stats) {
+    int seq_len = s->transformer->model.config.seq_len;
+    char* text;
+    int* tokens;
+    int n_tokens = 0;
+    int n_new;
+    int first = 0;
+    int token;
+    int next;
+    int i;
+    float* logits;
+    uint64_t start;
+
+    memset(stats, 0, sizeof(ChatTurnStats));
+
+    /* llama2 chat template, the system prompt only rides along with the first turn */
+    text = (char*)ps3_malloc(strlen(user_text) + (s->system_prompt ? strlen(s->system_prompt) : 0) + 64);
+    if (!text) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (s->n_turns == 0 && s->system_prompt && s->system_prompt[0] != '\0') {
+        sprintf(text, "[INST] <<SYS>>\n%s\n<</SYS>>\n\n%s [/INST]", s->system_prompt, user_text);
+    } else {
+        sprintf(text, "[INST] %s [/INST]", user_text);
+    }
+
+    /* encode writes at most strlen + 3 tokens, plus the pending one */
+    tokens = (int*)ps3_malloc((strlen(text) + 4) * sizeof(int));
+    if (!tokens) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the token sampled last turn (usually EOS) was never fed, so it leads this turn */
+    if (s->pending_token >= 0) {
+        tokens[n_tokens++] = s->pending_token;
+        first = 1;
+    }
+    encode(s->tokenizer, text, 1, 0, tokens + first, &n_new);
+    n_tokens += n_new;
+    ps3_free(text);
+
+    /* never let a turn plus some reply room exceed the context, keep its tail */
+    if (n_tokens > seq_len / 2) {
+        memmove(tokens, tokens + n_tokens - seq_len / 2, (seq_len / 2) * sizeof(int));
+        n_tokens = seq_len / 2;
+    }
+
+    stats->n_shifted += ensure_room(s, n_tokens);
+    if (s->n_turns == 0 && s->system_prompt && s->system_prompt[0] != '\0') {
+        /* protect the system prompt from being shifted out */
+        s->n_keep = n_tokens < seq_len / 4 ? n_tokens : seq_len / 4;
+    }
+
+    /* prefill only the new tokens, appended at the current position */
+    start = ps3_time_us();
+    for (i = 0; i < n_tokens - 1; i++) {
+        /* only the last prompt token's logits are needed */
+        forward_rows(s->transformer, tokens[i], s->pos, NULL, 0);
+        s->pos++;
+    }
+    logits = forward(s->transformer, tokens[n_tokens - 1], s->pos);
+    s->pos++;
+    stats->n_prompt_tokens = n_tokens;
+    stats->prefill_us = ps3_time_us() - start;
+
+    /* generate the reply */
+    start = ps3_time_us();
+    token = tokens[n_tokens - 1];
+    s->pending_token = -1;
+    ps3_free(tokens);
+    ps3_mem_hot_begin();
+    while (stats->n_reply_tokens < max_reply) {
+        next = sample(s->sampler, logits);
+        stats->n_reply_tokens++;
+
+        if (next == 1 || next == 2) {  /* BOS or EOS ends the reply */
+            s->pending_token = next;
+            break;
+        }
+        emit(decode(s->tokenizer, token, next), userdata);
+
+        if (stats->n_reply_tokens == max_reply) {
+            /* out of budget: feed it with the next turn */
+            s->pending_token = next;
+            break;
+        }
+        stats->n_shifted += ensure_room(s, 1);
+        logits = forward(s->transformer, next, s->pos);
+        s->pos++;
+        token = next;
+    }
+    ps3_mem_hot_end();
+    stats->reply_us = ps3_time_us() - start;
+    s->n_turns++;
+}
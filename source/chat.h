@@ -0,0 +1,43 @@
+#ifndef __CHAT_H__
+#define __CHAT_H__
+
+#include <stdint.h>
+#include "transformer.h"
+#include "tokenizer.h"
+#include "sampler.h"
+#include "generate.h"
+
+/* Timing for one turn, prefill and reply reported separately */
+typedef struct {
+    int n_prompt_tokens;   /* new tokens fed for this turn only */
+    int n_reply_tokens;    /* tokens sampled for the reply */
+    int n_shifted;         /* cache positions discarded to make room */
+    uint64_t prefill_us;
+    uint64_t reply_us;
+} ChatTurnStats;
+
+/* A conversation that keeps the transformer's KV cache alive between turns.
+ * Each turn only encodes and prefills the new user text at the current pos. */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    Sampler* sampler;
+    const char* system_prompt; /* optional, sent with the first turn */
+    int pos;            /* next free position in the KV cache */
+    int n_keep;         /* leading positions never discarded when the context fills */
+    int pending_token;  /* last sampled token not yet fed to the model, -1 if none */
+    int n_turns;
+} ChatSession;
+
+void chat_session_init(ChatSession* s, Transformer* transformer, Tokenizer* tokenizer,
+                       Sampler* sampler, const char* system_prompt);
+void chat_session_free(ChatSession* s);
+
+/* Start over with an empty conversation; the cache is simply overwritten */
+void chat_session_reset(ChatSession* s);
+
+/* Feed one user turn and generate up to max_reply tokens of answer */
+void chat_session_turn(ChatSession* s, const char* user_text, int max_reply,
+                       EmitFn emit, void* userdata, ChatTurnStats* stats);
+
+#endif /* __CHAT_H__ */
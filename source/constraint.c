@@ -0,0 +1,80 @@
+#include "constraint.h"
+#include "memory_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void constraint_init(Constraint* c, int vocab_size) {
+    c->vocab_size = vocab_size;
+    c->allowed = (int*)ps3_malloc(vocab_size * sizeof(int));
+    c->n_allowed = 0;
+    if (!c->allowed) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void constraint_free(Constraint* c) {
+    if (c->allowed) ps3_free(c->allowed);
+    memset(c, 0, sizeof(Constraint));
+}
+
+void constraint_set_mask(Constraint* c, const unsigned char* mask) {
+    int i;
+    c->n_allowed = 0;
+    for (i = 0; i < c->vocab_size; i++) {
+        if (mask[i]) {
+            c->allowed[c->n_allowed++] = i;
+        }
+    }
+}
+
+void constraint_set_tokens(Constraint* c, const int* tokens, int n_tokens) {
+    unsigned char* mask = (unsigned char*)ps3_malloc(c->vocab_size);
+    int i;
+
+    if (!mask) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(mask, 0, c->vocab_size);
+    for (i = 0; i < n_tokens; i++) {
+        if (tokens[i] >= 0 && tokens[i] < c->vocab_size) {
+            mask[tokens[i]] = 1;
+        }
+    }
+    constraint_set_mask(c, mask);
+    ps3_free(mask);
+}
+
+void constraint_set_words(Constraint* c, Tokenizer* tokenizer, const char** words, int n_words) {
+    unsigned char* mask = (unsigned char*)ps3_malloc(c->vocab_size);
+    int* tokens;
+    size_t max_len = 0;
+    int n_tokens;
+    int i, j;
+
+    for (i = 0; i < n_words; i++) {
+        if (strlen(words[i]) > max_len) max_len = strlen(words[i]);
+    }
+    /* encode writes at most strlen + 3 tokens */
+    tokens = (int*)ps3_malloc((max_len + 3) * sizeof(int));
+    if (!mask || !tokens) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(mask, 0, c->vocab_size);
+
+    /* encode's dummy prefix gives us the space-led form used mid-sentence */
+    for (i = 0; i < n_words; i++) {
+        encode(tokenizer, (char*)words[i], 0, 0, tokens, &n_tokens);
+        for (j = 0; j < n_tokens; j++) {
+            mask[tokens[j]] = 1;
+        }
+    }
+    mask[2] = 1; /* EOS */
+
+    constraint_set_mask(c, mask);
+    ps3_free(tokens);
+    ps3_free(mask);
+}
@@ -0,0 +1,29 @@
+#ifndef __CONSTRAINT_H__
+#define __CONSTRAINT_H__
+
+#include "tokenizer.h"
+
+/* Restricts decoding to an allowed set of token ids. Only those rows of the
+ * classifier are evaluated and the sampler only sees those candidates, so the
+ * cost of both drops with the size of the set. The set may be changed between
+ * steps, e.g. by a caller-side grammar. */
+typedef struct {
+    int vocab_size;
+    int* allowed;   /* allowed token ids, ascending (vocab_size,) capacity */
+    int n_allowed;
+} Constraint;
+
+void constraint_init(Constraint* c, int vocab_size);
+void constraint_free(Constraint* c);
+
+/* Replace the allowed set with every id whose mask byte is non-zero */
+void constraint_set_mask(Constraint* c, const unsigned char* mask);
+
+/* Replace the allowed set with an explicit list (duplicates are dropped) */
+void constraint_set_tokens(Constraint* c, const int* tokens, int n_tokens);
+
+/* Allow every token that appears in the encoding of the given words (in their
+ * space-led, mid-sentence form) plus EOS so generation can stop */
+void constraint_set_words(Constraint* c, Tokenizer* tokenizer, const char** words, int n_words);
+
+#endif /* __CONSTRAINT_H__ */
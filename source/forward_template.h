@@ -0,0 +1,146 @@
+/* Body of the per-token layer loop, instantiated by math_utils.c once as the
+ * generic forward pass and once per known model shape. No include guard: the
+ * includer defines these and the template undefines them again.
+ *
+ *   FWD_NAME                     function name
+ *   FWD_ATTRS                    extra function attributes
+ *   FWD_DIM, FWD_HIDDEN,
+ *   FWD_N_HEADS, FWD_N_KV_HEADS  sizes, constants or expressions on config
+ *   FWD_MATMUL(xout, x, w32, w16, offset, n, d)
+ *   FWD_MATMUL_RESIDUAL(xout, x, w32, w16, offset, n, d)
+ *                                xout += W @ x, returning the sum of squares of the new xout
+ *   FWD_SUM_SQUARES(x, size)
+ *   FWD_RMSNORM_SCALED(o, x, weight, scale, size)
+ *
+ * Layers [l_begin, l_end) of one position. The first layer starts from the
+ * token's embedding and the last one ends with the final rmsnorm, leaving the
+ * normalized state in x; in between x carries the residual stream.
+ *
+ * The output projections wo and w2 accumulate straight into x and hand back
+ * its sum of squares, so the residual add and the first pass of the following
+ * norm happen in the matmul's epilogue; only the scaling pass of each norm is
+ * left (the summation order is unchanged, and so are the results).
+ *
+ * With weights->norms_folded the attention and ffn norm weights are already
+ * in the columns of wq/wk/wv and w1/w3, so those matmuls read x directly and
+ * the 1/rms scalar is applied in the passes that follow them anyway: the q
+ * scaling, the key/value store and the SwiGLU. Unfolded weights get a scalar
+ * of exactly 1 there, which leaves their results unchanged. */
+static FWD_ATTRS void FWD_NAME(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                               int l_begin, int l_end) {
+    /* a few convenience variables */
+    float *x = state->x;
+    const int dim = FWD_DIM;
+    const int kv_dim = (FWD_DIM * FWD_N_KV_HEADS) / FWD_N_HEADS;
+    const int hidden_dim = FWD_HIDDEN;
+    const int head_size = FWD_DIM / FWD_N_HEADS;
+    float q_scale = 1.0f / sqrtf(head_size);
+    float ss;          /* sum of squares of x, for the next norm */
+    float norm_scale;  /* 1/rms of x when the norm weights are folded, else 1 */
+    float* xn;         /* input of the matmuls after a norm */
+    const float* rope = weights->rope + (size_t)pos * head_size;
+    int l, g, i;
+
+    /* copy the token embedding into x */
+    if (l_begin == 0) {
+        embedding_row(weights, token, dim, x);
+    }
+    ss = FWD_SUM_SQUARES(x, dim);
+
+    /* forward the layers */
+    for (l = l_begin; l < l_end; l++) {
+        /* attention rmsnorm */
+        if (weights->norms_folded) {
+            norm_scale = rms_scale_ss(ss, dim);
+            xn = x;
+        } else {
+            FWD_RMSNORM_SCALED(state->xb, x, weights->rms_att_weight + l*dim, rms_scale_ss(ss, dim), dim);
+            norm_scale = 1.0f;
+            xn = state->xb;
+        }
+
+        /* qkv matmuls for this position */
+        FWD_MATMUL(state->q, xn, weights->wq, weights->wq_f16, (size_t)l*dim*dim, dim, dim);
+        FWD_MATMUL(state->k, xn, weights->wk, weights->wk_f16, (size_t)l*dim*kv_dim, dim, kv_dim);
+        FWD_MATMUL(state->v, xn, weights->wv, weights->wv_f16, (size_t)l*dim*kv_dim, dim, kv_dim);
+
+        /* RoPE relative positional encoding: complex-valued rotate q and k in each head */
+        for (i = 0; i < dim; i+=2) {
+            int head_dim = i % head_size;
+            float fcr = rope[head_dim];
+            float fci = rope[head_dim + 1];
+            int rotn = i < kv_dim ? 2 : 1; /* how many vectors? 2 = q & k, 1 = q only */
+            int v;
+            for (v = 0; v < rotn; v++) {
+                float* vec = (v == 0) ? state->q : state->k;
+                float v0 = vec[i];
+                float v1 = vec[i+1];
+                vec[i]   = v0 * fcr - v1 * fci;
+                vec[i+1] = v0 * fci + v1 * fcr;
+            }
+        }
+
+        /* fold the 1/sqrt(head_size) score scaling into q once */
+        for (i = 0; i < dim; i++) {
+            state->q[i] *= q_scale * norm_scale;
+        }
+
+        /* store key and value for this position, one head at a time */
+        for (g = 0; g < FWD_N_KV_HEADS; g++) {
+            if (weights->norms_folded) {
+                float* kr = kv_row(config, state, 0, l, g, pos);
+                float* vr = kv_row(config, state, 1, l, g, pos);
+                for (i = 0; i < head_size; i++) {
+                    kr[i] = state->k[g * head_size + i] * norm_scale;
+                    vr[i] = state->v[g * head_size + i] * norm_scale;
+                }
+            } else {
+                memcpy(kv_row(config, state, 0, l, g, pos), state->k + g * head_size, head_size * sizeof(float));
+                memcpy(kv_row(config, state, 1, l, g, pos), state->v + g * head_size, head_size * sizeof(float));
+            }
+        }
+
+        /* multihead attention, kv head groups (or slices of one) spread over the worker pool */
+        attention(config, state, l, pos);
+
+        /* final matmul to get the output of the attention, added into x */
+        ss = FWD_MATMUL_RESIDUAL(x, state->xb, weights->wo, weights->wo_f16, (size_t)l*dim*dim, dim, dim);
+
+        /* ffn rmsnorm */
+        if (weights->norms_folded) {
+            norm_scale = rms_scale_ss(ss, dim);
+            xn = x;
+        } else {
+            FWD_RMSNORM_SCALED(state->xb, x, weights->rms_ffn_weight + l*dim, rms_scale_ss(ss, dim), dim);
+            norm_scale = 1.0f;
+            xn = state->xb;
+        }
+
+        /* Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x)) */
+        FWD_MATMUL(state->hb, xn, weights->w1, weights->w1_f16, (size_t)l*dim*hidden_dim, dim, hidden_dim);
+        FWD_MATMUL(state->hb2, xn, weights->w3, weights->w3_f16, (size_t)l*dim*hidden_dim, dim, hidden_dim);
+
+        /* SwiGLU non-linearity */
+        swiglu(state->hb, state->hb2, norm_scale, hidden_dim);
+
+        /* final matmul to get the output of the ffn, added into x */
+        ss = FWD_MATMUL_RESIDUAL(x, state->hb, weights->w2, weights->w2_f16, (size_t)l*dim*hidden_dim,
+                                 hidden_dim, dim);
+    }
+
+    /* final rmsnorm */
+    if (l_end == config->n_layers) {
+        FWD_RMSNORM_SCALED(x, x, weights->rms_final_weight, rms_scale_ss(ss, dim), dim);
+    }
+}
+
+#undef FWD_NAME
+#undef FWD_ATTRS
+#undef FWD_DIM
+#undef FWD_HIDDEN
+#undef FWD_N_HEADS
+#undef FWD_N_KV_HEADS
+#undef FWD_MATMUL
+#undef FWD_MATMUL_RESIDUAL
+#undef FWD_SUM_SQUARES
+#undef FWD_RMSNORM_SCALED
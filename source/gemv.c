@@ -0,0 +1,357 @@
+#include "gemv.h"
+#include "gemv_kernel.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <ppu-lv2.h>
+#include <sys/file.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GEMV_TUNE_US 2000     /* each variant runs at least this long per measurement */
+#define GEMV_TUNE_ROUNDS 3    /* best of */
+#define GEMV_DEFAULT "r4"
+
+typedef void (*GemvKernel)(float* xout, const float* x, const void* w, int n, int d);
+typedef float (*GemvResidualKernel)(float* xout, const float* x, const void* w, int n, int d);
+
+/* Register-blocked kernels, one per row count of the template in
+ * gemv_kernel.h, with GEMV_LOAD redefined for every element type. Every
+ * kernel also comes as name_residual, the epilogue of an output projection:
+ * rows are added into xout instead of stored, and the sum of squares of the
+ * updated xout is accumulated on the way (rows in order, as rmsnorm would)
+ * and returned for the next norm */
+#define GEMV_KERNEL(name, ROWS) \
+static void name(float* xout, const float* x, const void* wv, int n, int d) { \
+    const WTYPE* w = (const WTYPE*)wv; \
+    int i, j; \
+    GEMV_LOOP(ROWS, GEMV_STORE) \
+} \
+static float name##_residual(float* xout, const float* x, const void* wv, int n, int d) { \
+    const WTYPE* w = (const WTYPE*)wv; \
+    float ss = 0.0f; \
+    int i, j; \
+    GEMV_LOOP(ROWS, GEMV_ADD) \
+    return ss; \
+}
+
+#define WTYPE float
+#define GEMV_LOAD(v) (v)
+GEMV_KERNEL(gemv_f32_r1, 1)
+GEMV_KERNEL(gemv_f32_r2, 2)
+GEMV_KERNEL(gemv_f32_r4, 4)
+GEMV_KERNEL(gemv_f32_r8, 8)
+#undef GEMV_LOAD
+#undef WTYPE
+
+#define WTYPE uint16_t
+#define GEMV_LOAD(v) fp16_to_fp32(v)
+GEMV_KERNEL(gemv_f16_r1, 1)
+GEMV_KERNEL(gemv_f16_r2, 2)
+GEMV_KERNEL(gemv_f16_r4, 4)
+GEMV_KERNEL(gemv_f16_r8, 8)
+#undef GEMV_LOAD
+#undef WTYPE
+
+/* Batched kernels: one weight row at a time against BATCH input vectors, so
+ * each weight is read and widened once per step however many sequences there
+ * are. BATCH is a literal in every instance, letting the compiler keep the
+ * accumulators in registers. Each output still sums in order j = 0..n-1. */
+#define GEMV_BATCH_KERNEL(name, BATCH) \
+static void name(float* xout, const float* x, const void* wv, int n, int d) { \
+    const WTYPE* w = (const WTYPE*)wv; \
+    float acc[BATCH]; \
+    int i, j, b; \
+    for (i = 0; i < d; i++) { \
+        const WTYPE* row = w + (size_t)i * n; \
+        for (b = 0; b < BATCH; b++) { \
+            acc[b] = 0.0f; \
+        } \
+        for (j = 0; j < n; j++) { \
+            float wj = GEMV_LOAD(row[j]); \
+            for (b = 0; b < BATCH; b++) { \
+                acc[b] += wj * x[(size_t)b * n + j]; \
+            } \
+        } \
+        for (b = 0; b < BATCH; b++) { \
+            xout[(size_t)b * d + i] = acc[b]; \
+        } \
+    } \
+}
+
+#define WTYPE float
+#define GEMV_LOAD(v) (v)
+GEMV_BATCH_KERNEL(gemv_f32_b2, 2)
+GEMV_BATCH_KERNEL(gemv_f32_b3, 3)
+GEMV_BATCH_KERNEL(gemv_f32_b4, 4)
+GEMV_BATCH_KERNEL(gemv_f32_b5, 5)
+GEMV_BATCH_KERNEL(gemv_f32_b6, 6)
+GEMV_BATCH_KERNEL(gemv_f32_b7, 7)
+GEMV_BATCH_KERNEL(gemv_f32_b8, 8)
+#undef GEMV_LOAD
+#undef WTYPE
+
+#define WTYPE uint16_t
+#define GEMV_LOAD(v) fp16_to_fp32(v)
+GEMV_BATCH_KERNEL(gemv_f16_b2, 2)
+GEMV_BATCH_KERNEL(gemv_f16_b3, 3)
+GEMV_BATCH_KERNEL(gemv_f16_b4, 4)
+GEMV_BATCH_KERNEL(gemv_f16_b5, 5)
+GEMV_BATCH_KERNEL(gemv_f16_b6, 6)
+GEMV_BATCH_KERNEL(gemv_f16_b7, 7)
+GEMV_BATCH_KERNEL(gemv_f16_b8, 8)
+#undef GEMV_LOAD
+#undef WTYPE
+
+/* Indexed by batch size; 0 and 1 are unused */
+static const GemvKernel gemv_batch_kernels[GEMV_MAX_BATCH + 1][GEMV_FORMATS] = {
+    { NULL, NULL },
+    { NULL, NULL },
+    { gemv_f32_b2, gemv_f16_b2 },
+    { gemv_f32_b3, gemv_f16_b3 },
+    { gemv_f32_b4, gemv_f16_b4 },
+    { gemv_f32_b5, gemv_f16_b5 },
+    { gemv_f32_b6, gemv_f16_b6 },
+    { gemv_f32_b7, gemv_f16_b7 },
+    { gemv_f32_b8, gemv_f16_b8 },
+};
+
+typedef struct {
+    const char* name;
+    int rows;
+    GemvKernel kernel[GEMV_FORMATS];
+    GemvResidualKernel residual[GEMV_FORMATS];
+} GemvVariant;
+
+#define GEMV_VARIANT(v, rows) \
+    { #v, rows, { gemv_f32_##v, gemv_f16_##v }, { gemv_f32_##v##_residual, gemv_f16_##v##_residual } }
+
+static const GemvVariant gemv_variants[] = {
+    GEMV_VARIANT(r1, 1),
+    GEMV_VARIANT(r2, 2),
+    GEMV_VARIANT(r4, 4),
+    GEMV_VARIANT(r8, 8),
+};
+#define GEMV_VARIANTS ((int)(sizeof(gemv_variants) / sizeof(gemv_variants[0])))
+
+/* Winners per shape. Written while tuning at startup, only read afterwards. */
+typedef struct {
+    int n;
+    int d;
+    int format;
+    int variant;
+} GemvTuning;
+
+static GemvTuning gemv_tuned[GEMV_MAX_SHAPES];
+static int gemv_n_tuned = 0;
+
+static int find_variant(const char* name) {
+    int v;
+    for (v = 0; v < GEMV_VARIANTS; v++) {
+        if (strcmp(gemv_variants[v].name, name) == 0) {
+            return v;
+        }
+    }
+    return -1;
+}
+
+static GemvTuning* find_tuning(int format, int n, int d) {
+    int i;
+    for (i = 0; i < gemv_n_tuned; i++) {
+        if (gemv_tuned[i].n == n && gemv_tuned[i].d == d && gemv_tuned[i].format == format) {
+            return &gemv_tuned[i];
+        }
+    }
+    return NULL;
+}
+
+static void set_tuning(int format, int n, int d, int variant) {
+    GemvTuning* t = find_tuning(format, n, d);
+    if (!t) {
+        if (gemv_n_tuned == GEMV_MAX_SHAPES) {
+            return;
+        }
+        t = &gemv_tuned[gemv_n_tuned++];
+        t->n = n;
+        t->d = d;
+        t->format = format;
+    }
+    t->variant = variant;
+}
+
+static int variant_for(int format, int n, int d) {
+    GemvTuning* t = find_tuning(format, n, d);
+    return t ? t->variant : find_variant(GEMV_DEFAULT);
+}
+
+void gemv(float* xout, const float* x, const void* w, int format, int n, int d) {
+    gemv_variants[variant_for(format, n, d)].kernel[format](xout, x, w, n, d);
+}
+
+float gemv_residual(float* xout, const float* x, const void* w, int format, int n, int d) {
+    return gemv_variants[variant_for(format, n, d)].residual[format](xout, x, w, n, d);
+}
+
+void gemv_batch(float* xout, const float* x, const void* w, int format, int n, int d, int batch) {
+    int b, chunk;
+
+    for (b = 0; b < batch; b += chunk) {
+        chunk = batch - b < GEMV_MAX_BATCH ? batch - b : GEMV_MAX_BATCH;
+        if (chunk == 1) {
+            gemv(xout + (size_t)b * d, x + (size_t)b * n, w, format, n, d);
+        } else {
+            gemv_batch_kernels[chunk][format](xout + (size_t)b * d, x + (size_t)b * n, w, n, d);
+        }
+    }
+}
+
+const char* gemv_kernel_name(int format, int n, int d) {
+    return gemv_variants[variant_for(format, n, d)].name;
+}
+
+int gemv_kernel_rows(int format, int n, int d) {
+    return gemv_variants[variant_for(format, n, d)].rows;
+}
+
+static double time_variant(GemvKernel kernel, float* xout, const float* x, const void* w, int n, int d) {
+    double best = 0.0;
+    uint64_t start, elapsed;
+    long reps, i;
+    int round;
+
+    for (round = 0; round < GEMV_TUNE_ROUNDS; round++) {
+        for (reps = 1; ; reps *= 2) {
+            start = ps3_time_us();
+            for (i = 0; i < reps; i++) {
+                kernel(xout, x, w, n, d);
+            }
+            elapsed = ps3_time_us() - start;
+            if (elapsed >= GEMV_TUNE_US) {
+                break;
+            }
+        }
+        if (round == 0 || elapsed / (double)reps < best) {
+            best = elapsed / (double)reps;
+        }
+    }
+    return best;
+}
+
+/* Tune one projection unless its shape is known already */
+static int tune_shape(const void* w, int format, int n, int d, float* x, float* xout) {
+    double t, best_time = 0.0;
+    int v, best = 0;
+
+    if (!w || find_tuning(format, n, d)) {
+        return 0;
+    }
+    for (v = 0; v < GEMV_VARIANTS; v++) {
+        t = time_variant(gemv_variants[v].kernel[format], xout, x, w, n, d);
+        if (v == 0 || t < best_time) {
+            best_time = t;
+            best = v;
+        }
+    }
+    set_tuning(format, n, d, best);
+    return 1;
+}
+
+int gemv_autotune(Transformer* transformer) {
+    Config* p = &transformer->model.config;
+    TransformerWeights* w = &transformer->model.weights;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int size = p->hidden_dim > p->vocab_size ? p->hidden_dim : p->vocab_size;
+    int tuned = 0;
+    float* x;
+    float* xout;
+    int i;
+
+    x = (float*)ps3_malloc(size * sizeof(float));
+    xout = (float*)ps3_malloc(size * sizeof(float));
+    if (!x || !xout) {
+        fprintf(stderr, "Failed to allocate tuning buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < size; i++) {
+        x[i] = (float)(i % 17) * 0.01f - 0.08f;
+    }
+
+#define TUNE(field, n, d) \
+    tuned += w->field##_f16 ? tune_shape(w->field##_f16, GEMV_FP16, n, d, x, xout) \
+                            : tune_shape(w->field, GEMV_FP32, n, d, x, xout);
+    TUNE(wq, p->dim, p->dim)
+    TUNE(wk, p->dim, kv_dim)
+    TUNE(w1, p->dim, p->hidden_dim)
+    TUNE(w2, p->hidden_dim, p->dim)
+    /* the int8 classifier has a kernel of its own */
+    if (!w->token_embedding_q8) {
+        TUNE(token_embedding_table, p->dim, p->vocab_size)
+    }
+#undef TUNE
+
+    ps3_free(xout);
+    ps3_free(x);
+    return tuned;
+}
+
+int gemv_load_tuning(const char* path) {
+    char name[16];
+    char* file;
+    char* line;
+    char* next;
+    int n, d, format, variant;
+    int count = 0;
+
+    file = ps3_read_file(path, NULL);
+    if (!file) {
+        return 0;
+    }
+    for (line = file; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        if (sscanf(line, "%d %d %d %15s", &n, &d, &format, name) != 4
+            || format < 0 || format >= GEMV_FORMATS) {
+            continue;
+        }
+        variant = find_variant(name);
+        if (variant >= 0) {
+            set_tuning(format, n, d, variant);
+            count++;
+        }
+    }
+    ps3_free(file);
+    return count;
+}
+
+int gemv_save_tuning(const char* path) {
+    char buffer[GEMV_MAX_SHAPES * 48];
+    size_t used = 0;
+    uint64_t written;
+    int fd, i, len, ok;
+
+    for (i = 0; i < gemv_n_tuned; i++) {
+        len = snprintf(buffer + used, sizeof(buffer) - used, "%d %d %d %s\n", gemv_tuned[i].n,
+                       gemv_tuned[i].d, gemv_tuned[i].format, gemv_variants[gemv_tuned[i].variant].name);
+        if (len < 0 || (size_t)len >= sizeof(buffer) - used) {
+            /* a record cut off here would misparse on load, so save nothing */
+            return 0;
+        }
+        used += len;
+    }
+    if (sysLv2FsOpen(path, SYS_O_WRONLY | SYS_O_CREAT | SYS_O_TRUNC, &fd, 0, NULL, 0) != 0) {
+        return 0;
+    }
+    ok = sysLv2FsWrite(fd, buffer, used, &written) == 0 && written == used;
+    sysLv2FsClose(fd);
+    return ok;
+}
+
+void gemv_tune(Transformer* transformer, const char* path) {
+    gemv_load_tuning(path);
+    if (gemv_autotune(transformer) > 0 && !gemv_save_tuning(path)) {
+        fprintf(stderr, "couldn't save kernel tuning to %s\n", path);
+    }
+}
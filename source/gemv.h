@@ -0,0 +1,52 @@
+#ifndef __GEMV_H__
+#define __GEMV_H__
+
+#include "transformer.h"
+
+/* Weight element types the GEMV kernels come in */
+#define GEMV_FP32 0
+#define GEMV_FP16 1
+#define GEMV_FORMATS 2
+
+/* Distinct (n, d, format) shapes remembered by the tuner */
+#define GEMV_MAX_SHAPES 16
+
+/* W (d,n) @ x (n,) -> xout (d,) with w pointing at float or uint16_t weights.
+ * Uses the kernel tuned for this shape, or a blocked default if there is none.
+ * Every variant sums each row in the same order as matmul, so results are identical. */
+void gemv(float* xout, const float* x, const void* w, int format, int n, int d);
+
+/* xout (d,) += W (d,n) @ x (n,) with the same kernel gemv() would use, returning
+ * the sum of squares of the updated xout in the order rmsnorm sums it: a residual
+ * add and the next norm's first pass fused into the matmul's stores */
+float gemv_residual(float* xout, const float* x, const void* w, int format, int n, int d);
+
+/* Largest batch gemv_batch reads the weights once for; bigger ones go in chunks */
+#define GEMV_MAX_BATCH 8
+
+/* W (d,n) @ x[b] (n,) -> xout[b] (d,) for `batch` vectors stored one after
+ * another in x and xout, reading each weight row once for all of them. Sums in
+ * the same order as gemv, so xout[b] is exactly what gemv gives for x[b]. */
+void gemv_batch(float* xout, const float* x, const void* w, int format, int n, int d, int batch);
+
+/* Time every kernel variant on the model's own projections (layer 0 and the
+ * classifier) and remember the fastest per shape. Shapes already known from a
+ * loaded tuning file are skipped. Returns the number of shapes tuned. */
+int gemv_autotune(Transformer* transformer);
+
+/* Tuning file: one "n d format kernel" line per shape. Load returns the number of
+ * shapes read (0 if the file is missing); unknown kernel names are ignored. */
+int gemv_load_tuning(const char* path);
+int gemv_save_tuning(const char* path);
+
+/* Load the tuning file, tune whatever it doesn't cover and save it back */
+void gemv_tune(Transformer* transformer, const char* path);
+
+/* Name of the kernel gemv() would use for a shape, for reports */
+const char* gemv_kernel_name(int format, int n, int d);
+
+/* Rows per block of that kernel (1, 2, 4 or 8), for the fixed-shape copies of
+ * it in the specialized forward passes (see gemv_kernel.h) */
+int gemv_kernel_rows(int format, int n, int d);
+
+#endif /* __GEMV_H__ */
@@ -0,0 +1,44 @@
+#ifndef __GEMV_KERNEL_H__
+#define __GEMV_KERNEL_H__
+
+/* Loop template of the register-blocked GEMV kernels, shared by gemv.c and the
+ * fixed-shape copies in the specialized forward passes. ROWS output rows are
+ * computed together so each x[j] is loaded once for all of them. Each row
+ * accumulates w[j] * x[j] into a single sum in order j = 0..n-1, exactly like
+ * matmul; unrolling the columns as well would only add dependent adds to the
+ * same chain unless each row got several partial sums, which would change the
+ * results.
+ *
+ * GEMV_LOOP(ROWS, STORE) expects w (const WTYPE*), x, xout, n, d and the loop
+ * variables i and j in scope, plus ss for GEMV_ADD. The includer defines WTYPE
+ * and GEMV_LOAD(v), which widens a weight to float, before expanding it. */
+#define GEMV_ROWS_1(X) X(0)
+#define GEMV_ROWS_2(X) X(0) X(1)
+#define GEMV_ROWS_4(X) X(0) X(1) X(2) X(3)
+#define GEMV_ROWS_8(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+#define GEMV_DECL(r)  float acc##r = 0.0f; const WTYPE* w##r = w + (size_t)(i + r) * n;
+#define GEMV_STEP(r)  acc##r += GEMV_LOAD(w##r[j]) * x0;
+#define GEMV_STORE(r) xout[i + r] = acc##r;
+#define GEMV_ADD(r)   xout[i + r] += acc##r; ss += xout[i + r] * xout[i + r];
+
+#define GEMV_COLUMNS(ROWS) \
+        for (j = 0; j < n; j++) { \
+            float x0 = x[j]; \
+            GEMV_ROWS_##ROWS(GEMV_STEP) \
+        }
+
+#define GEMV_LOOP(ROWS, STORE) \
+    for (i = 0; i + ROWS <= d; i += ROWS) { \
+        GEMV_ROWS_##ROWS(GEMV_DECL) \
+        GEMV_COLUMNS(ROWS) \
+        GEMV_ROWS_##ROWS(STORE) \
+    } \
+    /* leftover rows one at a time */ \
+    for (; i < d; i++) { \
+        GEMV_ROWS_1(GEMV_DECL) \
+        GEMV_COLUMNS(1) \
+        GEMV_ROWS_1(STORE) \
+    }
+
+#endif /* __GEMV_KERNEL_H__ */
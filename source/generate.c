@@ -0,0 +1,84 @@
+#include "generate.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int generate(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler,
+             const char* prompt, int steps, const Constraint* constraint, ApproxClassifier* approx,
+             EmitFn emit, void* userdata, GenerateStats* stats) {
+    int* prompt_tokens;
+    int pos = 0;            /* position in sequence */
+    int token;              /* current token */
+    int next;              /* next token */
+    float* logits;
+    int n_candidates;
+    char* piece;
+    uint64_t start;
+
+    memset(stats, 0, sizeof(GenerateStats));
+
+    /* a position past the context would run off the end of the KV cache */
+    if (steps > transformer->model.config.seq_len) {
+        steps = transformer->model.config.seq_len;
+    }
+
+    /* Encode the prompt; +3 for '\0', BOS and the dummy prefix */
+    prompt_tokens = (int*)ps3_malloc((strlen(prompt) + 3) * sizeof(int));
+    if (!prompt_tokens) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    encode(tokenizer, (char*)prompt, 1, 0, prompt_tokens, &stats->n_prompt_tokens);
+
+    if (stats->n_prompt_tokens < 1) {
+        ps3_free(prompt_tokens);
+        return 0;
+    }
+
+    /* nothing carries over from a previous prompt: every cache row read at
+     * position pos was written by this run, so resetting pos is enough */
+    start = ps3_time_us();
+    token = prompt_tokens[0];
+
+    /* everything the loop needs is allocated by now */
+    ps3_mem_hot_begin();
+    while (pos < steps) {
+        if (pos < stats->n_prompt_tokens - 1) {
+            /* still forcing the prompt, so nobody reads these logits */
+            forward_rows(transformer, token, pos, NULL, 0);
+            next = prompt_tokens[pos + 1];
+        } else if (constraint) {
+            logits = forward_rows(transformer, token, pos, constraint->allowed, constraint->n_allowed);
+            next = sample_sparse(sampler, logits, constraint->allowed, constraint->n_allowed);
+            stats->n_generated++;
+        } else if (approx) {
+            logits = forward_approx(transformer, approx, token, pos, &n_candidates);
+            next = sample_sparse(sampler, logits, approx->candidates, n_candidates);
+            stats->n_generated++;
+        } else {
+            logits = forward(transformer, token, pos);
+            next = sample(sampler, logits);
+            stats->n_generated++;
+        }
+
+        pos++;
+
+        if (next == 1 || next == 2) {  /* BOS or EOS */
+            break;
+        }
+
+        piece = decode(tokenizer, token, next);
+        if (piece) {
+            emit(piece, userdata);
+        }
+
+        token = next;
+    }
+    ps3_mem_hot_end();
+
+    stats->total_us = ps3_time_us() - start;
+    ps3_free(prompt_tokens);
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef __GENERATE_H__
+#define __GENERATE_H__
+
+#include <stdint.h>
+#include "transformer.h"
+#include "tokenizer.h"
+#include "sampler.h"
+#include "constraint.h"
+#include "approx_classifier.h"
+
+/* Callback receiving each decoded piece of generated text */
+typedef void (*EmitFn)(const char* piece, void* userdata);
+
+/* Counters for one generate() call */
+typedef struct {
+    int n_prompt_tokens;   /* tokens in the encoded prompt (including BOS) */
+    int n_generated;       /* tokens sampled after the prompt */
+    uint64_t total_us;     /* time spent in the token loop */
+} GenerateStats;
+
+/* Run the prompt through the model starting at pos 0 and sample until `steps`
+ * positions are used or BOS/EOS comes up. Prompt pieces are emitted too.
+ * With a constraint only its allowed tokens are scored and sampled; the emit
+ * callback may update the allowed set between steps. Without one, approx (if
+ * not NULL) replaces the full classifier with the two-stage one; NULL is exact.
+ * Returns 0 if the prompt encoded to nothing. */
+int generate(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler,
+             const char* prompt, int steps, const Constraint* constraint, ApproxClassifier* approx,
+             EmitFn emit, void* userdata, GenerateStats* stats);
+
+#endif /* __GENERATE_H__ */
@@ -0,0 +1,192 @@
+#include "kv_cache.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct KVPool {
+    int n_layers;
+    int n_kv_heads;
+    int head_size;
+    int n_blocks;
+    size_t block_floats;     /* floats per block, keys or values */
+    float* keys;             /* (n_blocks, n_layers, n_kv_heads, KV_BLOCK_SIZE, head_size) */
+    float* values;
+    int* refcount;           /* per block, 0 while free */
+    int* free_list;          /* stack of unused blocks */
+    int n_free;
+    int peak;
+    sys_mutex_t mutex;       /* free list and reference counts */
+};
+
+size_t kv_block_bytes(int n_layers, int n_kv_heads, int head_size) {
+    return 2 * (size_t)n_layers * n_kv_heads * KV_BLOCK_SIZE * head_size * sizeof(float);
+}
+
+KVPool* kv_pool_create(int n_layers, int n_kv_heads, int head_size, int n_blocks) {
+    KVPool* pool;
+    sys_mutex_attr_t mutex_attr;
+    int i;
+
+    pool = (KVPool*)ps3_malloc_tagged(sizeof(KVPool), MEM_KV);
+    if (!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(KVPool));
+    pool->n_layers = n_layers;
+    pool->n_kv_heads = n_kv_heads;
+    pool->head_size = head_size;
+    pool->n_blocks = n_blocks;
+    pool->block_floats = (size_t)n_layers * n_kv_heads * KV_BLOCK_SIZE * head_size;
+    pool->keys = (float*)ps3_malloc_large(n_blocks * pool->block_floats * sizeof(float), MEM_KV);
+    pool->values = (float*)ps3_malloc_large(n_blocks * pool->block_floats * sizeof(float), MEM_KV);
+    pool->refcount = (int*)ps3_malloc_tagged(n_blocks * sizeof(int), MEM_KV);
+    pool->free_list = (int*)ps3_malloc_tagged(n_blocks * sizeof(int), MEM_KV);
+
+    memset(&mutex_attr, 0, sizeof(mutex_attr));
+    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
+    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
+    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_NOT_PSHARED;
+    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_NOT_ADAPTIVE;
+    strcpy(mutex_attr.name, "kv_pool");
+
+    if (n_blocks < 1 || !pool->keys || !pool->values || !pool->refcount || !pool->free_list ||
+        sysMutexCreate(&pool->mutex, &mutex_attr) != 0) {
+        ps3_free(pool->keys);
+        ps3_free(pool->values);
+        ps3_free(pool->refcount);
+        ps3_free(pool->free_list);
+        ps3_free(pool);
+        return NULL;
+    }
+
+    /* hand out low blocks first */
+    for (i = 0; i < n_blocks; i++) {
+        pool->refcount[i] = 0;
+        pool->free_list[i] = n_blocks - 1 - i;
+    }
+    pool->n_free = n_blocks;
+    return pool;
+}
+
+KVPool* kv_pool_create_bytes(int n_layers, int n_kv_heads, int head_size, size_t bytes) {
+    return kv_pool_create(n_layers, n_kv_heads, head_size,
+                          (int)(bytes / kv_block_bytes(n_layers, n_kv_heads, head_size)));
+}
+
+void kv_pool_destroy(KVPool* pool) {
+    if (!pool) {
+        return;
+    }
+    sysMutexDestroy(pool->mutex);
+    ps3_free(pool->keys);
+    ps3_free(pool->values);
+    ps3_free(pool->refcount);
+    ps3_free(pool->free_list);
+    ps3_free(pool);
+}
+
+int kv_pool_total_blocks(KVPool* pool) {
+    return pool->n_blocks;
+}
+
+int kv_pool_free_blocks(KVPool* pool) {
+    int n;
+
+    sysMutexLock(pool->mutex, 0);
+    n = pool->n_free;
+    sysMutexUnlock(pool->mutex);
+    return n;
+}
+
+int kv_pool_peak_blocks(KVPool* pool) {
+    int n;
+
+    sysMutexLock(pool->mutex, 0);
+    n = pool->peak;
+    sysMutexUnlock(pool->mutex);
+    return n;
+}
+
+/* Take a block off the free list; -1 if the pool is empty. Caller holds the mutex. */
+static int alloc_locked(KVPool* pool) {
+    int block;
+
+    if (pool->n_free == 0) {
+        return -1;
+    }
+    block = pool->free_list[--pool->n_free];
+    pool->refcount[block] = 1;
+    if (pool->n_blocks - pool->n_free > pool->peak) {
+        pool->peak = pool->n_blocks - pool->n_free;
+    }
+    return block;
+}
+
+int kv_block_alloc(KVPool* pool) {
+    int block;
+
+    sysMutexLock(pool->mutex, 0);
+    block = alloc_locked(pool);
+    sysMutexUnlock(pool->mutex);
+    return block;
+}
+
+void kv_block_ref(KVPool* pool, int block) {
+    sysMutexLock(pool->mutex, 0);
+    pool->refcount[block]++;
+    sysMutexUnlock(pool->mutex);
+}
+
+void kv_block_release(KVPool* pool, int block) {
+    sysMutexLock(pool->mutex, 0);
+    if (--pool->refcount[block] == 0) {
+        pool->free_list[pool->n_free++] = block;
+    }
+    sysMutexUnlock(pool->mutex);
+}
+
+int kv_block_refcount(KVPool* pool, int block) {
+    int count;
+
+    sysMutexLock(pool->mutex, 0);
+    count = pool->refcount[block];
+    sysMutexUnlock(pool->mutex);
+    return count;
+}
+
+int kv_block_make_private(KVPool* pool, int block) {
+    int copy;
+    size_t offset;
+
+    /* kv_cache_share raises the count from whichever thread shares the block,
+     * so it is read under the lock. A block with one reference can only be
+     * shared from the caller's own sequence, which the caller does not do
+     * while writing to it. */
+    sysMutexLock(pool->mutex, 0);
+    if (pool->refcount[block] == 1) {
+        sysMutexUnlock(pool->mutex);
+        return block;
+    }
+    copy = alloc_locked(pool);
+    sysMutexUnlock(pool->mutex);
+    if (copy < 0) {
+        return -1;
+    }
+    offset = (size_t)block * pool->block_floats;
+    memcpy(pool->keys + (size_t)copy * pool->block_floats, pool->keys + offset, pool->block_floats * sizeof(float));
+    memcpy(pool->values + (size_t)copy * pool->block_floats, pool->values + offset, pool->block_floats * sizeof(float));
+    kv_block_release(pool, block);
+    return copy;
+}
+
+float* kv_block_keys(KVPool* pool, int block, int l, int g) {
+    return pool->keys + (size_t)block * pool->block_floats
+           + ((size_t)l * pool->n_kv_heads + g) * KV_BLOCK_SIZE * pool->head_size;
+}
+
+float* kv_block_values(KVPool* pool, int block, int l, int g) {
+    return pool->values + (size_t)block * pool->block_floats
+           + ((size_t)l * pool->n_kv_heads + g) * KV_BLOCK_SIZE * pool->head_size;
+}
@@ -0,0 +1,51 @@
+#ifndef __KV_CACHE_H__
+#define __KV_CACHE_H__
+
+#include <stddef.h>
+
+/* Positions per KV block. A multiple of the attention kernel's block of
+ * timesteps, so a run of rows it scores never crosses a block boundary. */
+#define KV_BLOCK_SIZE 16
+
+/* Shared pool of fixed-size KV cache blocks for paged sequences. A block holds
+ * the keys and values of KV_BLOCK_SIZE consecutive positions for every layer,
+ * laid out (layer, kv_head, position, head_size) so each head's rows are
+ * contiguous. Sequences map their positions to blocks through a block table
+ * and only take blocks as they grow. Blocks are reference counted: sequences
+ * that share a prompt prefix point at the same blocks, and a shared block is
+ * copied before it is written (see kv_block_make_private). Allocation and the
+ * reference counts are safe to use from several threads. */
+typedef struct KVPool KVPool;
+
+/* Bytes of one block, keys and values */
+size_t kv_block_bytes(int n_layers, int n_kv_heads, int head_size);
+
+/* Returns NULL if the blocks can't be allocated */
+KVPool* kv_pool_create(int n_layers, int n_kv_heads, int head_size, int n_blocks);
+/* Pool with as many blocks as fit in bytes */
+KVPool* kv_pool_create_bytes(int n_layers, int n_kv_heads, int head_size, size_t bytes);
+void kv_pool_destroy(KVPool* pool);
+
+int kv_pool_total_blocks(KVPool* pool);
+int kv_pool_free_blocks(KVPool* pool);
+/* Most blocks in use at once since the pool was created */
+int kv_pool_peak_blocks(KVPool* pool);
+
+/* Take an unused block with a reference count of one, or -1 if the pool is empty */
+int kv_block_alloc(KVPool* pool);
+void kv_block_ref(KVPool* pool, int block);
+/* Drop a reference; the block returns to the pool with the last one */
+void kv_block_release(KVPool* pool, int block);
+/* Current number of references, for reporting */
+int kv_block_refcount(KVPool* pool, int block);
+
+/* The block itself if the caller holds the only reference, otherwise a private
+ * copy of it (the reference to the shared one is dropped). -1 if a copy was
+ * needed but the pool is empty; the caller then still holds `block`. */
+int kv_block_make_private(KVPool* pool, int block);
+
+/* First key/value row of layer l, kv head g in a block; KV_BLOCK_SIZE rows of head_size floats follow */
+float* kv_block_keys(KVPool* pool, int block, int l, int g);
+float* kv_block_values(KVPool* pool, int block, int l, int g);
+
+#endif /* __KV_CACHE_H__ */
@@ -10,6 +10,58 @@
 #include "tokenizer.h"
 #include "sampler.h"
 #include "rsxutil.h"
+#include "thread_utils.h"
+#include "output_queue.h"
+#include "generate.h"
+#include "chat.h"
+#include "batch.h"
+#include "bench.h"
+#include "microbench.h"
+#include "server.h"
+#include "beam.h"
+#include "startup.h"
+#include "gemv.h"
+#include "memory_utils.h"
+#include "math_utils.h"
+
+/* Files expected on the USB drive */
+#define MODEL_PATH       "/dev_usb006/PS3/USRDIR/stories15M.bin"
+#define TOKENIZER_PATH   "/dev_usb006/PS3/USRDIR/tokenizer.bin"
+#define CHAT_SCRIPT_PATH "/dev_usb006/PS3/USRDIR/chat.txt"
+#define BATCH_PROMPTS_PATH "/dev_usb006/PS3/USRDIR/prompts.txt"
+#define BATCH_OUTPUT_PATH  "/dev_usb006/PS3/USRDIR/stories_out.txt"
+#define CLASSIFIER_INDEX_PATH "/dev_usb006/PS3/USRDIR/classifier.idx"
+#define GEMV_TUNING_PATH "/dev_usb006/PS3/USRDIR/gemv_tuning.txt"
+
+/* Half precision matrices halve weight memory and bandwidth, the int8 embedding table
+ * quarters the largest tensor and folding the norm weights into the matrices saves
+ * a vector pass per norm; WEIGHTS_FP32 keeps the checkpoint as is. With EXP_FAST
+ * below the default is approximate, see "Default precision" in the README. */
+#define MODEL_WEIGHT_FORMAT (WEIGHTS_FP16 | WEIGHTS_EMBEDDING_Q8 | WEIGHTS_FOLD_NORMS)
+
+/* Exponential behind softmax, attention and the SwiGLU: EXP_FAST (exp_fast in
+ * math_utils.h, which states its error) or EXP_EXACT for libm's expf */
+#define EXP_MODE EXP_FAST
+
+/* 1 puts the weights and KV caches on 1 MB lv2 pages (64 KB, then the heap, if
+ * those run out) to cut TLB misses while streaming them; 0 keeps them on the heap */
+#define USE_LARGE_PAGES 1
+
+/* 1 samples from the two-stage classifier's candidates (built into CLASSIFIER_INDEX_PATH
+ * on first use); meant for greedy/top-k sampling. 0 keeps the exact classifier. */
+#define USE_APPROX_CLASSIFIER 0
+
+/* 1 streams every weight matrix through local-store-sized tiles with double-buffered
+ * staging, as an SPE would (see tiled.h); 0 reads the weights in place */
+#define TILED_EXECUTION 0
+
+/* Sequences the server decodes together, and the paged KV cache they share
+ * (0 gives each sequence a full seq_len cache of its own) */
+#define SERVER_SLOTS 8
+#define SERVER_KV_BYTES (32*1024*1024)
+
+/* Hypotheses kept by the beam search mode */
+#define BEAM_WIDTH 4
 
 /* Global variables for UI control */
 static vs32 dialog_action = 0;
@@ -25,98 +77,613 @@ static void do_flip(void) {
     flip();
 }
 
-/* Main generation function */
+/* Append text to the dialog buffer, scrolling out the oldest half when full */
+static void append_display(char* display_buffer, size_t size, const char* text) {
+    size_t len = strlen(display_buffer);
+    size_t add = strlen(text);
+
+    if (add >= size / 2) {
+        return;
+    }
+    if (len + add >= size - 100) {
+        memmove(display_buffer, display_buffer + len / 2, len - len / 2 + 1);
+    }
+    strcat(display_buffer, text);
+}
+
+/* UI loop: drain whatever the producer thread queued since the last frame until
+ * it closes the queue. With live_ui the dialog is refreshed at most once per
+ * frame; the text is always streamed to stdout as well. */
+static void stream_to_display(OutputQueue* queue, char* display_buffer, size_t size, int live_ui) {
+    static char pending[OUTPUT_QUEUE_SIZE];
+    msgType dialogType = (msgType)(MSG_DIALOG_NORMAL);
+    int dirty;
+
+    while (!output_queue_finished(queue)) {
+        dirty = 0;
+        if (output_queue_pop(queue, pending, sizeof(pending)) > 0) {
+            printf("%s", pending);
+            fflush(stdout);
+            append_display(display_buffer, size, pending);
+            dirty = 1;
+        }
+
+        if (live_ui) {
+            /* the message dialog has no in-place text update, so reopen it only when the text changed */
+            if (dirty) {
+                msgDialogClose(0.0f);
+                msgDialogOpen2(dialogType, display_buffer, dialog_handler, NULL, NULL);
+            }
+            do_flip();
+        } else {
+            usleep(1000);
+        }
+    }
+}
+
+/* Final dialog that waits for the OK button */
+static void show_result_dialog(const char* display_buffer) {
+    msgDialogClose(0.0f);
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL | MSG_DIALOG_BTN_TYPE_OK), 
+                  display_buffer, dialog_handler, NULL, NULL);
+}
+
+static void print_emit(const char* piece, void* userdata) {
+    printf("%s", piece);
+}
+
+/* Load the model, tokenizer and sampler shared by every mode */
+static void build_components(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler) {
+    Startup startup;
+
+    /* checkpoint, tokenizer, vocab index, run state and RoPE table side by side */
+    startup_begin(&startup, transformer, tokenizer, (char*)MODEL_PATH, TOKENIZER_PATH, MODEL_WEIGHT_FORMAT);
+    startup_wait(&startup);
+    startup_report(&startup, print_emit, NULL);
+    printf("\n");
+    /* pick the GEMV kernels; only the first run on a model does the timing */
+    gemv_tune(transformer, GEMV_TUNING_PATH);
+    if (TILED_EXECUTION) {
+        transformer->state.tiled = tiled_engine_create(TILE_DEFAULT_BYTES, 1);
+    }
+    build_sampler(sampler, transformer->model.config.vocab_size, 1.0f, 0.9f, 1234ull);
+}
+
+static void free_components(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler) {
+    /* Clean up in reverse order */
+    free_sampler(sampler);
+    free_tokenizer(tokenizer);
+    free_transformer(transformer);
+}
+
+/* Work shared between the generator thread and the UI thread */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    Sampler* sampler;
+    ApproxClassifier* approx;  /* NULL for the exact classifier */
+    const char* prompt;
+    int steps;
+    OutputQueue queue;       /* decoded pieces, generator -> UI */
+    int ok;                  /* written by the generator before it closes the queue */
+    GenerateStats stats;
+} GenerateJob;
+
+static void queue_emit(const char* piece, void* userdata) {
+    output_queue_push((OutputQueue*)userdata, piece);
+}
+
+/* Generator thread: runs the token loop and never touches the display */
+static void generate_thread(void* arg) {
+    GenerateJob* job = (GenerateJob*)arg;
+
+    job->ok = generate(job->transformer, job->tokenizer, job->sampler, job->prompt, job->steps,
+                       NULL, job->approx, queue_emit, &job->queue, &job->stats);
+    output_queue_close(&job->queue);
+}
+
+/* One generation of job->prompt, appended to the display. The sampler is
+ * reseeded first so every run samples the same tokens. Returns 0 if the
+ * generator thread could not be started. */
+static int run_generate(GenerateJob* job, char* display_buffer, size_t size, int live_ui) {
+    sys_ppu_thread_t generator;
+
+    job->sampler->rng_state = 1234ull;
+    job->ok = 0;
+    memset(&job->stats, 0, sizeof(job->stats));
+    output_queue_init(&job->queue);
+
+    if (!ps3_thread_create(&generator, generate_thread, job, "llama_generate")) {
+        append_display(display_buffer, size, "\nError: could not start generator thread!\n");
+        return 0;
+    }
+    stream_to_display(&job->queue, display_buffer, size, live_ui);
+    ps3_thread_join(generator);
+    printf("\n");
+    return 1;
+}
+
+/* Main generation function. The prompt is generated twice, first with the
+ * dialog only updated at the end and then with it refreshed once per frame;
+ * the text is streamed to stdout either way. Decode speed is reported for
+ * both runs so the cost of the live dialog shows. */
 void test_generate(void) {
     static char display_buffer[2048];
+    static GenerateJob job;
+    static const char* run_names[2] = { "dialog at the end", "live dialog" };
     Transformer transformer = {0};
     Tokenizer tokenizer = {0};
     Sampler sampler = {0};
+    ApproxClassifier approx = {0};
     msgType dialogType;
-    const char* prompt = "Once upon a time";
-    int prompt_tokens[512];  /* large enough buffer for the prompt */
-    int n_prompt_tokens = 0;
-    int steps = 50;         /* number of tokens to generate */
-    int pos = 0;            /* position in sequence */
-    int token;              /* current token */
-    int next;              /* next token */
-    int success = 1;
-    char* piece;
+    GenerateStats runs[2];
+    char stats[128];
+    int live_ui;
 
     /* Clear display buffer */
     display_buffer[0] = '\0';
 
     /* Initialize all components */
-    build_transformer(&transformer, (char*)"/dev_usb006/PS3/USRDIR/stories15M.bin");
-    build_tokenizer(&tokenizer, "/dev_usb006/PS3/USRDIR/tokenizer.bin", transformer.config.vocab_size);
-    build_sampler(&sampler, transformer.config.vocab_size, 1.0f, 0.9f, 1234ull);
+    build_components(&transformer, &tokenizer, &sampler);
+
+    memset(&job, 0, sizeof(job));
+    job.transformer = &transformer;
+    job.tokenizer = &tokenizer;
+    job.sampler = &sampler;
+    if (USE_APPROX_CLASSIFIER) {
+        approx_classifier_open(&approx, &transformer, CLASSIFIER_INDEX_PATH);
+        job.approx = &approx;
+    }
+    job.prompt = "Once upon a time";
+    job.steps = 50;         /* number of tokens to generate */
 
     /* Add initial text to buffer */
     strcat(display_buffer, "Prompt: \"");
-    strcat(display_buffer, prompt);
-    strcat(display_buffer, "\"\n\nGenerating: ");
+    strcat(display_buffer, job.prompt);
+    strcat(display_buffer, "\"");
     
     /* Show initial state */
     dialogType = (msgType)(MSG_DIALOG_NORMAL);
     msgDialogOpen2(dialogType, display_buffer, dialog_handler, NULL, NULL);
     do_flip();
 
-    /* Encode the prompt */
-    encode(&tokenizer, (char*)prompt, 1, 0, prompt_tokens, &n_prompt_tokens);
+    for (live_ui = 0; live_ui < 2; live_ui++) {
+        snprintf(stats, sizeof(stats), "\n\nGenerating (%s): ", run_names[live_ui]);
+        append_display(display_buffer, sizeof(display_buffer), stats);
+        if (!live_ui) {
+            /* the first run leaves the dialog alone until it is done */
+            msgDialogClose(0.0f);
+            msgDialogOpen2(dialogType, display_buffer, dialog_handler, NULL, NULL);
+            do_flip();
+        }
+        if (!run_generate(&job, display_buffer, sizeof(display_buffer), live_ui)) {
+            break;
+        }
+        if (!job.ok) {
+            append_display(display_buffer, sizeof(display_buffer), "\nError: No valid tokens in prompt!\n");
+            break;
+        }
+        runs[live_ui] = job.stats;
+    }
 
-    if (n_prompt_tokens < 1) {
-        strcat(display_buffer, "\nError: No valid tokens in prompt!\n");
-        msgDialogOpen2(dialogType, display_buffer, dialog_handler, NULL, NULL);
-        success = 0;
+    if (live_ui == 2) {
+        /* Show completion */
+        append_display(display_buffer, sizeof(display_buffer), "\n\nGeneration complete.");
+        printf("Generation complete.\n");
+        for (live_ui = 0; live_ui < 2; live_ui++) {
+            snprintf(stats, sizeof(stats), "\n%s: %d tokens in %llu ms (%.2f tok/s)", run_names[live_ui],
+                     runs[live_ui].n_generated, (unsigned long long)(runs[live_ui].total_us / 1000),
+                     runs[live_ui].total_us > 0 ?
+                     runs[live_ui].n_generated * 1e6 / (double)runs[live_ui].total_us : 0.0);
+            printf("%s\n", stats + 1);
+            append_display(display_buffer, sizeof(display_buffer), stats);
+        }
     }
+    show_result_dialog(display_buffer);
 
-    if (success) {
-        float* logits;
-        token = prompt_tokens[0];
+    if (job.approx) {
+        approx_classifier_free(job.approx);
+    }
+    free_components(&transformer, &tokenizer, &sampler);
+}
 
-        while (pos < steps) {
-            logits = forward(&transformer, token, pos);
-            
-            if (pos < n_prompt_tokens - 1) {
-                next = prompt_tokens[pos + 1];
-            } else {
-                next = sample(&sampler, logits);
-            }
+/* Beam search: deterministic, the winning continuation is shown once the search ends */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    const char* prompt;
+    int steps;
+    OutputQueue queue;
+    int ok;
+    BeamStats stats;
+} BeamJob;
 
-            pos++;
+static void beam_thread(void* arg) {
+    BeamJob* job = (BeamJob*)arg;
 
-            if (next == 1 || next == 2) {  /* BOS or EOS */
-                break;
-            }
+    job->ok = beam_search(job->transformer, job->tokenizer, job->prompt, job->steps, BEAM_WIDTH,
+                          queue_emit, &job->queue, &job->stats);
+    output_queue_close(&job->queue);
+}
 
-            /* Decode token and update display */
-            piece = decode(&tokenizer, token, next);
-            if (piece && strlen(piece) + strlen(display_buffer) < sizeof(display_buffer) - 100) {
-                strcat(display_buffer, piece);
-                msgDialogClose(0.0f);
-                msgDialogOpen2(dialogType, display_buffer, dialog_handler, NULL, NULL);
-                do_flip();
-            }
+void test_beam(int live_ui) {
+    static char display_buffer[2048];
+    static BeamJob job;
+    Transformer transformer = {0};
+    Tokenizer tokenizer = {0};
+    Sampler sampler = {0};
+    sys_ppu_thread_t worker;
+    char stats[192];
+
+    display_buffer[0] = '\0';
+    memset(&job, 0, sizeof(job));
+    build_components(&transformer, &tokenizer, &sampler);
+    job.transformer = &transformer;
+    job.tokenizer = &tokenizer;
+    job.prompt = "Once upon a time";
+    job.steps = 128;
+    output_queue_init(&job.queue);
+
+    append_display(display_buffer, sizeof(display_buffer), "Beam search\n\n");
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL), display_buffer, dialog_handler, NULL, NULL);
+    do_flip();
 
-            token = next;
+    if (ps3_thread_create(&worker, beam_thread, &job, "llama_beam")) {
+        stream_to_display(&job.queue, display_buffer, sizeof(display_buffer), live_ui);
+        ps3_thread_join(worker);
+        printf("\n");
+        if (!job.ok) {
+            append_display(display_buffer, sizeof(display_buffer), "\nError: No valid tokens in prompt!\n");
+        } else {
+            snprintf(stats, sizeof(stats),
+                     "\n\nWidth %d: %d tokens, log-prob %.2f, %d steps in %llu ms, peak %d KV blocks (%d unshared)",
+                     BEAM_WIDTH, job.stats.n_generated, job.stats.score, job.stats.n_steps,
+                     (unsigned long long)(job.stats.total_us / 1000), job.stats.kv_blocks_peak,
+                     job.stats.kv_blocks_unshared);
+            printf("%s\n", stats + 2);
+            append_display(display_buffer, sizeof(display_buffer), stats);
         }
+    } else {
+        append_display(display_buffer, sizeof(display_buffer), "\nError: could not start beam search thread!\n");
+    }
+    show_result_dialog(display_buffer);
 
-        /* Show completion */
-        strcat(display_buffer, "\n\nGeneration complete.");
-        msgDialogClose(0.0f);
-        msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL | MSG_DIALOG_BTN_TYPE_OK), 
-                      display_buffer, dialog_handler, NULL, NULL);
+    free_components(&transformer, &tokenizer, &sampler);
+}
+
+/* Scripted multi-turn chat: one user turn per line of chat.txt */
+typedef struct {
+    ChatSession session;
+    char* script;           /* user turns, one per line */
+    int max_reply;          /* reply budget per turn */
+    OutputQueue queue;      /* transcript, chat thread -> UI */
+} ChatJob;
+
+/* Chat thread: runs every turn against the same session so the KV cache grows incrementally */
+static void chat_thread(void* arg) {
+    ChatJob* job = (ChatJob*)arg;
+    char* line = job->script;
+    char* end;
+    char report[160];
+    ChatTurnStats stats;
+    size_t len;
+
+    while (line && *line) {
+        end = strchr(line, '\n');
+        if (end) *end = '\0';
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+
+        if (len > 0) {
+            output_queue_push(&job->queue, "\n\nUser: ");
+            output_queue_push(&job->queue, line);
+            output_queue_push(&job->queue, "\nAssistant:");
+            chat_session_turn(&job->session, line, job->max_reply, queue_emit, &job->queue, &stats);
+            snprintf(report, sizeof(report), "\n[%d new tokens, prefill %llu ms, %d reply tokens at %.2f tok/s, pos %d]",
+                     stats.n_prompt_tokens, (unsigned long long)(stats.prefill_us / 1000), stats.n_reply_tokens,
+                     stats.reply_us > 0 ? stats.n_reply_tokens * 1e6 / (double)stats.reply_us : 0.0,
+                     job->session.pos);
+            output_queue_push(&job->queue, report);
+        }
+        line = end ? end + 1 : NULL;
     }
+    output_queue_close(&job->queue);
+}
+
+void test_chat(int live_ui) {
+    static char display_buffer[2048];
+    static ChatJob job;
+    Transformer transformer = {0};
+    Tokenizer tokenizer = {0};
+    Sampler sampler = {0};
+    sys_ppu_thread_t chatter;
+
+    display_buffer[0] = '\0';
+    memset(&job, 0, sizeof(job));
+
+    job.script = ps3_read_file(CHAT_SCRIPT_PATH, NULL);
+    if (!job.script) {
+        append_display(display_buffer, sizeof(display_buffer), "Error: could not read " CHAT_SCRIPT_PATH "\n");
+        show_result_dialog(display_buffer);
+        return;
+    }
+
+    build_components(&transformer, &tokenizer, &sampler);
+    chat_session_init(&job.session, &transformer, &tokenizer, &sampler, NULL);
+    job.max_reply = 64;
+    output_queue_init(&job.queue);
+
+    append_display(display_buffer, sizeof(display_buffer), "Chat session");
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL), display_buffer, dialog_handler, NULL, NULL);
+    do_flip();
+
+    if (ps3_thread_create(&chatter, chat_thread, &job, "llama_chat")) {
+        stream_to_display(&job.queue, display_buffer, sizeof(display_buffer), live_ui);
+        ps3_thread_join(chatter);
+        printf("\n");
+        append_display(display_buffer, sizeof(display_buffer), "\n\nChat complete.");
+    } else {
+        append_display(display_buffer, sizeof(display_buffer), "\nError: could not start chat thread!\n");
+    }
+    show_result_dialog(display_buffer);
+
+    chat_session_free(&job.session);
+    ps3_free(job.script);
+    free_components(&transformer, &tokenizer, &sampler);
+}
+
+/* Batch job: many prompts against one model load */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    Sampler* sampler;
+    OutputQueue queue;      /* progress lines, batch thread -> UI */
+    int ok;
+    BatchStats stats;
+} BatchJob;
+
+static void batch_progress(int index, const char* prompt, const GenerateStats* stats, void* userdata) {
+    BatchJob* job = (BatchJob*)userdata;
+    char line[160];
+
+    snprintf(line, sizeof(line), "\n[%d] %d+%d tokens in %llu ms: %.40s",
+             index, stats->n_prompt_tokens, stats->n_generated,
+             (unsigned long long)(stats->total_us / 1000), prompt);
+    output_queue_push(&job->queue, line);
+}
+
+static void batch_thread(void* arg) {
+    BatchJob* job = (BatchJob*)arg;
+
+    job->ok = run_batch(job->transformer, job->tokenizer, job->sampler,
+                        BATCH_PROMPTS_PATH, BATCH_OUTPUT_PATH, 256,
+                        batch_progress, job, &job->stats);
+    output_queue_close(&job->queue);
+}
+
+void test_batch(int live_ui) {
+    static char display_buffer[2048];
+    static BatchJob job;
+    Transformer transformer = {0};
+    Tokenizer tokenizer = {0};
+    Sampler sampler = {0};
+    sys_ppu_thread_t worker;
+    char report[256];
+    uint64_t load_us;
+
+    display_buffer[0] = '\0';
+    memset(&job, 0, sizeof(job));
+
+    /* the load is paid once for the whole job */
+    load_us = ps3_time_us();
+    build_components(&transformer, &tokenizer, &sampler);
+    load_us = ps3_time_us() - load_us;
+
+    job.transformer = &transformer;
+    job.tokenizer = &tokenizer;
+    job.sampler = &sampler;
+    output_queue_init(&job.queue);
+
+    append_display(display_buffer, sizeof(display_buffer), "Batch: " BATCH_PROMPTS_PATH);
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL), display_buffer, dialog_handler, NULL, NULL);
+    do_flip();
+
+    if (ps3_thread_create(&worker, batch_thread, &job, "llama_batch")) {
+        stream_to_display(&job.queue, display_buffer, sizeof(display_buffer), live_ui);
+        ps3_thread_join(worker);
+        printf("\n");
+        snprintf(report, sizeof(report),
+                 "\n\n%s. %d prompts (%d failed), %lld tokens sampled in %llu ms (%.2f tok/s, %.2f pos/s), load %llu ms",
+                 job.ok ? "Batch complete" : "Batch failed",
+                 job.stats.n_prompts, job.stats.n_failed, job.stats.n_generated,
+                 (unsigned long long)(job.stats.total_us / 1000),
+                 job.stats.total_us > 0 ? job.stats.n_generated * 1e6 / (double)job.stats.total_us : 0.0,
+                 job.stats.total_us > 0 ? job.stats.n_positions * 1e6 / (double)job.stats.total_us : 0.0,
+                 (unsigned long long)(load_us / 1000));
+        printf("%s\n", report + 2);
+        append_display(display_buffer, sizeof(display_buffer), report);
+    } else {
+        append_display(display_buffer, sizeof(display_buffer), "\nError: could not start batch thread!\n");
+    }
+    show_result_dialog(display_buffer);
+
+    free_components(&transformer, &tokenizer, &sampler);
+}
+
+/* Inference server: the model stays loaded while requests come in over TCP */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    OutputQueue queue;      /* per-request reports, server thread -> UI */
+    int ok;
+    ServerStats stats;
+} ServerJob;
+
+static void server_thread(void* arg) {
+    ServerJob* job = (ServerJob*)arg;
+
+    job->ok = run_server(job->transformer, job->tokenizer, SERVER_PORT, SERVER_SLOTS, SERVER_KV_BYTES,
+                         queue_emit, &job->queue, &job->stats);
+    output_queue_close(&job->queue);
+}
+
+void test_server(int live_ui) {
+    static char display_buffer[2048];
+    static ServerJob job;
+    Transformer transformer = {0};
+    Tokenizer tokenizer = {0};
+    Sampler sampler = {0};
+    sys_ppu_thread_t worker;
+    char report[256];
+
+    display_buffer[0] = '\0';
+    memset(&job, 0, sizeof(job));
+    build_components(&transformer, &tokenizer, &sampler);
+    job.transformer = &transformer;
+    job.tokenizer = &tokenizer;
+    output_queue_init(&job.queue);
+
+    append_display(display_buffer, sizeof(display_buffer), "Server");
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL), display_buffer, dialog_handler, NULL, NULL);
+    do_flip();
+
+    if (ps3_thread_create(&worker, server_thread, &job, "llama_server")) {
+        stream_to_display(&job.queue, display_buffer, sizeof(display_buffer), live_ui);
+        ps3_thread_join(worker);
+        printf("\n");
+        snprintf(report, sizeof(report),
+                 "\n\n%s. %lld requests (%lld rejected), %lld tokens, avg queue %.1f ms, avg ttft %.1f ms, %.2f tok/s",
+                 job.ok ? "Server stopped" : "Error: could not start the server",
+                 job.stats.n_requests, job.stats.n_rejected, job.stats.n_generated,
+                 job.stats.n_requests > 0 ? job.stats.queue_us / 1000.0 / job.stats.n_requests : 0.0,
+                 job.stats.n_requests > 0 ? job.stats.ttft_us / 1000.0 / job.stats.n_requests : 0.0,
+                 job.stats.busy_us > 0 ? job.stats.n_generated * 1e6 / (double)job.stats.busy_us : 0.0);
+        printf("%s\n", report + 2);
+        append_display(display_buffer, sizeof(display_buffer), report);
+    } else {
+        append_display(display_buffer, sizeof(display_buffer), "\nError: could not start server thread!\n");
+    }
+    show_result_dialog(display_buffer);
+
+    free_components(&transformer, &tokenizer, &sampler);
+}
+
+/* Benchmarks run on their own thread and stream their report like generated text */
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    int kernels;             /* per-kernel microbenchmarks instead of the model benchmarks */
+    OutputQueue queue;
+} BenchJob;
+
+static void bench_thread(void* arg) {
+    BenchJob* job = (BenchJob*)arg;
+    Transformer reference, quantized;
+    ApproxClassifier approx;
+
+    if (job->kernels) {
+        microbench_kernels(job->tokenizer, job->transformer->model.config.seq_len, queue_emit, &job->queue);
+        output_queue_close(&job->queue);
+        return;
+    }
+
+    bench_attention_scaling(job->transformer, queue_emit, &job->queue);
+    bench_tiled(job->transformer, queue_emit, &job->queue);
+    bench_specialized(job->transformer, queue_emit, &job->queue);
+    bench_paged_kv(job->transformer, queue_emit, &job->queue);
+    bench_sessions(job->transformer, queue_emit, &job->queue);
+    bench_beam(job->transformer, job->tokenizer, queue_emit, &job->queue);
+    bench_pipeline(job->transformer, queue_emit, &job->queue);
+    bench_fast_exp(job->transformer, queue_emit, &job->queue);
+
+    /* the same model again with its weights and KV cache on heap pages */
+    ps3_set_large_pages(0);
+    build_transformer_format(&reference, (char*)MODEL_PATH, MODEL_WEIGHT_FORMAT);
+    ps3_set_large_pages(USE_LARGE_PAGES);
+    bench_large_pages(&reference, job->transformer, queue_emit, &job->queue);
+    free_transformer(&reference);
+
+    /* the int8 table is measured against plain fp32 so nothing else differs */
+    build_transformer_format(&reference, (char*)MODEL_PATH, WEIGHTS_FP32);
+    build_transformer_format(&quantized, (char*)MODEL_PATH, WEIGHTS_FP32 | WEIGHTS_EMBEDDING_Q8);
+    bench_embedding_q8(&reference, &quantized, queue_emit, &job->queue);
+    free_transformer(&reference);
+    free_transformer(&quantized);
+
+    /* fp16 storage against the checkpoint's own fp32 */
+    build_transformer_format(&reference, (char*)MODEL_PATH, WEIGHTS_FP32);
+    build_transformer_format(&quantized, (char*)MODEL_PATH, WEIGHTS_FP16);
+    bench_fp16(&reference, &quantized, queue_emit, &job->queue);
+    free_transformer(&reference);
+    free_transformer(&quantized);
+
+    /* folding against the same format with the norms kept separate */
+    build_transformer_format(&reference, (char*)MODEL_PATH, MODEL_WEIGHT_FORMAT & ~WEIGHTS_FOLD_NORMS);
+    build_transformer_format(&quantized, (char*)MODEL_PATH, MODEL_WEIGHT_FORMAT | WEIGHTS_FOLD_NORMS);
+    bench_folded_norms(&reference, &quantized, queue_emit, &job->queue);
+    free_transformer(&reference);
+    free_transformer(&quantized);
+
+    approx_classifier_open(&approx, job->transformer, CLASSIFIER_INDEX_PATH);
+    bench_approx_classifier(job->transformer, &approx, queue_emit, &job->queue);
+    approx_classifier_free(&approx);
+
+    bench_constraint(job->transformer, job->tokenizer, queue_emit, &job->queue);
+    output_queue_close(&job->queue);
+}
+
+void test_bench(int live_ui, int kernels) {
+    static char display_buffer[2048];
+    static BenchJob job;
+    Transformer transformer = {0};
+    Tokenizer tokenizer = {0};
+    sys_ppu_thread_t worker;
+
+    display_buffer[0] = '\0';
+    memset(&job, 0, sizeof(job));
+    build_transformer_format(&transformer, (char*)MODEL_PATH, MODEL_WEIGHT_FORMAT);
+    gemv_tune(&transformer, GEMV_TUNING_PATH);
+    build_tokenizer(&tokenizer, TOKENIZER_PATH, transformer.model.config.vocab_size);
+    job.transformer = &transformer;
+    job.tokenizer = &tokenizer;
+    job.kernels = kernels;
+    output_queue_init(&job.queue);
+
+    append_display(display_buffer, sizeof(display_buffer), "Benchmark");
+    msgDialogOpen2((msgType)(MSG_DIALOG_NORMAL), display_buffer, dialog_handler, NULL, NULL);
+    do_flip();
+
+    if (ps3_thread_create(&worker, bench_thread, &job, "llama_bench")) {
+        stream_to_display(&job.queue, display_buffer, sizeof(display_buffer), live_ui);
+        ps3_thread_join(worker);
+        printf("\n");
+        append_display(display_buffer, sizeof(display_buffer), "\n\nBenchmark complete.");
+    } else {
+        append_display(display_buffer, sizeof(display_buffer), "\nError: could not start benchmark thread!\n");
+    }
+    show_result_dialog(display_buffer);
 
-    /* Clean up in reverse order */
-    free_sampler(&sampler);
     free_tokenizer(&tokenizer);
     free_transformer(&transformer);
 }
 
+/* Memory counters, printed once: main reports before handing over to the
+ * loader, since atexit handlers don't run across sysProcessExitSpawn2; the
+ * exit callback covers the early exit(EXIT_FAILURE) paths */
+static void report_memory(void) {
+    static int reported = 0;
+
+    if (!reported) {
+        reported = 1;
+        ps3_mem_report();
+    }
+}
+
 /* Program exit callback */
 static void program_exit_callback(void) {
     gcmSetWaitFlip(context);
     rsxFinish(context, 1);
+    report_memory();
 }
 
 /* Main function */
@@ -130,8 +697,25 @@ int main(int argc, char *argv[]) {
     /* Register exit callback */
     atexit(program_exit_callback);
 
-    /* Run the text generation */
-    test_generate();
+    set_exp_mode(EXP_MODE);
+    ps3_set_large_pages(USE_LARGE_PAGES);
+
+    /* Run the requested mode, plain text generation by default */
+    if (argc > 1 && strcmp(argv[1], "chat") == 0) {
+        test_chat(1);
+    } else if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        test_batch(1);
+    } else if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        test_bench(1, 0);
+    } else if (argc > 1 && strcmp(argv[1], "kernels") == 0) {
+        test_bench(1, 1);
+    } else if (argc > 1 && strcmp(argv[1], "server") == 0) {
+        test_server(1);
+    } else if (argc > 1 && strcmp(argv[1], "beam") == 0) {
+        test_beam(1);
+    } else {
+        test_generate();
+    }
 
     /* Wait for dialog */
     dialog_action = 0;
@@ -141,6 +725,8 @@ int main(int argc, char *argv[]) {
     }
 
     msgDialogAbort();
+    report_memory();
+    fflush(stdout);
     
     /* Return to PS3Load */
     sysProcessExitSpawn2("/dev_hdd0/game/PSL145310/RELOAD.SELF", NULL, NULL, NULL, 0, 1001, SYS_PROCESS_SPAWN_STACK_SIZE_1M);
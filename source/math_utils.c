@@ -1,20 +1,133 @@
 #include "math_utils.h"
+#include "gemv.h"
+#include "gemv_kernel.h"
+#include "tiled.h"
+#include "memory_utils.h"
 #include <math.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
-void rmsnorm(float* o, float* x, float* weight, int size) {
-    /* calculate sum of squares */
+float sum_squares(const float* x, int size) {
     float ss = 0.0f;
     int j;
     for (j = 0; j < size; j++) {
         ss += x[j] * x[j];
     }
+    return ss;
+}
+
+float rms_scale_ss(float ss, int size) {
     ss /= size;
     ss += 1e-5f;
-    ss = 1.0f / sqrtf(ss);
-    /* normalize and scale */
+    return 1.0f / sqrtf(ss);
+}
+
+float rms_scale(const float* x, int size) {
+    return rms_scale_ss(sum_squares(x, size), size);
+}
+
+void rmsnorm_scaled(float* o, const float* x, const float* weight, float scale, int size) {
+    int j;
     for (j = 0; j < size; j++) {
-        o[j] = weight[j] * (ss * x[j]);
+        o[j] = weight[j] * (scale * x[j]);
+    }
+}
+
+void rmsnorm(float* o, float* x, float* weight, int size) {
+    rmsnorm_scaled(o, x, weight, rms_scale(x, size), size);
+}
+
+int exp_mode = EXP_EXACT;
+
+void set_exp_mode(int mode) {
+    exp_mode = mode;
+}
+
+static ExpRange exp_seen;
+static int exp_tracking = 0;
+
+void exp_range_begin(void) {
+    exp_seen.softmax_min = 0.0f;
+    exp_seen.silu_min = 0.0f;
+    exp_seen.silu_max = 0.0f;
+    exp_tracking = 1;
+}
+
+void exp_range_end(ExpRange* range) {
+    exp_tracking = 0;
+    *range = exp_seen;
+}
+
+static void track_range(const float* x, int n, float shift, float scale, float* lo, float* hi) {
+    int i;
+    for (i = 0; i < n; i++) {
+        float v = (x[i] + shift) * scale;
+        if (v < *lo) *lo = v;
+        if (hi && v > *hi) *hi = v;
+    }
+}
+
+/* The fast loops take four elements per trip: exp_fast is one dependent chain
+ * of about fifteen flops, and four independent ones keep the in-order PPU's
+ * pipelined FPU busy where one would stall on every step */
+void exp_shifted(float* x, int n, float shift) {
+    int i;
+    if (exp_tracking) {
+        track_range(x, n, shift, 1.0f, &exp_seen.softmax_min, NULL);
+    }
+    if (exp_mode == EXP_FAST) {
+        for (i = 0; i + 4 <= n; i += 4) {
+            float e0 = exp_fast(x[i] + shift);
+            float e1 = exp_fast(x[i + 1] + shift);
+            float e2 = exp_fast(x[i + 2] + shift);
+            float e3 = exp_fast(x[i + 3] + shift);
+            x[i] = e0; x[i + 1] = e1; x[i + 2] = e2; x[i + 3] = e3;
+        }
+        for (; i < n; i++) {
+            x[i] = exp_fast(x[i] + shift);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            x[i] = expf(x[i] + shift);
+        }
+    }
+}
+
+void swiglu(float* hb, const float* hb2, float scale, int n) {
+    int i;
+    if (exp_tracking) {
+        track_range(hb, n, 0.0f, scale, &exp_seen.silu_min, &exp_seen.silu_max);
+    }
+    if (exp_mode == EXP_FAST) {
+        /* below -80 silu is 0 to float precision; SILU_FAST's clamp keeps 1/(1+e) out of the denormals */
+#define SILU_FAST(v) ((v) / (1.0f + exp_fast((v) < -80.0f ? 80.0f : -(v))))
+        for (i = 0; i + 4 <= n; i += 4) {
+            float v0 = hb[i] * scale, v1 = hb[i + 1] * scale, v2 = hb[i + 2] * scale, v3 = hb[i + 3] * scale;
+            v0 = SILU_FAST(v0);
+            v1 = SILU_FAST(v1);
+            v2 = SILU_FAST(v2);
+            v3 = SILU_FAST(v3);
+            hb[i] = v0 * (hb2[i] * scale);
+            hb[i + 1] = v1 * (hb2[i + 1] * scale);
+            hb[i + 2] = v2 * (hb2[i + 2] * scale);
+            hb[i + 3] = v3 * (hb2[i + 3] * scale);
+        }
+        for (; i < n; i++) {
+            float val = hb[i] * scale;
+            val = SILU_FAST(val);
+            hb[i] = val * (hb2[i] * scale);
+        }
+#undef SILU_FAST
+    } else {
+        for (i = 0; i < n; i++) {
+            float val = hb[i] * scale;
+            /* silu(x)=x*σ(x), where σ(x) is the logistic sigmoid */
+            val *= (1.0f / (1.0f + expf(-val)));
+            /* elementwise multiply with w3(x) */
+            val *= hb2[i] * scale;
+            hb[i] = val;
+        }
     }
 }
 
@@ -29,8 +142,8 @@ void softmax(float* x, int size) {
     }
     /* exp and sum */
     float sum = 0.0f;
+    exp_shifted(x, size, -max_val);
     for (i = 0; i < size; i++) {
-        x[i] = expf(x[i] - max_val);
         sum += x[i];
     }
     /* normalize */
@@ -52,128 +165,958 @@ void matmul(float* xout, float* x, float* w, int n, int d) {
     }
 }
 
-void forward_impl(Config* config, TransformerWeights* weights, RunState* state, int token, int pos) {
-    /* a few convenience variables */
-    float *x = state->x;
-    int dim = config->dim;
-    int kv_dim = (config->dim * config->n_kv_heads) / config->n_heads;
-    int kv_mul = config->n_heads / config->n_kv_heads; /* integer multiplier of the kv sharing */
-    int hidden_dim = config->hidden_dim;
-    int head_size = dim / config->n_heads;
-
-    /* copy the token embedding into x */
-    float* content_row = weights->token_embedding_table + token * dim;
-    memcpy(x, content_row, dim * sizeof(*x));
-
-    /* forward all the layers */
-    int l, h, i, t;
-    for (l = 0; l < config->n_layers; l++) {
-        /* attention rmsnorm */
-        rmsnorm(state->xb, x, weights->rms_att_weight + l*dim, dim);
-
-        /* compute key and value vectors for this position */
-        int loff = l * config->seq_len * kv_dim; /* kv cache layer offset */
-        float* key_cache_row = state->key_cache + loff + pos * kv_dim;
-        float* value_cache_row = state->value_cache + loff + pos * kv_dim;
-
-        /* qkv matmuls for this position */
-        matmul(state->q, state->xb, weights->wq + l*dim*dim, dim, dim);
-        matmul(key_cache_row, state->xb, weights->wk + l*dim*kv_dim, dim, kv_dim);
-        matmul(value_cache_row, state->xb, weights->wv + l*dim*kv_dim, dim, kv_dim);
-
-        /* RoPE relative positional encoding: complex-valued rotate q and k in each head */
-        for (i = 0; i < dim; i+=2) {
-            int head_dim = i % head_size;
-            float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
+float* rope_table_create(Config* p) {
+    int head_size = p->dim / p->n_heads;
+    float* table = (float*)ps3_malloc_tagged((size_t)p->seq_len * head_size * sizeof(float), MEM_WEIGHTS);
+    float* row;
+    int pos, i;
+
+    if (!table) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    /* the same expressions the forward pass used, so the rotations are bit-identical */
+    for (pos = 0; pos < p->seq_len; pos++) {
+        row = table + (size_t)pos * head_size;
+        for (i = 0; i < head_size; i += 2) {
+            float freq = 1.0f / powf(10000.0f, i / (float)head_size);
             float val = pos * freq;
-            float fcr = cosf(val);
-            float fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; /* how many vectors? 2 = q & k, 1 = q only */
-            int v;
-            for (v = 0; v < rotn; v++) {
-                float* vec = (v == 0) ? state->q : key_cache_row;
-                float v0 = vec[i];
-                float v1 = vec[i+1];
-                vec[i]   = v0 * fcr - v1 * fci;
-                vec[i+1] = v0 * fci + v1 * fcr;
-            }
+            row[i] = cosf(val);
+            row[i + 1] = sinf(val);
+        }
+    }
+    return table;
+}
+
+/* Widening through a lookup table: the PPU has no fp16 hardware, and doing it
+ * with integer bit tricks would move every value from a GPR to an FPR through
+ * memory (a load-hit-store stall per weight). The table load goes straight to an FPR. */
+float fp16_table[65536];
+
+void fp16_init(void) {
+    static int initialized = 0;
+    uint32_t h, bits;
+    float f;
+
+    if (initialized) {
+        return;
+    }
+    for (h = 0; h < 65536; h++) {
+        uint32_t sign = (h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        if (exponent == 0x1f) {
+            bits = sign | 0x7f800000 | (mantissa << 13); /* inf / nan */
+            memcpy(&f, &bits, sizeof(float));
+        } else if (exponent == 0) {
+            f = ldexpf((float)mantissa, -24); /* zero / subnormal */
+            if (sign) f = -f;
+        } else {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+            memcpy(&f, &bits, sizeof(float));
+        }
+        fp16_table[h] = f;
+    }
+    initialized = 1;
+}
+
+uint16_t fp32_to_fp16(float value) {
+    /* round to nearest even; only used at load time */
+    uint32_t bits, sign, mantissa;
+    int exponent;
+
+    memcpy(&bits, &value, sizeof(float));
+    sign = (bits >> 16) & 0x8000;
+    exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0); /* inf / nan */
+    }
+    if (exponent >= 0x1f) {
+        return sign | 0x7c00; /* overflow to inf */
+    }
+    if (exponent <= 0) {
+        /* subnormal half (or zero) */
+        uint32_t shift, half, rest;
+        if (exponent < -10) {
+            return sign;
         }
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        if (rest > (1u << (shift - 1)) || (rest == (1u << (shift - 1)) && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    {
+        uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        /* a carry out of the mantissa correctly bumps the exponent */
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+            half++;
+        }
+        return (uint16_t)half;
+    }
+}
+
+void matmul_fp16(float* xout, float* x, const uint16_t* w, int n, int d) {
+    /* W (d,n) @ x (n,) -> xout (d,), with W in half precision */
+    int i, j;
+    for (i = 0; i < d; i++) {
+        const uint16_t* row = w + (size_t)i * n;
+        float val = 0.0f;
+        for (j = 0; j < n; j++) {
+            val += fp16_to_fp32(row[j]) * x[j];
+        }
+        xout[i] = val;
+    }
+}
+
+void matmul_rows_fp16(float* xout, float* x, const uint16_t* w, int n, const int* rows, int n_rows) {
+    int r, j;
+    for (r = 0; r < n_rows; r++) {
+        const uint16_t* row = w + (size_t)rows[r] * n;
+        float val = 0.0f;
+        for (j = 0; j < n; j++) {
+            val += fp16_to_fp32(row[j]) * x[j];
+        }
+        xout[r] = val;
+    }
+}
+
+/* int8 is widened through a table for the same reason as fp16 */
+float q8_table[256];
+
+void q8_init(void) {
+    static int initialized = 0;
+    int i;
+
+    if (initialized) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        q8_table[i] = (float)(int8_t)i;
+    }
+    initialized = 1;
+}
+
+void matmul_q8(float* xout, float* x, const int8_t* w, const float* scales, int n, int d) {
+    /* W (d,n) @ x (n,) -> xout (d,), with W in int8 and one scale per row */
+    int i, j;
+    for (i = 0; i < d; i++) {
+        const int8_t* row = w + (size_t)i * n;
+        float val = 0.0f;
+        for (j = 0; j < n; j++) {
+            val += q8_to_fp32(row[j]) * x[j];
+        }
+        xout[i] = val * scales[i];
+    }
+}
+
+void matmul_rows_q8(float* xout, float* x, const int8_t* w, const float* scales, int n,
+                    const int* rows, int n_rows) {
+    int r, j;
+    for (r = 0; r < n_rows; r++) {
+        const int8_t* row = w + (size_t)rows[r] * n;
+        float val = 0.0f;
+        for (j = 0; j < n; j++) {
+            val += q8_to_fp32(row[j]) * x[j];
+        }
+        xout[r] = val * scales[rows[r]];
+    }
+}
+
+/* int8 rows against BATCH vectors at once, each row widened once for all of
+ * them; BATCH is a literal per instance so the accumulators stay in registers */
+#define MATMUL_Q8_BATCH(name, BATCH) \
+static void name(float* xout, const float* x, const int8_t* w, const float* scales, int n, int d) { \
+    float acc[BATCH]; \
+    int i, j, b; \
+    for (i = 0; i < d; i++) { \
+        const int8_t* row = w + (size_t)i * n; \
+        for (b = 0; b < BATCH; b++) { \
+            acc[b] = 0.0f; \
+        } \
+        for (j = 0; j < n; j++) { \
+            float wj = q8_to_fp32(row[j]); \
+            for (b = 0; b < BATCH; b++) { \
+                acc[b] += wj * x[(size_t)b * n + j]; \
+            } \
+        } \
+        for (b = 0; b < BATCH; b++) { \
+            xout[(size_t)b * d + i] = acc[b] * scales[i]; \
+        } \
+    } \
+}
+MATMUL_Q8_BATCH(matmul_q8_b2, 2)
+MATMUL_Q8_BATCH(matmul_q8_b3, 3)
+MATMUL_Q8_BATCH(matmul_q8_b4, 4)
+MATMUL_Q8_BATCH(matmul_q8_b5, 5)
+MATMUL_Q8_BATCH(matmul_q8_b6, 6)
+MATMUL_Q8_BATCH(matmul_q8_b7, 7)
+MATMUL_Q8_BATCH(matmul_q8_b8, 8)
+#undef MATMUL_Q8_BATCH
+
+typedef void (*MatmulQ8Batch)(float* xout, const float* x, const int8_t* w, const float* scales, int n, int d);
+
+/* Indexed by batch size; 0 and 1 are unused */
+static const MatmulQ8Batch matmul_q8_batches[GEMV_MAX_BATCH + 1] = {
+    NULL, NULL, matmul_q8_b2, matmul_q8_b3, matmul_q8_b4, matmul_q8_b5, matmul_q8_b6, matmul_q8_b7, matmul_q8_b8
+};
+
+void matmul_q8_batch(float* xout, float* x, const int8_t* w, const float* scales, int n, int d, int batch) {
+    int b, chunk;
+    for (b = 0; b < batch; b += chunk) {
+        chunk = batch - b < GEMV_MAX_BATCH ? batch - b : GEMV_MAX_BATCH;
+        if (chunk == 1) {
+            matmul_q8(xout + (size_t)b * d, x + (size_t)b * n, w, scales, n, d);
+        } else {
+            matmul_q8_batches[chunk](xout + (size_t)b * d, x + (size_t)b * n, w, scales, n, d);
+        }
+    }
+}
+
+void embedding_row(TransformerWeights* weights, int token, int dim, float* out) {
+    int i;
+    if (weights->token_embedding_q8) {
+        int8_t* content_row = weights->token_embedding_q8 + (size_t)token * dim;
+        float scale = weights->token_embedding_scale[token];
+        for (i = 0; i < dim; i++) {
+            out[i] = q8_to_fp32(content_row[i]) * scale;
+        }
+    } else if (weights->token_embedding_table_f16) {
+        uint16_t* content_row = weights->token_embedding_table_f16 + (size_t)token * dim;
+        for (i = 0; i < dim; i++) {
+            out[i] = fp16_to_fp32(content_row[i]);
+        }
+    } else {
+        memcpy(out, weights->token_embedding_table + (size_t)token * dim, dim * sizeof(float));
+    }
+}
+
+/* Row-split execution: one matmul's output rows cut into one slice per thread */
+typedef struct {
+    float* xout;
+    const float* x;
+    const void* w;           /* float or uint16_t rows, int8 rows with scales */
+    const float* scales;     /* set for int8 weights */
+    int format;
+    int n;
+    int d;
+    int rows;                /* per slice */
+} RowSplitJob;
+
+static void row_split_task(void* ctx, int index) {
+    RowSplitJob* job = (RowSplitJob*)ctx;
+    int first = index * job->rows;
+    int rows = job->d - first < job->rows ? job->d - first : job->rows;
+
+    if (rows <= 0) {
+        return;
+    }
+    if (job->scales) {
+        matmul_q8(job->xout + first, (float*)job->x, (const int8_t*)job->w + (size_t)first * job->n,
+                  job->scales + first, job->n, rows);
+    } else if (job->format == GEMV_FP16) {
+        gemv(job->xout + first, job->x, (const uint16_t*)job->w + (size_t)first * job->n, job->format, job->n, rows);
+    } else {
+        gemv(job->xout + first, job->x, (const float*)job->w + (size_t)first * job->n, job->format, job->n, rows);
+    }
+}
+
+static void row_split(RunState* s, float* xout, const float* x, const void* w, const float* scales, int format,
+                      int n, int d) {
+    RowSplitJob job;
+    int slices = thread_pool_size(s->pool);
+
+    job.xout = xout;
+    job.x = x;
+    job.w = w;
+    job.scales = scales;
+    job.format = format;
+    job.n = n;
+    job.d = d;
+    /* slices a multiple of 8 rows so the register-blocked kernels keep their full blocks */
+    job.rows = ((d + slices - 1) / slices + 7) & ~7;
+    thread_pool_run(s->pool, (d + job.rows - 1) / job.rows, row_split_task, &job);
+}
+
+/* W @ x for the slice of a weight matrix starting at element `offset`, in
+ * whichever precision it is stored (w16 is NULL for fp32 weights), through the
+ * GEMV kernel tuned for its shape; staged tile by tile in tiled mode, or
+ * spread over the worker pool by rows in row-split mode */
+static void matmul_weights(RunState* s, float* xout, float* x, float* w32, uint16_t* w16, size_t offset,
+                           int n, int d) {
+    const void* w = w16 ? (const void*)(w16 + offset) : (const void*)(w32 + offset);
+    int format = w16 ? GEMV_FP16 : GEMV_FP32;
+
+    if (s->tiled) {
+        tiled_gemv(s->tiled, xout, x, w, format, n, d);
+    } else if (s->row_split && s->pool) {
+        row_split(s, xout, x, w, NULL, format, n, d);
+    } else {
+        gemv(xout, x, w, format, n, d);
+    }
+}
+
+/* x += W @ in for an output projection, returning the sum of squares of the
+ * new x for the norm after it. Read in place the add and the sum happen in the
+ * GEMV kernel's stores; tiled and row-split execution go through xb2 and one
+ * pass over it, with the same result. */
+static float matmul_weights_residual(RunState* s, float* x, float* in, float* w32, uint16_t* w16, size_t offset,
+                                     int n, int d) {
+    float ss = 0.0f;
+    int i;
+
+    if (!s->tiled && !(s->row_split && s->pool)) {
+        return gemv_residual(x, in, w16 ? (const void*)(w16 + offset) : (const void*)(w32 + offset),
+                             w16 ? GEMV_FP16 : GEMV_FP32, n, d);
+    }
+    matmul_weights(s, s->xb2, in, w32, w16, offset, n, d);
+    for (i = 0; i < d; i++) {
+        x[i] += s->xb2[i];
+        ss += x[i] * x[i];
+    }
+    return ss;
+}
+
+/* Same for the int8 classifier */
+static void matmul_q8_weights(RunState* s, float* xout, float* x, const int8_t* w, const float* scales, int n, int d) {
+    if (s->tiled) {
+        tiled_matmul_q8(s->tiled, xout, x, w, scales, n, d);
+    } else if (s->row_split && s->pool) {
+        row_split(s, xout, x, w, scales, GEMV_FP32, n, d);
+    } else {
+        matmul_q8(xout, x, w, scales, n, d);
+    }
+}
+
+/* The KV cache can be laid out position-major (layer, seq_len, kv_dim) as in run.c,
+ * or head-major (layer, n_kv_heads, seq_len, head_size). Either way one kv head's
+ * rows are a base offset plus a fixed stride per position. */
+static size_t kv_head_offset(Config* p, RunState* s, int l, int kv_head) {
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = head_size * p->n_kv_heads;
+    if (s->kv_layout == KV_LAYOUT_HEAD_MAJOR) {
+        return ((size_t)l * p->n_kv_heads + kv_head) * p->seq_len * head_size;
+    }
+    return (size_t)l * p->seq_len * kv_dim + kv_head * head_size;
+}
+
+static int kv_pos_stride(Config* p, RunState* s) {
+    int head_size = p->dim / p->n_heads;
+    return s->kv_layout == KV_LAYOUT_POSITION_MAJOR ? head_size * p->n_kv_heads : head_size;
+}
+
+/* Key row (or value row, with values set) of position t for layer l, kv head g.
+ * The following rows of the same head are kv_pos_stride() apart up to the end
+ * of the KV block, or all the way with the contiguous layouts. */
+static float* kv_row(Config* p, RunState* s, int values, int l, int g, int t) {
+    int block;
+    if (s->kv_layout == KV_LAYOUT_PAGED) {
+        block = s->kv_blocks[t / KV_BLOCK_SIZE];
+        return (values ? kv_block_values(s->kv_pool, block, l, g) : kv_block_keys(s->kv_pool, block, l, g))
+               + (size_t)(t % KV_BLOCK_SIZE) * (p->dim / p->n_heads);
+    }
+    return (values ? s->value_cache : s->key_cache) + kv_head_offset(p, s, l, g) + (size_t)t * kv_pos_stride(p, s);
+}
 
-        /* multihead attention. iterate over all heads */
-        for (h = 0; h < config->n_heads; h++) {
-            /* get the query vector for this head */
-            float* q = state->q + h * head_size;
-            /* attention scores for this head */
-            float* att = state->att + h * config->seq_len;
-            /* iterate over all timesteps, including the current one */
-            for (t = 0; t <= pos; t++) {
-                /* get the key vector for this head and at this timestep */
-                float* k = state->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                /* calculate the attention score as the dot product of q and k */
+int kv_cache_reserve(RunState* s, int pos) {
+    int* entry;
+    int block;
+
+    if (s->kv_layout != KV_LAYOUT_PAGED) {
+        return 1;
+    }
+    entry = &s->kv_blocks[pos / KV_BLOCK_SIZE];
+    block = *entry < 0 ? kv_block_alloc(s->kv_pool) : kv_block_make_private(s->kv_pool, *entry);
+    if (block < 0) {
+        return 0;
+    }
+    *entry = block;
+    return 1;
+}
+
+void kv_cache_share(RunState* dst, RunState* src, int n_pos) {
+    int n = (n_pos + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    int b;
+
+    if (dst->kv_layout != KV_LAYOUT_PAGED) {
+        return;
+    }
+    kv_cache_reset(dst);
+    for (b = 0; b < n; b++) {
+        kv_block_ref(src->kv_pool, src->kv_blocks[b]);
+        dst->kv_blocks[b] = src->kv_blocks[b];
+    }
+}
+
+void kv_cache_reset(RunState* s) {
+    int b;
+    for (b = 0; b < s->kv_n_table; b++) {
+        if (s->kv_blocks[b] >= 0) {
+            kv_block_release(s->kv_pool, s->kv_blocks[b]);
+            s->kv_blocks[b] = -1;
+        }
+    }
+}
+
+int kv_cache_blocks(RunState* s) {
+    int b, n = 0;
+    for (b = 0; b < s->kv_n_table; b++) {
+        n += s->kv_blocks[b] >= 0;
+    }
+    return n;
+}
+
+/* Timesteps scored per block of the fused attention kernel */
+#define ATTN_BLOCK 16
+
+#if KV_BLOCK_SIZE % ATTN_BLOCK != 0
+#error "KV_BLOCK_SIZE must be a multiple of ATTN_BLOCK"
+#endif
+
+/* Attention for query heads m0..m1-1 of the kv_mul that share kv head g, so
+ * every key and value row is loaded once per slice rather than once per head.
+ * Single pass with an online softmax: per block of timesteps we score the keys,
+ * raise the running max if needed (rescaling the running sum and the partial
+ * output accordingly) and accumulate the weighted values straight into xb.
+ * The queries are expected to be pre-scaled by 1/sqrt(head_size). */
+static void attention_heads(Config* p, RunState* s, int l, int g, int m0, int m1, int pos) {
+    int head_size = p->dim / p->n_heads;
+    int stride = kv_pos_stride(p, s);
+    int h0 = g * (p->n_heads / p->n_kv_heads);
+    float* keys;
+    float* values;
+    float scores[ATTN_BLOCK];
+    int t0, n, m, j, i;
+
+    for (m = m0; m < m1; m++) {
+        s->att_max[h0 + m] = -1e30f;
+        s->att_sum[h0 + m] = 0.0f;
+        memset(s->xb + (h0 + m) * head_size, 0, head_size * sizeof(float));
+    }
+
+    for (t0 = 0; t0 <= pos; t0 += ATTN_BLOCK) {
+        n = pos + 1 - t0 < ATTN_BLOCK ? pos + 1 - t0 : ATTN_BLOCK;
+        /* rows of one block of timesteps never straddle a paged KV block */
+        keys = kv_row(p, s, 0, l, g, t0);
+        values = kv_row(p, s, 1, l, g, t0);
+        /* the block's key and value rows stay in cache while the slice's heads reuse them */
+        for (m = m0; m < m1; m++) {
+            float* q = s->q + (h0 + m) * head_size;
+            float* xb = s->xb + (h0 + m) * head_size;
+            float* k = keys;
+            float* v = values;
+            float block_max = -1e30f;
+            float running_max = s->att_max[h0 + m];
+            float sum = s->att_sum[h0 + m];
+
+            /* attention scores for this block */
+            for (j = 0; j < n; j++, k += stride) {
                 float score = 0.0f;
                 for (i = 0; i < head_size; i++) {
                     score += q[i] * k[i];
                 }
-                score /= sqrtf(head_size);
-                /* save the score to the attention buffer */
-                att[t] = score;
+                scores[j] = score;
+                if (score > block_max) {
+                    block_max = score;
+                }
             }
 
-            /* softmax the scores to get attention weights */
-            softmax(att, pos + 1);
-
-            /* weighted sum of the values, store into xb */
-            float* xb = state->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(float));
-            for (t = 0; t <= pos; t++) {
-                /* get the value vector for this head and at this timestep */
-                float* v = state->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                /* get the attention weight for this timestep */
-                float a = att[t];
-                /* accumulate the weighted value into xb */
+            /* a new maximum rescales everything accumulated so far */
+            if (block_max > running_max) {
+                float correction = exp_mode == EXP_FAST ? exp_fast(running_max - block_max)
+                                                        : expf(running_max - block_max);
+                sum *= correction;
+                for (i = 0; i < head_size; i++) {
+                    xb[i] *= correction;
+                }
+                running_max = block_max;
+            }
+
+            /* weighted sum of the values */
+            exp_shifted(scores, n, -running_max);
+            for (j = 0; j < n; j++, v += stride) {
+                float a = scores[j];
+                sum += a;
                 for (i = 0; i < head_size; i++) {
                     xb[i] += a * v[i];
                 }
             }
+
+            s->att_max[h0 + m] = running_max;
+            s->att_sum[h0 + m] = sum;
         }
+    }
 
-        /* final matmul to get the output of the attention */
-        matmul(state->xb2, state->xb, weights->wo + l*dim*dim, dim, dim);
+    /* normalize */
+    for (m = m0; m < m1; m++) {
+        float* xb = s->xb + (h0 + m) * head_size;
+        float inv_sum = 1.0f / s->att_sum[h0 + m];
+        for (i = 0; i < head_size; i++) {
+            xb[i] *= inv_sum;
+        }
+    }
+}
 
-        /* residual connection back into x */
-        for (i = 0; i < dim; i++) {
-            x[i] += state->xb2[i];
+/* Arguments for one layer's attention, shared read-only by the pool workers */
+typedef struct {
+    Config* config;
+    RunState* state;
+    int layer;
+    int pos;
+    int parts;       /* slices each group's query heads are split into */
+} AttentionJob;
+
+/* Pool task: one slice of a kv head group's query heads. Slices write disjoint
+ * parts of xb, att_max and att_sum and keep their block scores on their own
+ * stack, so nothing is shared. Every head is computed the same way whatever
+ * slice it lands in, so the split doesn't change the result. */
+static void attention_task(void* ctx, int task) {
+    AttentionJob* job = (AttentionJob*)ctx;
+    int kv_mul = job->config->n_heads / job->config->n_kv_heads;
+    int g = task / job->parts;
+    int part = task % job->parts;
+
+    attention_heads(job->config, job->state, job->layer, g,
+                    part * kv_mul / job->parts, (part + 1) * kv_mul / job->parts, job->pos);
+}
+
+void attention(Config* config, RunState* state, int l, int pos) {
+    AttentionJob job;
+    int kv_mul = config->n_heads / config->n_kv_heads;
+    int threads = thread_pool_size(state->pool);
+
+    job.config = config;
+    job.state = state;
+    job.layer = l;
+    job.pos = pos;
+    /* whole groups share each key and value load among the most heads; they are
+     * only split when there are fewer groups than threads (n_kv_heads == 1) */
+    job.parts = 1;
+    if (config->n_kv_heads < threads) {
+        job.parts = (threads + config->n_kv_heads - 1) / config->n_kv_heads;
+        if (job.parts > kv_mul) {
+            job.parts = kv_mul;
         }
+    }
+    thread_pool_run(state->pool, config->n_kv_heads * job.parts, attention_task, &job);
+}
 
-        /* ffn rmsnorm */
-        rmsnorm(state->xb, x, weights->rms_ffn_weight + l*dim, dim);
+/* Helpers for the specialized forward passes. They are forced inline so n, d
+ * and size are compile-time constants inside each instance; the summation order
+ * is the same as matmul/gemv and rmsnorm, so the results are too. The matmuls
+ * expand the gemv_kernel.h template for every row count and run the one the
+ * tuner picked for the shape, so they block rows exactly like gemv() would. */
+#define MATMUL_FIXED_TUNED(format, STORE) \
+    switch (gemv_kernel_rows(format, n, d)) { \
+    case 1: GEMV_LOOP(1, STORE) break; \
+    case 2: GEMV_LOOP(2, STORE) break; \
+    case 8: GEMV_LOOP(8, STORE) break; \
+    default: GEMV_LOOP(4, STORE) break; \
+    }
 
-        /* Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x)) */
-        matmul(state->hb, state->xb, weights->w1 + l*dim*hidden_dim, dim, hidden_dim);
-        matmul(state->hb2, state->xb, weights->w3 + l*dim*hidden_dim, dim, hidden_dim);
+static inline __attribute__((always_inline))
+void matmul_fixed(float* xout, const float* x, const float* w32, const uint16_t* w16, size_t offset, int n, int d) {
+    int i, j;
+    if (w16) {
+        const uint16_t* w = w16 + offset;
+#define WTYPE uint16_t
+#define GEMV_LOAD(v) fp16_to_fp32(v)
+        MATMUL_FIXED_TUNED(GEMV_FP16, GEMV_STORE)
+#undef GEMV_LOAD
+#undef WTYPE
+    } else {
+        const float* w = w32 + offset;
+#define WTYPE float
+#define GEMV_LOAD(v) (v)
+        MATMUL_FIXED_TUNED(GEMV_FP32, GEMV_STORE)
+#undef GEMV_LOAD
+#undef WTYPE
+    }
+}
 
-        /* SwiGLU non-linearity */
-        for (i = 0; i < hidden_dim; i++) {
-            float val = state->hb[i];
-            /* silu(x)=x*σ(x), where σ(x) is the logistic sigmoid */
-            val *= (1.0f / (1.0f + expf(-val)));
-            /* elementwise multiply with w3(x) */
-            val *= state->hb2[i];
-            state->hb[i] = val;
+static inline __attribute__((always_inline))
+float matmul_fixed_residual(float* xout, const float* x, const float* w32, const uint16_t* w16, size_t offset,
+                            int n, int d) {
+    float ss = 0.0f;
+    int i, j;
+    if (w16) {
+        const uint16_t* w = w16 + offset;
+#define WTYPE uint16_t
+#define GEMV_LOAD(v) fp16_to_fp32(v)
+        MATMUL_FIXED_TUNED(GEMV_FP16, GEMV_ADD)
+#undef GEMV_LOAD
+#undef WTYPE
+    } else {
+        const float* w = w32 + offset;
+#define WTYPE float
+#define GEMV_LOAD(v) (v)
+        MATMUL_FIXED_TUNED(GEMV_FP32, GEMV_ADD)
+#undef GEMV_LOAD
+#undef WTYPE
+    }
+    return ss;
+}
+#undef MATMUL_FIXED_TUNED
+
+static inline __attribute__((always_inline))
+float sum_squares_fixed(const float* x, int size) {
+    float ss = 0.0f;
+    int j;
+    for (j = 0; j < size; j++) {
+        ss += x[j] * x[j];
+    }
+    return ss;
+}
+
+static inline __attribute__((always_inline))
+void rmsnorm_scaled_fixed(float* o, const float* x, const float* weight, float scale, int size) {
+    int j;
+    for (j = 0; j < size; j++) {
+        o[j] = weight[j] * (scale * x[j]);
+    }
+}
+
+/* The generic forward pass: sizes from Config, tuned GEMV kernels, optional tiling */
+#define FWD_NAME forward_layers_generic
+#define FWD_ATTRS
+#define FWD_DIM (config->dim)
+#define FWD_HIDDEN (config->hidden_dim)
+#define FWD_N_HEADS (config->n_heads)
+#define FWD_N_KV_HEADS (config->n_kv_heads)
+#define FWD_MATMUL(xout, x, w32, w16, offset, n, d) matmul_weights(state, xout, x, w32, w16, offset, n, d)
+#define FWD_MATMUL_RESIDUAL(xout, x, w32, w16, offset, n, d) \
+    matmul_weights_residual(state, xout, x, w32, w16, offset, n, d)
+#define FWD_SUM_SQUARES(x, size) sum_squares(x, size)
+#define FWD_RMSNORM_SCALED(o, x, weight, scale, size) rmsnorm_scaled(o, x, weight, scale, size)
+#include "forward_template.h"
+
+/* Specialized instances for known shapes: every size is a literal, and the
+ * loops over them may be unrolled */
+#define FWD_FIXED_MATMUL(xout, x, w32, w16, offset, n, d) matmul_fixed(xout, x, w32, w16, offset, n, d)
+#define FWD_FIXED_MATMUL_RESIDUAL(xout, x, w32, w16, offset, n, d) \
+    matmul_fixed_residual(xout, x, w32, w16, offset, n, d)
+#define FWD_FIXED_SUM_SQUARES(x, size) sum_squares_fixed(x, size)
+#define FWD_FIXED_RMSNORM_SCALED(o, x, weight, scale, size) rmsnorm_scaled_fixed(o, x, weight, scale, size)
+
+#define FWD_NAME forward_layers_288_768_6_6
+#define FWD_ATTRS __attribute__((optimize("unroll-loops")))
+#define FWD_DIM 288
+#define FWD_HIDDEN 768
+#define FWD_N_HEADS 6
+#define FWD_N_KV_HEADS 6
+#define FWD_MATMUL FWD_FIXED_MATMUL
+#define FWD_MATMUL_RESIDUAL FWD_FIXED_MATMUL_RESIDUAL
+#define FWD_SUM_SQUARES FWD_FIXED_SUM_SQUARES
+#define FWD_RMSNORM_SCALED FWD_FIXED_RMSNORM_SCALED
+#include "forward_template.h"
+
+#define FWD_NAME forward_layers_512_1376_8_8
+#define FWD_ATTRS __attribute__((optimize("unroll-loops")))
+#define FWD_DIM 512
+#define FWD_HIDDEN 1376
+#define FWD_N_HEADS 8
+#define FWD_N_KV_HEADS 8
+#define FWD_MATMUL FWD_FIXED_MATMUL
+#define FWD_MATMUL_RESIDUAL FWD_FIXED_MATMUL_RESIDUAL
+#define FWD_SUM_SQUARES FWD_FIXED_SUM_SQUARES
+#define FWD_RMSNORM_SCALED FWD_FIXED_RMSNORM_SCALED
+#include "forward_template.h"
+
+#define FWD_NAME forward_layers_768_2048_12_12
+#define FWD_ATTRS __attribute__((optimize("unroll-loops")))
+#define FWD_DIM 768
+#define FWD_HIDDEN 2048
+#define FWD_N_HEADS 12
+#define FWD_N_KV_HEADS 12
+#define FWD_MATMUL FWD_FIXED_MATMUL
+#define FWD_MATMUL_RESIDUAL FWD_FIXED_MATMUL_RESIDUAL
+#define FWD_SUM_SQUARES FWD_FIXED_SUM_SQUARES
+#define FWD_RMSNORM_SCALED FWD_FIXED_RMSNORM_SCALED
+#include "forward_template.h"
+
+typedef void (*ForwardLayersFn)(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                                int l_begin, int l_end);
+
+typedef struct {
+    int dim;
+    int hidden_dim;
+    int n_heads;
+    int n_kv_heads;
+    ForwardLayersFn fn;
+} ForwardSpecialization;
+
+/* stories15M, stories42M and stories110M */
+static const ForwardSpecialization forward_specializations[] = {
+    { 288, 768, 6, 6, forward_layers_288_768_6_6 },
+    { 512, 1376, 8, 8, forward_layers_512_1376_8_8 },
+    { 768, 2048, 12, 12, forward_layers_768_2048_12_12 },
+};
+
+static ForwardLayersFn find_specialization(Config* config) {
+    int i;
+    for (i = 0; i < (int)(sizeof(forward_specializations) / sizeof(forward_specializations[0])); i++) {
+        const ForwardSpecialization* f = &forward_specializations[i];
+        if (f->dim == config->dim && f->hidden_dim == config->hidden_dim &&
+            f->n_heads == config->n_heads && f->n_kv_heads == config->n_kv_heads) {
+            return f->fn;
         }
+    }
+    return NULL;
+}
 
-        /* final matmul to get the output of the ffn */
-        matmul(state->xb, state->hb, weights->w2 + l*dim*hidden_dim, hidden_dim, dim);
+int forward_has_specialization(Config* config) {
+    return find_specialization(config) != NULL;
+}
 
-        /* residual connection */
-        for (i = 0; i < dim; i++) {
-            x[i] += state->xb[i];
+/* Picks the specialized instance for this shape if there is one; tiled and
+ * row-split execution need the generic path, which routes every matmul
+ * through matmul_weights */
+static void forward_layers(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                           int l_begin, int l_end) {
+    ForwardLayersFn fn = state->specialized && !state->tiled && !state->row_split ? find_specialization(config) : NULL;
+
+    /* a paged cache needs a private block for this position; callers that can
+     * back off (e.g. the server) reserve it themselves beforehand */
+    if (l_begin == 0 && !kv_cache_reserve(state, pos)) {
+        fprintf(stderr, "KV cache pool exhausted at pos %d\n", pos);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fn) {
+        fn(config, weights, state, token, pos, l_begin, l_end);
+    } else {
+        forward_layers_generic(config, weights, state, token, pos, l_begin, l_end);
+    }
+}
+
+void matmul_rows(float* xout, float* x, float* w, int n, const int* rows, int n_rows) {
+    /* gathered W[rows] (n_rows,n) @ x (n,) -> xout (n_rows,), xout[r] belongs to row rows[r] */
+    int r, j;
+    for (r = 0; r < n_rows; r++) {
+        float* row = w + (size_t)rows[r] * n;
+        float val = 0.0f;
+        for (j = 0; j < n; j++) {
+            val += row[j] * x[j];
         }
+        xout[r] = val;
     }
+}
 
-    /* final rmsnorm */
-    rmsnorm(x, x, weights->rms_final_weight, dim);
+void forward_impl(Config* config, TransformerWeights* weights, RunState* state, int token, int pos) {
+    forward_layers(config, weights, state, token, pos, 0, config->n_layers);
+    forward_classifier(config, weights, state);
+}
 
+void forward_impl_layers(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                         int l_begin, int l_end) {
+    forward_layers(config, weights, state, token, pos, l_begin, l_end);
+}
+
+void forward_classifier(Config* config, TransformerWeights* weights, RunState* state) {
     /* classifier into logits */
-    matmul(state->logits, x, weights->token_embedding_table, dim, config->vocab_size);
-}
\ No newline at end of file
+    if (weights->token_embedding_q8) {
+        matmul_q8_weights(state, state->logits, state->x, weights->token_embedding_q8, weights->token_embedding_scale,
+                          config->dim, config->vocab_size);
+    } else {
+        matmul_weights(state, state->logits, state->x, weights->token_embedding_table, weights->token_embedding_table_f16,
+                       0, config->dim, config->vocab_size);
+    }
+}
+
+void classifier_rows(Config* config, TransformerWeights* weights, RunState* state, const int* rows, int n_rows) {
+    if (weights->token_embedding_q8) {
+        matmul_rows_q8(state->logits, state->x, weights->token_embedding_q8, weights->token_embedding_scale,
+                       config->dim, rows, n_rows);
+    } else if (weights->token_embedding_table_f16) {
+        matmul_rows_fp16(state->logits, state->x, weights->token_embedding_table_f16, config->dim, rows, n_rows);
+    } else {
+        matmul_rows(state->logits, state->x, weights->token_embedding_table, config->dim, rows, n_rows);
+    }
+}
+
+void forward_impl_rows(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                       const int* rows, int n_rows) {
+    forward_layers(config, weights, state, token, pos, 0, config->n_layers);
+
+    /* classifier for the requested vocabulary rows only */
+    classifier_rows(config, weights, state, rows, n_rows);
+}
+
+/* matmul_weights for a batch of input rows, reading the weights in place */
+static void matmul_weights_batch(float* xout, float* x, float* w32, uint16_t* w16, size_t offset,
+                                 int n, int d, int batch) {
+    const void* w = w16 ? (const void*)(w16 + offset) : (const void*)(w32 + offset);
+    gemv_batch(xout, x, w, w16 ? GEMV_FP16 : GEMV_FP32, n, d, batch);
+}
+
+/* RoPE on q and k for position pos, then the score scaling folded into q,
+ * with the same arithmetic as the per-token forward pass */
+static void rope_scale(float* q, float* k, const float* rope, int dim, int kv_dim, int head_size, float q_scale) {
+    int i, v;
+    for (i = 0; i < dim; i+=2) {
+        int head_dim = i % head_size;
+        float fcr = rope[head_dim];
+        float fci = rope[head_dim + 1];
+        int rotn = i < kv_dim ? 2 : 1; /* how many vectors? 2 = q & k, 1 = q only */
+        for (v = 0; v < rotn; v++) {
+            float* vec = (v == 0) ? q : k;
+            float v0 = vec[i];
+            float v1 = vec[i+1];
+            vec[i]   = v0 * fcr - v1 * fci;
+            vec[i+1] = v0 * fci + v1 * fcr;
+        }
+    }
+    for (i = 0; i < dim; i++) {
+        q[i] *= q_scale;
+    }
+}
+
+void forward_impl_batch(Config* config, TransformerWeights* weights, RunState* seqs, const int* tokens,
+                        const int* pos, int batch) {
+    RunState* s = &seqs[0];  /* its buffers hold the rows of every sequence */
+    const int dim = config->dim;
+    const int kv_dim = (config->dim * config->n_kv_heads) / config->n_heads;
+    const int hidden_dim = config->hidden_dim;
+    const int head_size = config->dim / config->n_heads;
+    float q_scale = 1.0f / sqrtf(head_size);
+    float norm_scale;
+    float* xn = weights->norms_folded ? s->x : s->xb;  /* input rows of the matmuls after a norm */
+    int b, l, g, i;
+
+    for (b = 0; b < batch; b++) {
+        if (!kv_cache_reserve(&seqs[b], pos[b])) {
+            fprintf(stderr, "KV cache pool exhausted at pos %d\n", pos[b]);
+            exit(EXIT_FAILURE);
+        }
+        embedding_row(weights, tokens[b], dim, seqs[b].x);
+    }
+
+    for (l = 0; l < config->n_layers; l++) {
+        /* attention rmsnorm, then the qkv matmuls for every sequence at once;
+         * folded norms leave only 1/rms, applied per sequence below (x is
+         * unchanged until the residual, so it is computed there) */
+        if (!weights->norms_folded) {
+            for (b = 0; b < batch; b++) {
+                rmsnorm(seqs[b].xb, seqs[b].x, weights->rms_att_weight + l*dim, dim);
+            }
+        }
+        matmul_weights_batch(s->q, xn, weights->wq, weights->wq_f16, (size_t)l*dim*dim, dim, dim, batch);
+        matmul_weights_batch(s->k, xn, weights->wk, weights->wk_f16, (size_t)l*dim*kv_dim, dim, kv_dim, batch);
+        matmul_weights_batch(s->v, xn, weights->wv, weights->wv_f16, (size_t)l*dim*kv_dim, dim, kv_dim, batch);
+
+        /* positions, cache writes and attention are per sequence */
+        for (b = 0; b < batch; b++) {
+            norm_scale = weights->norms_folded ? rms_scale(seqs[b].x, dim) : 1.0f;
+            rope_scale(seqs[b].q, seqs[b].k, weights->rope + (size_t)pos[b] * head_size, dim, kv_dim, head_size,
+                       q_scale * norm_scale);
+            for (g = 0; g < config->n_kv_heads; g++) {
+                float* kr = kv_row(config, &seqs[b], 0, l, g, pos[b]);
+                float* vr = kv_row(config, &seqs[b], 1, l, g, pos[b]);
+                for (i = 0; i < head_size; i++) {
+                    kr[i] = seqs[b].k[g * head_size + i] * norm_scale;
+                    vr[i] = seqs[b].v[g * head_size + i] * norm_scale;
+                }
+            }
+            attention(config, &seqs[b], l, pos[b]);
+        }
+
+        /* attention output and residual */
+        matmul_weights_batch(s->xb2, s->xb, weights->wo, weights->wo_f16, (size_t)l*dim*dim, dim, dim, batch);
+        for (i = 0; i < batch * dim; i++) {
+            s->x[i] += s->xb2[i];
+        }
+
+        /* ffn */
+        if (!weights->norms_folded) {
+            for (b = 0; b < batch; b++) {
+                rmsnorm(seqs[b].xb, seqs[b].x, weights->rms_ffn_weight + l*dim, dim);
+            }
+        }
+        matmul_weights_batch(s->hb, xn, weights->w1, weights->w1_f16, (size_t)l*dim*hidden_dim,
+                             dim, hidden_dim, batch);
+        matmul_weights_batch(s->hb2, xn, weights->w3, weights->w3_f16, (size_t)l*dim*hidden_dim,
+                             dim, hidden_dim, batch);
+        for (b = 0; b < batch; b++) {
+            norm_scale = weights->norms_folded ? rms_scale(seqs[b].x, dim) : 1.0f;
+            swiglu(seqs[b].hb, seqs[b].hb2, norm_scale, hidden_dim);
+        }
+        matmul_weights_batch(s->xb, s->hb, weights->w2, weights->w2_f16, (size_t)l*dim*hidden_dim,
+                             hidden_dim, dim, batch);
+        for (i = 0; i < batch * dim; i++) {
+            s->x[i] += s->xb[i];
+        }
+    }
+
+    /* final rmsnorm and the classifier */
+    for (b = 0; b < batch; b++) {
+        rmsnorm(seqs[b].x, seqs[b].x, weights->rms_final_weight, dim);
+    }
+    if (weights->token_embedding_q8) {
+        matmul_q8_batch(s->logits, s->x, weights->token_embedding_q8, weights->token_embedding_scale,
+                        dim, config->vocab_size, batch);
+    } else {
+        matmul_weights_batch(s->logits, s->x, weights->token_embedding_table, weights->token_embedding_table_f16,
+                             0, dim, config->vocab_size, batch);
+    }
+}
+
+void kv_cache_shift(Config* config, RunState* state, int n_keep, int n_discard, int n_past) {
+    int head_size = config->dim / config->n_heads;
+    int l, g, t, i, b;
+    float* fcr;
+    float* fci;
+
+    if (n_discard <= 0 || n_keep + n_discard > n_past) {
+        return;
+    }
+
+    /* paged: the rows written below need blocks of their own */
+    for (t = n_keep; t < n_past - n_discard; t += KV_BLOCK_SIZE - t % KV_BLOCK_SIZE) {
+        if (!kv_cache_reserve(state, t)) {
+            fprintf(stderr, "KV cache pool exhausted\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* the rotation by -n_discard positions only depends on the pair index inside
+     * a head; q is free between forward passes and holds a head's worth of both */
+    fcr = state->q;
+    fci = state->q + head_size / 2;
+    for (i = 0; i < head_size; i += 2) {
+        float freq = 1.0f / powf(10000.0f, i / (float)head_size);
+        float val = -n_discard * freq;
+        fcr[i / 2] = cosf(val);
+        fci[i / 2] = sinf(val);
+    }
+
+    for (l = 0; l < config->n_layers; l++) {
+        for (g = 0; g < config->n_kv_heads; g++) {
+            for (t = n_keep + n_discard; t < n_past; t++) {
+                float* k = kv_row(config, state, 0, l, g, t - n_discard);
+                memcpy(k, kv_row(config, state, 0, l, g, t), head_size * sizeof(float));
+                memcpy(kv_row(config, state, 1, l, g, t - n_discard), kv_row(config, state, 1, l, g, t),
+                       head_size * sizeof(float));
+                for (i = 0; i < head_size; i += 2) {
+                    float v0 = k[i];
+                    float v1 = k[i+1];
+                    k[i]   = v0 * fcr[i / 2] - v1 * fci[i / 2];
+                    k[i+1] = v0 * fci[i / 2] + v1 * fcr[i / 2];
+                }
+            }
+        }
+    }
+
+    /* paged: blocks past the new end go back to the pool */
+    for (b = (n_past - n_discard + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE; b < state->kv_n_table; b++) {
+        if (state->kv_blocks[b] >= 0) {
+            kv_block_release(state->kv_pool, state->kv_blocks[b]);
+            state->kv_blocks[b] = -1;
+        }
+    }
+}
@@ -4,11 +4,153 @@
 #include "transformer.h"
 
 /* Core math functions copied from run.c */
+/* 1/rms(x), the scalar rmsnorm multiplies by before the weights */
+float rms_scale(const float* x, int size);
+/* rmsnorm in its parts: the sum of squares, 1/rms from it, and the scaling pass */
+float sum_squares(const float* x, int size);
+float rms_scale_ss(float ss, int size);
+void rmsnorm_scaled(float* o, const float* x, const float* weight, float scale, int size);
 void rmsnorm(float* o, float* x, float* weight, int size);
 void softmax(float* x, int size);
 void matmul(float* xout, float* x, float* w, int n, int d);
 
+/* matmul over a subset of the rows of w, compacted into xout[0..n_rows) */
+void matmul_rows(float* xout, float* x, float* w, int n, const int* rows, int n_rows);
+
+/* Exponential behind softmax, attention and the SwiGLU: libm's expf
+ * (EXP_EXACT) or exp_fast (EXP_FAST). exp_mode starts out as EXP_EXACT; the
+ * app sets it from EXP_MODE in llama_ps3.c, which is EXP_FAST. Pick it once
+ * before the first forward pass; every forward variant follows it, so they
+ * still agree. */
+#define EXP_EXACT 0
+#define EXP_FAST 1
+extern int exp_mode;
+void set_exp_mode(int mode);
+
+/* Branch-free expf: Cody-Waite reduction to x = n*ln2 + r with |r| <= ln2/2,
+ * a degree-6 polynomial for e^r (Cephes' expf coefficients) and n put straight
+ * into the exponent bits. n is rounded by adding 1.5*2^23, which leaves it in
+ * the low mantissa bits, so there is no float/int round trip on the critical
+ * path. Max relative error against double exp is below 1e-7 (about 8e-8)
+ * over [-87, 88]; arguments are clamped to that range, so it never returns 0
+ * or inf. bench_fast_exp sweeps the error over that range and over the
+ * arguments a model really produces. */
+static inline float exp_fast(float x) {
+    union { float f; int32_t i; } bits;
+    float n, r, p;
+
+    x = x < -87.0f ? -87.0f : x;
+    x = x > 88.0f ? 88.0f : x;
+    bits.f = x * 1.44269504088896341f + 12582912.0f;
+    n = bits.f - 12582912.0f;
+    r = x - n * 0.693359375f;
+    r = r - n * -2.12194440e-4f;
+    p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    /* the low mantissa bits hold n + 0x400000 */
+    bits.i = (bits.i - 0x4b400000 + 127) << 23;
+    return p * bits.f;
+}
+
+/* x[i] = exp(x[i] + shift) in the current exp mode */
+void exp_shifted(float* x, int n, float shift);
+
+/* hb[i] = silu(scale * hb[i]) * (scale * hb2[i]) in the current exp mode */
+void swiglu(float* hb, const float* hb2, float scale, int n);
+
+/* Arguments the exponential really gets from a model, recorded between
+ * exp_range_begin and exp_range_end: the smallest x + shift in exp_shifted
+ * (softmax and attention, where it is <= 0) and the range of the SwiGLU
+ * gate's pre-activation. Not thread safe, so track with the worker pool off. */
+typedef struct {
+    float softmax_min;
+    float silu_min;
+    float silu_max;
+} ExpRange;
+void exp_range_begin(void);
+void exp_range_end(ExpRange* range);
+
+/* RoPE rotations for every position: seq_len rows of head_size floats, the
+ * cos and sin of each pair side by side, so the forward pass reads them
+ * instead of calling powf/cosf/sinf per element. Freed with ps3_free. */
+float* rope_table_create(Config* p);
+
+/* IEEE half precision storage. fp16_init must run before fp16_to_fp32 is used */
+void fp16_init(void);
+uint16_t fp32_to_fp16(float value);
+extern float fp16_table[65536];
+#define fp16_to_fp32(h) (fp16_table[(h)])
+
+/* matmul/matmul_rows with fp16 weights, widened to fp32 as they are read */
+void matmul_fp16(float* xout, float* x, const uint16_t* w, int n, int d);
+void matmul_rows_fp16(float* xout, float* x, const uint16_t* w, int n, const int* rows, int n_rows);
+
+/* int8 rows with one fp32 scale each, widened through a table. q8_init must run first */
+void q8_init(void);
+extern float q8_table[256];
+#define q8_to_fp32(q) (q8_table[(uint8_t)(q)])
+void matmul_q8(float* xout, float* x, const int8_t* w, const float* scales, int n, int d);
+void matmul_rows_q8(float* xout, float* x, const int8_t* w, const float* scales, int n,
+                    const int* rows, int n_rows);
+/* matmul_q8 for `batch` vectors stored one after another in x and xout */
+void matmul_q8_batch(float* xout, float* x, const int8_t* w, const float* scales, int n, int d, int batch);
+
+/* Dequantized/widened copy of one row of the embedding table, in whatever format it is stored */
+void embedding_row(TransformerWeights* weights, int token, int dim, float* out);
+
+/* Multihead attention of layer l at position pos over the cached keys/values,
+ * queries in state->q (pre-scaled by 1/sqrt(head_size)), output in state->xb */
+void attention(Config* config, RunState* state, int l, int pos);
+
+/* 1 if forward has a compile-time specialized instance for this config's shape */
+int forward_has_specialization(Config* config);
+
 /* Internal implementation of the forward pass */
 void forward_impl(Config* config, TransformerWeights* weights, RunState* state, int token, int pos);
 
+/* Layers [l_begin, l_end) of forward_impl, without the classifier: the first
+ * range starts from the token's embedding (and maps the position's KV block),
+ * the last one ends with the final rmsnorm. Consecutive ranges of one position
+ * may run on different threads as long as they run in order. */
+void forward_impl_layers(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                         int l_begin, int l_end);
+/* The classifier of forward_impl, on the state the last layer left in x */
+void forward_classifier(Config* config, TransformerWeights* weights, RunState* state);
+
+/* Same, but only computes the logits of the given vocabulary rows (none if n_rows is 0) */
+void forward_impl_rows(Config* config, TransformerWeights* weights, RunState* state, int token, int pos,
+                       const int* rows, int n_rows);
+
+/* One decoding step for `batch` sequences, token b going to seqs[b] at
+ * position pos[b] (allocated together by malloc_run_state_batch). Every weight
+ * matrix is read once for the whole batch; the logits of sequence b land in
+ * seqs[b].logits and match what forward_impl would give. Weights are read in
+ * place, whatever seqs[0].tiled says. */
+void forward_impl_batch(Config* config, TransformerWeights* weights, RunState* seqs, const int* tokens,
+                        const int* pos, int batch);
+
+/* Sparse classifier on the final hidden state left in state->x by the last forward */
+void classifier_rows(Config* config, TransformerWeights* weights, RunState* state, const int* rows, int n_rows);
+
+/* Drop n_discard cached positions after the first n_keep and slide the remaining
+ * ones (up to n_past) down, re-rotating the keys so RoPE matches their new position */
+void kv_cache_shift(Config* config, RunState* state, int n_keep, int n_discard, int n_past);
+
+/* Paged KV cache (KV_LAYOUT_PAGED); with the contiguous layouts these are no-ops.
+ * Reserve maps a private block for position pos, copying a shared one first;
+ * returns 0 if the pool has no block left. forward reserves on its own and
+ * exits if that fails, so callers that want to back off reserve beforehand. */
+int kv_cache_reserve(RunState* state, int pos);
+/* Point dst's first n_pos positions at src's blocks; whichever writes one of them first copies it */
+void kv_cache_share(RunState* dst, RunState* src, int n_pos);
+/* Give every block back to the pool */
+void kv_cache_reset(RunState* state);
+/* Blocks currently mapped */
+int kv_cache_blocks(RunState* state);
+
 #endif /* __MATH_UTILS_H__ */
\ No newline at end of file
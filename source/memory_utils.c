@@ -4,18 +4,217 @@
 #include <stdio.h>
 #include <ppu-lv2.h>
 #include <sys/file.h>
+#include <sys/memory.h>
+#include "thread_utils.h"
 
-void* ps3_malloc(size_t size) {
-    void* ptr = memalign(128, size); /* PS3 requires 128-byte alignment */
-    if (!ptr) {
+/* Every block starts with this, one alignment unit before the pointer handed
+ * out, so ps3_free knows what to give back and what to take off the counters */
+#define BLOCK_HEADER 128
+#define BLOCK_MAGIC 0x4d454d42u  /* "MEMB" */
+#define PAGE_1M  (1024*1024)
+#define PAGE_64K (64*1024)
+#define MEM_MAX_HOT 8           /* threads that can be inside a hot section at once */
+
+typedef struct {
+    uint32_t magic;
+    int tag;                 /* MEM_* */
+    int kind;                /* PAGES_* */
+    sys_mem_addr_t addr;     /* lv2 region, for the page kinds */
+    size_t bytes;            /* held, header and page rounding included */
+} BlockHeader;
+
+static const char* tag_names[MEM_TAGS] = {
+    "weights", "kv", "activations", "tokenizer", "sampler", "other"
+};
+
+static int large_pages = 1;
+static MemStats mem;
+static volatile sys_ppu_thread_t hot_threads[MEM_MAX_HOT];
+static volatile int n_hot;
+
+static void raise_peak(size_t* peak, size_t value) {
+    size_t old = *peak;
+    while (value > old && !__sync_bool_compare_and_swap(peak, old, value)) {
+        old = *peak;
+    }
+}
+
+static int in_hot_section(void) {
+    sys_ppu_thread_t self;
+    int i;
+
+    if (n_hot == 0) {
+        return 0;
+    }
+    self = ps3_thread_self();
+    for (i = 0; i < MEM_MAX_HOT; i++) {
+        if (hot_threads[i] == self) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* track(BlockHeader* h, int tag, int kind, sys_mem_addr_t addr, size_t bytes) {
+    h->magic = BLOCK_MAGIC;
+    h->tag = tag;
+    h->kind = kind;
+    h->addr = addr;
+    h->bytes = bytes;
+    raise_peak(&mem.peak_bytes[tag], __sync_add_and_fetch(&mem.bytes[tag], bytes));
+    raise_peak(&mem.peak_total, __sync_add_and_fetch(&mem.total, bytes));
+    __sync_fetch_and_add(&mem.page_bytes[kind], bytes);
+    __sync_fetch_and_add(&mem.n_allocs, 1);
+    __sync_fetch_and_add(&mem.n_live, 1);
+    if (in_hot_section()) {
+        __sync_fetch_and_add(&mem.n_hot_allocs, 1);
+    }
+    return (char*)h + BLOCK_HEADER;
+}
+
+void* ps3_malloc_tagged(size_t size, int tag) {
+    BlockHeader* h = (BlockHeader*)memalign(128, size + BLOCK_HEADER); /* PS3 requires 128-byte alignment */
+    if (!h) {
         fprintf(stderr, "Failed to allocate %zu bytes\n", size);
         return NULL;
     }
-    return ptr;
+    return track(h, tag, PAGES_HEAP, 0, size + BLOCK_HEADER);
+}
+
+void* ps3_malloc(size_t size) {
+    return ps3_malloc_tagged(size, MEM_OTHER);
+}
+
+static int allocate_pages(size_t size, size_t page, uint64_t flags, sys_mem_addr_t* addr, size_t* bytes) {
+    *bytes = (size + page - 1) / page * page;
+    return sysMemoryAllocate(*bytes, flags, addr) == 0;
+}
+
+void* ps3_malloc_large(size_t size, int tag) {
+    size_t total = size + BLOCK_HEADER;
+    sys_mem_addr_t addr = 0;
+    size_t bytes;
+
+    if (large_pages && allocate_pages(total, PAGE_1M, SYS_MEMORY_PAGE_SIZE_1M, &addr, &bytes)) {
+        return track((BlockHeader*)(uintptr_t)addr, tag, PAGES_1M, addr, bytes);
+    }
+    if (large_pages && allocate_pages(total, PAGE_64K, SYS_MEMORY_PAGE_SIZE_64K, &addr, &bytes)) {
+        return track((BlockHeader*)(uintptr_t)addr, tag, PAGES_64K, addr, bytes);
+    }
+    return ps3_malloc_tagged(size, tag);
+}
+
+static BlockHeader* block_header(const void* ptr) {
+    BlockHeader* h = (BlockHeader*)((char*)ptr - BLOCK_HEADER);
+    if (h->magic != BLOCK_MAGIC) {
+        fprintf(stderr, "ps3_free: %p was not allocated by ps3_malloc\n", ptr);
+        exit(EXIT_FAILURE);
+    }
+    return h;
 }
 
 void ps3_free(void* ptr) {
-    free(ptr);
+    BlockHeader* h;
+
+    if (!ptr) {
+        return;
+    }
+    h = block_header(ptr);
+    h->magic = 0;
+    __sync_fetch_and_sub(&mem.bytes[h->tag], h->bytes);
+    __sync_fetch_and_sub(&mem.total, h->bytes);
+    __sync_fetch_and_sub(&mem.page_bytes[h->kind], h->bytes);
+    __sync_fetch_and_sub(&mem.n_live, 1);
+    if (h->kind == PAGES_HEAP) {
+        free(h);
+    } else {
+        sysMemoryFree(h->addr);
+    }
+}
+
+int ps3_page_kind(const void* ptr) {
+    return block_header(ptr)->kind;
+}
+
+void ps3_set_large_pages(int enabled) {
+    large_pages = enabled;
+}
+
+void ps3_mem_hot_begin(void) {
+    sys_ppu_thread_t self = ps3_thread_self();
+    int i;
+
+    for (i = 0; i < MEM_MAX_HOT; i++) {
+        if (__sync_bool_compare_and_swap(&hot_threads[i], 0, self)) {
+            __sync_fetch_and_add(&n_hot, 1);
+            return;
+        }
+    }
+}
+
+void ps3_mem_hot_end(void) {
+    sys_ppu_thread_t self = ps3_thread_self();
+    int i;
+
+    for (i = 0; i < MEM_MAX_HOT; i++) {
+        if (hot_threads[i] == self) {
+            hot_threads[i] = 0;
+            __sync_fetch_and_sub(&n_hot, 1);
+            return;
+        }
+    }
+}
+
+void ps3_mem_stats(MemStats* stats) {
+    *stats = mem;
+}
+
+void ps3_mem_report(void) {
+    struct mallinfo heap = mallinfo();
+    int t;
+
+    printf("memory: peak %.2f MB, %.2f MB still held in %lld blocks, %lld allocations, %lld in hot sections\n",
+           mem.peak_total / 1048576.0, mem.total / 1048576.0, mem.n_live, mem.n_allocs, mem.n_hot_allocs);
+    for (t = 0; t < MEM_TAGS; t++) {
+        printf("  %-12s %8.2f MB now, %8.2f MB peak\n", tag_names[t],
+               mem.bytes[t] / 1048576.0, mem.peak_bytes[t] / 1048576.0);
+    }
+    printf("  pages: %.2f MB 1M, %.2f MB 64K, %.2f MB heap\n", mem.page_bytes[PAGES_1M] / 1048576.0,
+           mem.page_bytes[PAGES_64K] / 1048576.0, mem.page_bytes[PAGES_HEAP] / 1048576.0);
+    /* what the heap took from the system but isn't handing out: free lists and fragments */
+    printf("  heap arena %.2f MB, %.2f MB in use, %.2f MB free in %d chunks\n", heap.arena / 1048576.0,
+           heap.uordblks / 1048576.0, heap.fordblks / 1048576.0, heap.ordblks);
+}
+
+char* ps3_read_file(const char* path, size_t* size) {
+    int fd;
+    uint64_t pos;
+    uint64_t bytes_read;
+    char* buffer;
+
+    if (sysLv2FsOpen(path, SYS_O_RDONLY, &fd, 0, NULL, 0) != 0) {
+        return NULL;
+    }
+    sysLv2FsLSeek64(fd, 0, SEEK_END, &pos);
+    sysLv2FsLSeek64(fd, 0, SEEK_SET, &bytes_read);
+
+    buffer = (char*)ps3_malloc(pos + 1);
+    if (!buffer) {
+        sysLv2FsClose(fd);
+        return NULL;
+    }
+    if (sysLv2FsRead(fd, buffer, pos, &bytes_read) != 0 || bytes_read != pos) {
+        sysLv2FsClose(fd);
+        ps3_free(buffer);
+        return NULL;
+    }
+    sysLv2FsClose(fd);
+
+    buffer[pos] = '\0';
+    if (size) {
+        *size = pos;
+    }
+    return buffer;
 }
 
 int32_t swap32(int32_t value) {
@@ -6,10 +6,67 @@
 #include <sys/types.h>
 #include "transformer.h"
 
-/* PS3-specific memory allocation with 128-byte alignment */
+/* What an allocation is for, in the memory report */
+#define MEM_WEIGHTS     0
+#define MEM_KV          1
+#define MEM_ACTIVATIONS 2
+#define MEM_TOKENIZER   3
+#define MEM_SAMPLER     4
+#define MEM_OTHER       5   /* pools, queues, prompts, request buffers */
+#define MEM_TAGS        6
+
+/* Kinds of pages a block can sit on */
+#define PAGES_HEAP 0
+#define PAGES_64K  1
+#define PAGES_1M   2
+#define PAGE_KINDS 3
+
+/* PS3-specific memory allocation with 128-byte alignment. Every block is
+ * counted against its MEM_* tag (ps3_malloc uses MEM_OTHER) until ps3_free. */
+void* ps3_malloc_tagged(size_t size, int tag);
 void* ps3_malloc(size_t size);
+/* Frees ps3_malloc, ps3_malloc_tagged and ps3_malloc_large blocks; NULL is ignored */
 void ps3_free(void* ptr);
 
+/* Large-page allocations for the big, long-lived buffers that are streamed
+ * through (weights, KV caches), so they cover a fraction of the TLB entries
+ * 4 KB heap pages would. Each one is its own lv2 memory region of 1 MB pages,
+ * or 64 KB pages if no 1 MB pages are left, rounded up to whole pages; if
+ * neither can be had (or large pages are off) it comes from the heap like
+ * ps3_malloc_tagged. The result is 128-byte aligned. */
+void* ps3_malloc_large(size_t size, int tag);
+/* Which kind of pages a block ended up on */
+int ps3_page_kind(const void* ptr);
+/* Turn large pages on (the default) or off for later ps3_malloc_large calls */
+void ps3_set_large_pages(int enabled);
+
+/* Mark the calling thread as being in a hot section (a decode loop) until
+ * ps3_mem_hot_end; anything it allocates meanwhile counts in n_hot_allocs,
+ * which should stay at zero. Sections don't nest. */
+void ps3_mem_hot_begin(void);
+void ps3_mem_hot_end(void);
+
+/* Allocation counters; byte counts include headers and page rounding */
+typedef struct {
+    size_t bytes[MEM_TAGS];        /* held now */
+    size_t peak_bytes[MEM_TAGS];   /* each tag's own high-water mark */
+    size_t total;
+    size_t peak_total;             /* high-water mark of everything together */
+    size_t page_bytes[PAGE_KINDS]; /* held now, by kind of page */
+    long long n_allocs;            /* since startup */
+    long long n_live;              /* not freed yet */
+    long long n_hot_allocs;        /* made inside a hot section */
+} MemStats;
+
+void ps3_mem_stats(MemStats* stats);
+
+/* Print the counters, and how much of the heap is free but held, to stdout */
+void ps3_mem_report(void);
+
+/* Read a whole (small) text file into a NUL-terminated ps3_malloc'd buffer.
+ * Returns NULL if the file can't be opened or read */
+char* ps3_read_file(const char* path, size_t* size);
+
 /* PS3-specific endianness conversion helpers */
 int32_t swap32(int32_t value);
 float swap_float(float value);
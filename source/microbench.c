@@ -0,0 +1,354 @@
+#include "microbench.h"
+#include "math_utils.h"
+#include "gemv.h"
+#include "memory_utils.h"
+#include "sampler.h"
+#include "thread_utils.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MICRO_MIN_US 20000   /* each kernel is repeated for at least this long */
+#define MICRO_VOCAB 32000
+#define MICRO_SHAPES 3
+#define MICRO_FMA_CHAINS 12  /* independent accumulators, enough to cover the FPU latency */
+#define MICRO_FMA_STEPS 4096
+
+static const int micro_dims[MICRO_SHAPES] = { 288, 512, 768 };
+static const int micro_hidden[MICRO_SHAPES] = { 768, 1376, 2048 };
+static const int micro_heads[MICRO_SHAPES] = { 6, 8, 12 };
+
+static const char micro_text[] =
+    "Once upon a time, there was a little girl named Lily. She loved to play outside in the "
+    "sunshine. One day, she saw a big, red ball in the park. She ran to it and kicked it as far "
+    "as she could. The ball went over the fence and into the garden of an old man. Lily was "
+    "scared, but she knocked on the door and asked for her ball back. The old man smiled and "
+    "gave it to her, and they became good friends.";
+
+/* Everything a kernel wrapper may need; each one uses a few of the fields */
+typedef struct {
+    float* out;
+    float* x;
+    float* residual;  /* stands in for the residual stream x of the forward pass */
+    float* w;
+    uint16_t* w16;
+    int8_t* w8;
+    float* scales;
+    int n;
+    int d;
+    Config config;
+    RunState* state;
+    int pos;
+    ProbIndex* probindex;
+    Tokenizer* tokenizer;
+    int* tokens;
+    float sink;       /* keeps the baseline loops from being optimized away */
+    /* roofs */
+    double bandwidth; /* GB/s, streaming reads */
+    double peak;      /* GFLOP/s, independent FMAs */
+    EmitFn emit;
+    void* userdata;
+} Micro;
+
+typedef void (*MicroFn)(Micro* m);
+
+static double time_kernel(MicroFn fn, Micro* m) {
+    uint64_t start, elapsed;
+    long reps = 1;
+    long i;
+
+    for (;;) {
+        start = ps3_time_us();
+        for (i = 0; i < reps; i++) {
+            fn(m);
+        }
+        elapsed = ps3_time_us() - start;
+        if (elapsed >= MICRO_MIN_US) {
+            return elapsed / (double)reps;
+        }
+        reps *= 2;
+    }
+}
+
+static void fill_random(float* v, size_t n, unsigned long long* state) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        v[i] = (float)((*state * 0x2545F4914F6CDD1Dull) >> 40) / 16777216.0f - 0.5f;
+    }
+}
+
+/* One report line. flops may be 0 for kernels that don't compute much, e.g. sorting;
+ * for encode the bytes are those of the input text. */
+static void report(Micro* m, const char* name, double us, double flops, double bytes) {
+    double gflops = flops / (us * 1e3);
+    double gbytes = bytes / (us * 1e3);
+    double roof, ridge;
+    char line[160];
+
+    if (flops > 0.0) {
+        /* attainable = min(peak, intensity * bandwidth) */
+        ridge = m->peak / m->bandwidth;
+        roof = flops / bytes < ridge ? flops / bytes * m->bandwidth : m->peak;
+        snprintf(line, sizeof(line), "\n%-22s %9.3f ms %6.2f GFLOP/s %6.2f GB/s %3.0f%% of %s roof",
+                 name, us / 1000.0, gflops, gbytes, 100.0 * gflops / roof,
+                 flops / bytes < ridge ? "memory" : "compute");
+    } else {
+        /* these run far below the bandwidth, so MB/s is the more readable unit */
+        snprintf(line, sizeof(line), "\n%-22s %9.3f ms %9.2f MB/s %12.1f%% of memory roof",
+                 name, us / 1000.0, gbytes * 1e3, 100.0 * gbytes / m->bandwidth);
+    }
+    m->emit(line, m->userdata);
+}
+
+/* Baselines */
+static void stream_read(Micro* m) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    size_t n = (size_t)m->n * m->d;
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        s0 += m->w[i];
+        s1 += m->w[i + 1];
+        s2 += m->w[i + 2];
+        s3 += m->w[i + 3];
+    }
+    m->sink += s0 + s1 + s2 + s3;
+}
+
+static void stream_copy(Micro* m) {
+    size_t half = (size_t)m->n * m->d / 2;
+    memcpy(m->w + half, m->w, half * sizeof(float));
+}
+
+static void fma_peak(Micro* m) {
+    float acc[MICRO_FMA_CHAINS];
+    float a = 0.999f, b = 0.001f;
+    int i, c;
+    for (c = 0; c < MICRO_FMA_CHAINS; c++) {
+        acc[c] = m->x[c];
+    }
+    for (i = 0; i < MICRO_FMA_STEPS; i++) {
+        for (c = 0; c < MICRO_FMA_CHAINS; c++) {
+            acc[c] = acc[c] * a + b;
+        }
+    }
+    for (c = 0; c < MICRO_FMA_CHAINS; c++) {
+        m->sink += acc[c];
+    }
+}
+
+/* Kernel wrappers */
+static void run_matmul(Micro* m) { matmul(m->out, m->x, m->w, m->n, m->d); }
+static void run_matmul_fp16(Micro* m) { matmul_fp16(m->out, m->x, m->w16, m->n, m->d); }
+static void run_gemv(Micro* m) { gemv(m->out, m->x, m->w, GEMV_FP32, m->n, m->d); }
+static void run_gemv_fp16(Micro* m) { gemv(m->out, m->x, m->w16, GEMV_FP16, m->n, m->d); }
+static void run_matmul_q8(Micro* m) { matmul_q8(m->out, m->x, m->w8, m->scales, m->n, m->d); }
+static void run_rmsnorm(Micro* m) { rmsnorm(m->out, m->x, m->w, m->n); }
+static void run_attention(Micro* m) { attention(&m->config, m->state, 0, m->pos); }
+static void run_argmax(Micro* m) { m->sink += sample_argmax(m->x, m->n); }
+static void run_topp(Micro* m) { m->sink += sample_topp(m->x, m->n, 0.9f, m->probindex, 0.5f); }
+
+/* An output projection into the residual stream followed by the next norm,
+ * as separate passes and as the fused epilogue the forward pass uses */
+static void run_epilogue_separate(Micro* m) {
+    int i;
+    gemv(m->out, m->x, m->w16, GEMV_FP16, m->n, m->d);
+    for (i = 0; i < m->d; i++) {
+        m->residual[i] += m->out[i];
+    }
+    rmsnorm(m->out, m->residual, m->scales, m->d);
+}
+
+static void run_epilogue_fused(Micro* m) {
+    float ss = gemv_residual(m->residual, m->x, m->w16, GEMV_FP16, m->n, m->d);
+    rmsnorm_scaled(m->out, m->residual, m->scales, rms_scale_ss(ss, m->d), m->d);
+}
+
+static void run_softmax(Micro* m) {
+    /* softmax works in place, so start from the same logits every time */
+    memcpy(m->out, m->x, m->n * sizeof(float));
+    softmax(m->out, m->n);
+}
+
+static void run_swiglu(Micro* m) {
+    /* in place as well */
+    memcpy(m->out, m->x, m->n * sizeof(float));
+    swiglu(m->out, m->residual, 1.0f, m->n);
+}
+
+/* The kernels that use the fast exponential, timed in both modes (its
+ * accuracy is swept by bench_fast_exp over a model's real arguments) */
+static void bench_exp(Micro* m, int hidden_dim) {
+    char line[160];
+    int saved = exp_mode;
+    double exact_us, fast_us;
+
+    m->n = MICRO_VOCAB;
+    set_exp_mode(EXP_EXACT);
+    exact_us = time_kernel(run_softmax, m);
+    set_exp_mode(EXP_FAST);
+    fast_us = time_kernel(run_softmax, m);
+    snprintf(line, sizeof(line), "\nsoftmax %d: %.3f ms expf, %.3f ms exp_fast (%.2fx)", m->n,
+             exact_us / 1000.0, fast_us / 1000.0, fast_us > 0 ? exact_us / fast_us : 0.0);
+    m->emit(line, m->userdata);
+
+    m->n = hidden_dim;
+    set_exp_mode(EXP_EXACT);
+    exact_us = time_kernel(run_swiglu, m);
+    set_exp_mode(EXP_FAST);
+    fast_us = time_kernel(run_swiglu, m);
+    snprintf(line, sizeof(line), "\nswiglu %d: %.4f ms expf, %.4f ms exp_fast (%.2fx)", m->n,
+             exact_us / 1000.0, fast_us / 1000.0, fast_us > 0 ? exact_us / fast_us : 0.0);
+    m->emit(line, m->userdata);
+    set_exp_mode(saved);
+}
+
+static void run_encode(Micro* m) {
+    int n_tokens;
+    encode(m->tokenizer, (char*)micro_text, 1, 0, m->tokens, &n_tokens);
+}
+
+static void bench_matmul(Micro* m, const char* label, int n, int d) {
+    char name[32];
+    double flops = 2.0 * n * d;
+    double io = 4.0 * (n + d);
+
+    m->n = n;
+    m->d = d;
+    snprintf(name, sizeof(name), "matmul %s %dx%d", label, d, n);
+    report(m, name, time_kernel(run_matmul, m), flops, 4.0 * n * d + io);
+    snprintf(name, sizeof(name), "  fp16 %s %dx%d", label, d, n);
+    report(m, name, time_kernel(run_matmul_fp16, m), flops, 2.0 * n * d + io);
+    /* the register-blocked kernels the forward pass dispatches to for this shape */
+    snprintf(name, sizeof(name), "  gemv %s %s", label, gemv_kernel_name(GEMV_FP32, n, d));
+    report(m, name, time_kernel(run_gemv, m), flops, 4.0 * n * d + io);
+    snprintf(name, sizeof(name), "  gemv fp16 %s %s", label, gemv_kernel_name(GEMV_FP16, n, d));
+    report(m, name, time_kernel(run_gemv_fp16, m), flops, 2.0 * n * d + io);
+    snprintf(name, sizeof(name), "  int8 %s %dx%d", label, d, n);
+    report(m, name, time_kernel(run_matmul_q8, m), flops, 1.0 * n * d + io + 4.0 * d);
+}
+
+static void bench_attention(Micro* m, int dim, int n_heads, int seq_len) {
+    RunState state;
+    char name[32];
+    int kv_dim = dim;
+    unsigned long long rng = 42;
+    int p;
+
+    memset(&m->config, 0, sizeof(Config));
+    m->config.dim = dim;
+    m->config.hidden_dim = dim;
+    m->config.n_layers = 1;
+    m->config.n_heads = n_heads;
+    m->config.n_kv_heads = n_heads;
+    m->config.vocab_size = 1;
+    m->config.seq_len = seq_len;
+    /* a single thread, like every other kernel here */
+    malloc_run_state_shared(&state, &m->config, NULL, NULL);
+    fill_random(state.key_cache, (size_t)seq_len * kv_dim, &rng);
+    fill_random(state.value_cache, (size_t)seq_len * kv_dim, &rng);
+    fill_random(state.q, dim, &rng);
+    m->state = &state;
+
+    for (p = 1; p <= 4; p++) {
+        m->pos = p * seq_len / 4 - 1;
+        snprintf(name, sizeof(name), "attention %d pos %d", dim, m->pos);
+        report(m, name, time_kernel(run_attention, m), 4.0 * dim * (m->pos + 1),
+               8.0 * kv_dim * (m->pos + 1) + 8.0 * dim);
+    }
+
+    free_run_state(&state);
+}
+
+void microbench_kernels(Tokenizer* tokenizer, int seq_len, EmitFn emit, void* userdata) {
+    size_t w_count = (size_t)MICRO_VOCAB * micro_dims[0];
+    size_t i;
+    unsigned long long rng = 1234;
+    char line[160];
+    Micro m;
+    int s;
+
+    if (w_count < (size_t)micro_dims[MICRO_SHAPES - 1] * micro_hidden[MICRO_SHAPES - 1]) {
+        w_count = (size_t)micro_dims[MICRO_SHAPES - 1] * micro_hidden[MICRO_SHAPES - 1];
+    }
+    memset(&m, 0, sizeof(m));
+    m.emit = emit;
+    m.userdata = userdata;
+    m.tokenizer = tokenizer;
+    m.w = (float*)ps3_malloc(w_count * sizeof(float));
+    m.w16 = (uint16_t*)ps3_malloc(w_count * sizeof(uint16_t));
+    m.w8 = (int8_t*)ps3_malloc(w_count);
+    m.scales = (float*)ps3_malloc(MICRO_VOCAB * sizeof(float));
+    m.x = (float*)ps3_malloc(MICRO_VOCAB * sizeof(float));
+    m.out = (float*)ps3_malloc(MICRO_VOCAB * sizeof(float));
+    m.residual = (float*)ps3_malloc(MICRO_VOCAB * sizeof(float));
+    m.probindex = (ProbIndex*)ps3_malloc(MICRO_VOCAB * sizeof(ProbIndex));
+    m.tokens = (int*)ps3_malloc((sizeof(micro_text) + 3) * sizeof(int));
+    if (!m.w || !m.w16 || !m.w8 || !m.scales || !m.x || !m.out || !m.residual || !m.probindex || !m.tokens) {
+        fprintf(stderr, "Failed to allocate microbenchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    fp16_init();
+    q8_init();
+    fill_random(m.w, w_count, &rng);
+    fill_random(m.x, MICRO_VOCAB, &rng);
+    fill_random(m.residual, MICRO_VOCAB, &rng);
+    fill_random(m.scales, MICRO_VOCAB, &rng);
+    for (i = 0; i < w_count; i++) {
+        m.w16[i] = fp32_to_fp16(m.w[i]);
+        m.w8[i] = (int8_t)(m.w[i] * 254.0f);
+    }
+
+    /* the roofs every kernel is compared against */
+    m.n = (int)w_count;
+    m.d = 1;
+    m.bandwidth = w_count * sizeof(float) / (time_kernel(stream_read, &m) * 1e3);
+    m.peak = 2.0 * MICRO_FMA_CHAINS * MICRO_FMA_STEPS / (time_kernel(fma_peak, &m) * 1e3);
+    snprintf(line, sizeof(line), "\nBaseline: read %.2f GB/s, copy %.2f GB/s, FMA %.2f GFLOP/s (1 thread)",
+             m.bandwidth, w_count * sizeof(float) / (time_kernel(stream_copy, &m) * 1e3), m.peak);
+    emit(line, userdata);
+
+    for (s = 0; s < MICRO_SHAPES; s++) {
+        bench_matmul(&m, "qkvo", micro_dims[s], micro_dims[s]);
+        bench_matmul(&m, "w1/w3", micro_dims[s], micro_hidden[s]);
+        bench_matmul(&m, "w2", micro_hidden[s], micro_dims[s]);
+        snprintf(line, sizeof(line), "  w2+add+norm fp16 %d", micro_dims[s]);
+        report(&m, line, time_kernel(run_epilogue_separate, &m), 2.0 * m.n * m.d,
+               2.0 * m.n * m.d + 4.0 * m.n + 28.0 * m.d);
+        snprintf(line, sizeof(line), "  w2 fused fp16 %d", micro_dims[s]);
+        report(&m, line, time_kernel(run_epilogue_fused, &m), 2.0 * m.n * m.d,
+               2.0 * m.n * m.d + 4.0 * m.n + 16.0 * m.d);
+        m.n = micro_dims[s];
+        snprintf(line, sizeof(line), "rmsnorm %d", micro_dims[s]);
+        report(&m, line, time_kernel(run_rmsnorm, &m), 4.0 * m.n, 12.0 * m.n);
+        bench_attention(&m, micro_dims[s], micro_heads[s], seq_len);
+    }
+
+    bench_matmul(&m, "cls", micro_dims[0], MICRO_VOCAB);
+    m.n = MICRO_VOCAB;
+    report(&m, "softmax 32000", time_kernel(run_softmax, &m), 4.0 * m.n, 16.0 * m.n);
+    bench_exp(&m, micro_hidden[MICRO_SHAPES - 1]);
+    m.n = MICRO_VOCAB;
+    report(&m, "sample_argmax 32000", time_kernel(run_argmax, &m), 0.0, 4.0 * m.n);
+    /* top-p works on probabilities */
+    memcpy(m.out, m.x, m.n * sizeof(float));
+    softmax(m.out, m.n);
+    memcpy(m.x, m.out, m.n * sizeof(float));
+    report(&m, "sample_topp 32000", time_kernel(run_topp, &m), 0.0, 4.0 * m.n);
+    if (tokenizer) {
+        report(&m, "encode", time_kernel(run_encode, &m), 0.0, (double)strlen(micro_text));
+    }
+
+    ps3_free(m.tokens);
+    ps3_free(m.probindex);
+    ps3_free(m.residual);
+    ps3_free(m.out);
+    ps3_free(m.x);
+    ps3_free(m.scales);
+    ps3_free(m.w8);
+    ps3_free(m.w16);
+    ps3_free(m.w);
+}
@@ -0,0 +1,14 @@
+#ifndef __MICROBENCH_H__
+#define __MICROBENCH_H__
+
+#include "tokenizer.h"
+#include "generate.h"
+
+/* Times the kernels of math_utils.c, sampler.c and tokenizer.c on their own over
+ * the shapes of the 15M/42M/110M models, reporting GFLOP/s and GB/s against a
+ * measured memory bandwidth and FMA throughput baseline and whether each kernel
+ * sits under the memory or the compute roof. Attention is timed up to seq_len.
+ * encode is skipped when tokenizer is NULL. */
+void microbench_kernels(Tokenizer* tokenizer, int seq_len, EmitFn emit, void* userdata);
+
+#endif /* __MICROBENCH_H__ */
@@ -0,0 +1,67 @@
+#include "output_queue.h"
+#include "thread_utils.h"
+#include <string.h>
+
+#define OUTPUT_QUEUE_MASK (OUTPUT_QUEUE_SIZE - 1)
+
+void output_queue_init(OutputQueue* q) {
+    memset(q, 0, sizeof(OutputQueue));
+}
+
+void output_queue_push(OutputQueue* q, const char* piece) {
+    unsigned int len = strlen(piece);
+    unsigned int head = q->head;
+    unsigned int i;
+
+    /* a piece longer than the ring could never be published whole */
+    if (len == 0 || len >= OUTPUT_QUEUE_SIZE) {
+        return;
+    }
+
+    /* wait for room; head and tail are free-running so the difference is the fill level */
+    while (OUTPUT_QUEUE_SIZE - (head - q->tail) < len) {
+        ps3_thread_yield();
+    }
+
+    for (i = 0; i < len; i++) {
+        q->buffer[(head + i) & OUTPUT_QUEUE_MASK] = piece[i];
+    }
+
+    /* make the bytes visible before the new head */
+    ps3_memory_barrier();
+    q->head = head + len;
+}
+
+void output_queue_close(OutputQueue* q) {
+    ps3_memory_barrier();
+    q->closed = 1;
+}
+
+int output_queue_pop(OutputQueue* q, char* out, int max) {
+    unsigned int tail = q->tail;
+    unsigned int head = q->head;
+    unsigned int count = head - tail;
+    unsigned int i;
+
+    /* read the bytes only after observing the head that covers them */
+    ps3_memory_barrier();
+
+    if (count > (unsigned int)(max - 1)) {
+        count = max - 1;
+    }
+    for (i = 0; i < count; i++) {
+        out[i] = q->buffer[(tail + i) & OUTPUT_QUEUE_MASK];
+    }
+    out[count] = '\0';
+
+    /* finish reading before handing the slots back to the producer */
+    ps3_memory_barrier();
+    q->tail = tail + count;
+    return count;
+}
+
+int output_queue_finished(OutputQueue* q) {
+    int closed = q->closed;
+    ps3_memory_barrier();
+    return closed && q->head == q->tail;
+}
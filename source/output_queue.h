@@ -0,0 +1,30 @@
+#ifndef __OUTPUT_QUEUE_H__
+#define __OUTPUT_QUEUE_H__
+
+/* Lock-free single-producer/single-consumer ring buffer carrying decoded text.
+ * The generator thread pushes whole pieces, the UI thread drains them once per frame. */
+
+#define OUTPUT_QUEUE_SIZE 4096 /* must be a power of two */
+
+typedef struct {
+    char buffer[OUTPUT_QUEUE_SIZE];
+    volatile unsigned int head;  /* next write index, only advanced by the producer */
+    volatile unsigned int tail;  /* next read index, only advanced by the consumer */
+    volatile int closed;         /* set by the producer once it will push no more */
+} OutputQueue;
+
+void output_queue_init(OutputQueue* q);
+
+/* Producer side. Pieces are published whole, so the consumer never sees half a
+ * UTF-8 sequence. Blocks (yielding) only if the consumer falls a full ring behind. */
+void output_queue_push(OutputQueue* q, const char* piece);
+void output_queue_close(OutputQueue* q);
+
+/* Consumer side. Copies up to max-1 pending bytes into out, NUL terminates it and
+ * returns the number of bytes copied */
+int output_queue_pop(OutputQueue* q, char* out, int max);
+
+/* Returns 1 once the producer has closed the queue and everything was drained */
+int output_queue_finished(OutputQueue* q);
+
+#endif /* __OUTPUT_QUEUE_H__ */
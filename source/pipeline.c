@@ -0,0 +1,219 @@
+#include "pipeline.h"
+#include "math_utils.h"
+#include "thread_utils.h"
+#include "memory_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PIPELINE_QUEUE_SIZE 16 /* power of two, at least PIPELINE_MAX_SEQS */
+#define PIPELINE_QUEUE_MASK (PIPELINE_QUEUE_SIZE - 1)
+
+#if PIPELINE_QUEUE_SIZE < PIPELINE_MAX_SEQS
+#error "PIPELINE_QUEUE_SIZE must hold every sequence"
+#endif
+
+/* Lock-free single-producer/single-consumer ring of sequence indices into one
+ * stage. It can never fill up: a sequence sits in at most one queue. Aligned
+ * to a cache line so neighbouring stages don't share one. */
+typedef struct {
+    int items[PIPELINE_QUEUE_SIZE];
+    volatile unsigned int head;  /* next write index, only advanced by the producer */
+    volatile unsigned int tail;  /* next read index, only advanced by the consumer */
+} __attribute__((aligned(128))) SeqQueue;
+
+static void queue_push(SeqQueue* q, int seq) {
+    unsigned int head = q->head;
+
+    q->items[head & PIPELINE_QUEUE_MASK] = seq;
+    /* the item, and everything written to the sequence's state, before the new head */
+    ps3_memory_barrier();
+    q->head = head + 1;
+}
+
+static int queue_pop(SeqQueue* q, int* seq) {
+    unsigned int tail = q->tail;
+
+    if (q->head == tail) {
+        return 0;
+    }
+    /* read the item and the state behind it only after observing the head */
+    ps3_memory_barrier();
+    *seq = q->items[tail & PIPELINE_QUEUE_MASK];
+    ps3_memory_barrier();
+    q->tail = tail + 1;
+    return 1;
+}
+
+typedef struct {
+    Model* model;
+    Session* sessions;
+    int n_seqs;
+    int n_stages;
+    int first_layer[PIPELINE_MAX_STAGES + 1];
+    SeqQueue queues[PIPELINE_MAX_STAGES];   /* queues[s] feeds stage s; the last stage feeds queues[0] */
+    int token[PIPELINE_MAX_SEQS];           /* next token per sequence, written by the last stage */
+    int pos[PIPELINE_MAX_SEQS];
+    PipelineNextFn next;
+    void* userdata;
+    volatile int n_retired;                 /* written by the last stage only */
+    long long n_tokens;
+    uint64_t busy_us[PIPELINE_MAX_STAGES];
+} Pipeline;
+
+typedef struct {
+    Pipeline* pipeline;
+    int stage;
+} StageArg;
+
+/* Multiply-adds of one layer and of the classifier, to balance the stages */
+static double layer_cost(Config* p) {
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    return (double)p->dim * (2 * p->dim + 2 * kv_dim) + 3.0 * p->dim * p->hidden_dim;
+}
+
+/* Cut the layers so every stage gets about the same cost. Every stage but the
+ * last has at least one layer; the last may only run the classifier. */
+static void split_layers(Config* p, int n_stages, int* first_layer) {
+    double per_layer = layer_cost(p);
+    double total = per_layer * p->n_layers + (double)p->dim * p->vocab_size;
+    int s, l;
+
+    first_layer[0] = 0;
+    for (s = 1; s < n_stages; s++) {
+        l = first_layer[s - 1] + 1;
+        while (l < p->n_layers && per_layer * l < total * s / n_stages) {
+            l++;
+        }
+        if (l > p->n_layers - (n_stages - 1 - s)) {
+            l = p->n_layers - (n_stages - 1 - s);
+        }
+        first_layer[s] = l;
+    }
+    first_layer[n_stages] = p->n_layers;
+}
+
+static void run_stage(Pipeline* p, int stage) {
+    Config* config = &p->model->config;
+    TransformerWeights* weights = &p->model->weights;
+    int l_begin = p->first_layer[stage];
+    int l_end = p->first_layer[stage + 1];
+    int last = stage == p->n_stages - 1;
+    RunState* s;
+    uint64_t start;
+    int seq, token;
+
+    ps3_mem_hot_begin();
+    while (p->n_retired < p->n_seqs) {
+        if (!queue_pop(&p->queues[stage], &seq)) {
+            ps3_thread_yield();
+            continue;
+        }
+        s = &p->sessions[seq].state;
+        start = ps3_time_us();
+        if (l_begin < l_end) {
+            forward_impl_layers(config, weights, s, p->token[seq], p->pos[seq], l_begin, l_end);
+        }
+        if (!last) {
+            p->busy_us[stage] += ps3_time_us() - start;
+            queue_push(&p->queues[stage + 1], seq);
+            continue;
+        }
+
+        forward_classifier(config, weights, s);
+        token = p->next(p->userdata, seq, s->logits);
+        p->busy_us[stage] += ps3_time_us() - start;
+        p->n_tokens++;
+        p->pos[seq]++;
+        if (token < 0 || p->pos[seq] >= config->seq_len) {
+            ps3_memory_barrier();
+            p->n_retired++;
+        } else {
+            p->token[seq] = token;
+            queue_push(&p->queues[0], seq);
+        }
+    }
+    ps3_mem_hot_end();
+}
+
+static void stage_thread(void* arg) {
+    StageArg* a = (StageArg*)arg;
+    run_stage(a->pipeline, a->stage);
+}
+
+int pipeline_run(Model* model, Session* sessions, int n_seqs, const int* tokens, const int* pos, int n_stages,
+                 PipelineNextFn next, void* userdata, PipelineStats* stats) {
+    Pipeline* p;
+    StageArg args[PIPELINE_MAX_STAGES];
+    sys_ppu_thread_t threads[PIPELINE_MAX_STAGES];
+    uint64_t start;
+    int i, started = 0;
+
+    memset(stats, 0, sizeof(PipelineStats));
+    if (n_seqs > PIPELINE_MAX_SEQS) {
+        n_seqs = PIPELINE_MAX_SEQS;
+    }
+    if (n_stages > PIPELINE_MAX_STAGES) {
+        n_stages = PIPELINE_MAX_STAGES;
+    }
+    if (n_stages > model->config.n_layers + 1) {
+        n_stages = model->config.n_layers + 1;
+    }
+    if (n_stages < 1) {
+        n_stages = 1;
+    }
+
+    /* ps3_malloc gives the cache-line alignment the queues ask for */
+    p = (Pipeline*)ps3_malloc(sizeof(Pipeline));
+    if (!p) {
+        fprintf(stderr, "Failed to allocate the pipeline\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, sizeof(Pipeline));
+    p->model = model;
+    p->sessions = sessions;
+    p->n_seqs = n_seqs;
+    p->n_stages = n_stages;
+    p->next = next;
+    p->userdata = userdata;
+    split_layers(&model->config, n_stages, p->first_layer);
+    for (i = 0; i < n_seqs; i++) {
+        p->token[i] = tokens[i];
+        p->pos[i] = pos[i];
+    }
+
+    /* stages 1.. wait on their empty queues until the first sequences come through */
+    for (i = 1; i < n_stages; i++) {
+        args[i].pipeline = p;
+        args[i].stage = i;
+        if (!ps3_thread_create(&threads[i], stage_thread, &args[i], "llama_stage")) {
+            break;
+        }
+        started++;
+    }
+    if (started < n_stages - 1) {
+        p->n_retired = n_seqs;
+        for (i = 1; i <= started; i++) {
+            ps3_thread_join(threads[i]);
+        }
+        ps3_free(p);
+        return 0;
+    }
+
+    start = ps3_time_us();
+    for (i = 0; i < n_seqs; i++) {
+        queue_push(&p->queues[0], i);
+    }
+    run_stage(p, 0);
+    for (i = 1; i < n_stages; i++) {
+        ps3_thread_join(threads[i]);
+    }
+
+    stats->n_stages = n_stages;
+    memcpy(stats->first_layer, p->first_layer, sizeof(p->first_layer));
+    stats->n_tokens = p->n_tokens;
+    stats->total_us = ps3_time_us() - start;
+    memcpy(stats->busy_us, p->busy_us, sizeof(p->busy_us));
+    ps3_free(p);
+    return 1;
+}
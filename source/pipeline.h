@@ -0,0 +1,39 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdint.h>
+#include "transformer.h"
+
+#define PIPELINE_MAX_SEQS 16     /* sequences in flight */
+#define PIPELINE_MAX_STAGES 4
+
+/* Called by the last stage with a sequence's logits for its current position.
+ * Returns the token to feed it next, or -1 to retire the sequence. */
+typedef int (*PipelineNextFn)(void* userdata, int seq, float* logits);
+
+typedef struct {
+    int n_stages;
+    int first_layer[PIPELINE_MAX_STAGES + 1]; /* stage s runs layers [first_layer[s], first_layer[s + 1]) */
+    long long n_tokens;                       /* positions that went through the whole pipeline */
+    uint64_t total_us;
+    uint64_t busy_us[PIPELINE_MAX_STAGES];    /* time each stage spent computing */
+} PipelineStats;
+
+/* Decode several sequences at once through a layer pipeline. The layers are cut
+ * into n_stages contiguous ranges of roughly equal cost (the classifier counts
+ * towards the last one), each run by its own thread; the calling thread is
+ * stage 0. A sequence's state moves from stage to stage through lock-free
+ * single-producer/single-consumer queues, so while one stage works on a
+ * sequence the next works on the sequence ahead of it. After the last stage,
+ * next() picks the sequence's following token and it re-enters stage 0, so the
+ * pipeline stays full until sequences start retiring.
+ *
+ * Sequence i starts with tokens[i] at position pos[i] in sessions[i] and
+ * advances one position per pass until next() returns -1 or the context is
+ * full. Sessions must have no worker pool attached. At least n_stages
+ * sequences are needed to keep every stage busy. Returns 0 if a stage thread
+ * could not be started. */
+int pipeline_run(Model* model, Session* sessions, int n_seqs, const int* tokens, const int* pos, int n_stages,
+                 PipelineNextFn next, void* userdata, PipelineStats* stats);
+
+#endif /* __PIPELINE_H__ */
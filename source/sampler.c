@@ -99,36 +99,51 @@ int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex, f
     return probindex[last_idx].index; /* in case of rounding errors */
 }
 
-int sample(Sampler* sampler, float* logits) {
+/* sample among the first n logits, returning an index into them */
+static int sample_n(Sampler* sampler, float* logits, int n) {
     /* sample the token given the logits and some hyperparameters */
     int next;
     int i;
     float coin;
 
-    if (sampler->temperature == 0.0f) {
+    if (n == 1) {
+        /* a single candidate; top-p's cutoff would divide by zero */
+        next = 0;
+    } else if (sampler->temperature == 0.0f) {
         /* greedy argmax sampling: take the token with the highest probability */
-        next = sample_argmax(logits, sampler->vocab_size);
+        next = sample_argmax(logits, n);
     } else {
         /* apply the temperature to the logits */
-        for (i = 0; i < sampler->vocab_size; i++) {
+        for (i = 0; i < n; i++) {
             logits[i] /= sampler->temperature;
         }
         /* apply softmax to the logits to get the probabilities */
-        softmax(logits, sampler->vocab_size);
+        softmax(logits, n);
         /* flip a (float) coin (this is our source of entropy) */
         coin = random_f32(&sampler->rng_state);
         /* we sample from this distribution to get the next token */
         if (sampler->topp <= 0 || sampler->topp >= 1) {
             /* simply sample from the predicted probability distribution */
-            next = sample_mult(logits, sampler->vocab_size, coin);
+            next = sample_mult(logits, n, coin);
         } else {
             /* top-p (nucleus) sampling, clamping the least likely tokens to zero */
-            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+            next = sample_topp(logits, n, sampler->topp, sampler->probindex, coin);
         }
     }
     return next;
 }
 
+int sample(Sampler* sampler, float* logits) {
+    return sample_n(sampler, logits, sampler->vocab_size);
+}
+
+int sample_sparse(Sampler* sampler, float* logits, const int* ids, int n) {
+    if (n <= 0) {
+        return 2;  /* nothing is allowed: end the sequence (EOS) */
+    }
+    return ids[sample_n(sampler, logits, n)];
+}
+
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed) {
     /* initialize sampler struct with parameters */
     sampler->vocab_size = vocab_size;
@@ -136,7 +151,7 @@ void build_sampler(Sampler* sampler, int vocab_size, float temperature, float to
     sampler->topp = topp;
     sampler->rng_state = rng_seed;
     /* buffer only used with nucleus sampling; may not need but it's ~small */
-    sampler->probindex = ps3_malloc(sampler->vocab_size * sizeof(ProbIndex));
+    sampler->probindex = ps3_malloc_tagged(sampler->vocab_size * sizeof(ProbIndex), MEM_SAMPLER);
 }
 
 void free_sampler(Sampler* sampler) {
@@ -20,6 +20,9 @@ int sample_argmax(float* probabilities, int n);
 int sample_mult(float* probabilities, int n, float coin);
 int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex, float coin);
 int sample(Sampler* sampler, float* logits);
+/* Sample over a sparse candidate set: logits[i] belongs to token ids[i].
+ * Returns the chosen token id. */
+int sample_sparse(Sampler* sampler, float* logits, const int* ids, int n);
 
 /* Sampler initialization and cleanup */
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed);
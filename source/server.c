@@ -0,0 +1,1159 @@
+#include "server.h"
+#include "sampler.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <net/net.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SERVER_ID_MAX 64           /* longest request id echoed back */
+#define SERVER_TEXT_MAX (16*1024)  /* reply text kept for a non-streaming request */
+#define SERVER_DEFAULT_STEPS 256
+
+/* Why a sequence ended, reported as "finish" */
+#define FINISH_NONE    0
+#define FINISH_STOP    1   /* sampled BOS/EOS */
+#define FINISH_LENGTH  2   /* used its steps */
+#define FINISH_KV_FULL 3   /* the paged KV pool had no block left */
+
+static const char* finish_names[] = { "", "stop", "length", "kv_full" };
+
+typedef struct Server Server;
+
+typedef struct {
+    Server* server;
+    int fd;
+    int refs;                /* the reader plus every request not yet answered, under the server mutex */
+    int in_use;
+    int reader_done;         /* the reader thread has let go and only needs joining */
+    sys_ppu_thread_t reader;
+} ServerConnection;
+
+typedef struct {
+    ServerConnection* conn;
+    char id[SERVER_ID_MAX];  /* the request's id as JSON text, echoed in every reply */
+    char* prompt;
+    int steps;
+    float temperature;
+    float topp;
+    unsigned long long seed; /* 0 picks one */
+    int stream;
+    uint64_t arrival_us;
+} ServerRequest;
+
+typedef struct {
+    Session session;         /* this sequence's RunState and sampler over the server's model */
+    ServerRequest* req;      /* NULL while the slot is free */
+    int* tokens;             /* encoded prompt */
+    int n_prompt;
+    int n_shared;            /* prompt positions taken over from another sequence's cache */
+    int steps;
+    int pos;
+    int token;
+    int n_generated;
+    uint64_t admit_us;
+    uint64_t first_us;       /* first sampled token, 0 before it */
+    char* text;              /* reply text unless streaming */
+    size_t text_len;
+} ServerSlot;
+
+struct Server {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    int listen_fd;
+    sys_mutex_t mutex;       /* queue, connections, n_active, stats and shutdown */
+    sys_cond_t wake;         /* a request arrived or shutdown was asked for */
+    sys_mutex_t send_mutex;  /* keeps reply lines from different threads whole */
+    ServerRequest* queue[SERVER_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    ServerConnection conns[SERVER_MAX_CLIENTS];
+    ServerSlot slots[SERVER_MAX_SLOTS];
+    RunState batch[SERVER_MAX_SLOTS];  /* rows of the batched decoding step, each borrowing a slot's KV cache */
+    int n_slots;
+    int n_active;
+    char* piece_line;        /* slot_emit's reply, sized for the longest token escaped */
+    KVPool* kv_pool;         /* shared paged KV cache, NULL for one contiguous cache per slot */
+    volatile int shutdown;
+    unsigned long long next_seed;
+    EmitFn log;
+    void* userdata;
+    ServerStats stats;
+};
+
+/* Minimal JSON for flat request objects */
+
+static const char* json_skip_ws(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+static size_t put_utf8(char* out, size_t n, size_t size, unsigned int cp) {
+    char bytes[4];
+    size_t len, i;
+
+    if (cp < 0x80) {
+        bytes[0] = (char)cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        bytes[0] = (char)(0xc0 | (cp >> 6));
+        bytes[1] = (char)(0x80 | (cp & 0x3f));
+        len = 2;
+    } else if (cp < 0x10000) {
+        bytes[0] = (char)(0xe0 | (cp >> 12));
+        bytes[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        bytes[2] = (char)(0x80 | (cp & 0x3f));
+        len = 3;
+    } else {
+        bytes[0] = (char)(0xf0 | (cp >> 18));
+        bytes[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        bytes[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        bytes[3] = (char)(0x80 | (cp & 0x3f));
+        len = 4;
+    }
+    for (i = 0; i < len && n + 1 < size; i++) {
+        out[n++] = bytes[i];
+    }
+    return n;
+}
+
+/* The four hex digits of a \u escape. Returns the character after them, or NULL */
+static const char* json_hex4(const char* p, unsigned int* cp) {
+    char h;
+    int i;
+
+    *cp = 0;
+    for (i = 0; i < 4; i++) {
+        h = *p++;
+        if (h >= '0' && h <= '9') *cp = *cp * 16 + (h - '0');
+        else if (h >= 'a' && h <= 'f') *cp = *cp * 16 + (h - 'a' + 10);
+        else if (h >= 'A' && h <= 'F') *cp = *cp * 16 + (h - 'A' + 10);
+        else return NULL;
+    }
+    return p;
+}
+
+/* Decode the string starting at p's opening quote into out as UTF-8 (out may be
+ * NULL to just skip it). Returns the character after the closing quote, or NULL
+ * if the string is malformed. */
+static const char* json_parse_string(const char* p, char* out, size_t size) {
+    size_t n = 0;
+    unsigned int cp, low;
+    char c;
+
+    if (*p != '"') {
+        return NULL;
+    }
+    p++;
+    while (*p && *p != '"') {
+        c = *p++;
+        if (c == '\\') {
+            c = *p++;
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case '"': case '\\': case '/': break;
+            case 'u':
+                p = json_hex4(p, &cp);
+                if (!p || (cp >= 0xdc00 && cp <= 0xdfff)) {
+                    return NULL;
+                }
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    /* a high surrogate only makes a character with the low one after it */
+                    if (p[0] != '\\' || p[1] != 'u') {
+                        return NULL;
+                    }
+                    p = json_hex4(p + 2, &low);
+                    if (!p || low < 0xdc00 || low > 0xdfff) {
+                        return NULL;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                if (out) {
+                    n = put_utf8(out, n, size, cp);
+                }
+                continue;
+            default:
+                return NULL;
+            }
+        }
+        if (out && n + 1 < size) {
+            out[n++] = c;
+        }
+    }
+    if (*p != '"') {
+        return NULL;
+    }
+    if (out) {
+        out[n] = '\0';
+    }
+    return p + 1;
+}
+
+/* Skip one value of any type. Returns the character after it, or NULL if malformed */
+static const char* json_skip_value(const char* p) {
+    int depth = 0;
+
+    p = json_skip_ws(p);
+    if (*p == '"') {
+        return json_parse_string(p, NULL, 0);
+    }
+    if (*p == '{' || *p == '[') {
+        do {
+            if (*p == '"') {
+                p = json_parse_string(p, NULL, 0);
+                if (!p) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                depth--;
+            } else if (!*p) {
+                return NULL;
+            }
+            p++;
+        } while (depth > 0);
+        return p;
+    }
+    /* number, true, false or null */
+    if (!*p || *p == ',' || *p == '}') {
+        return NULL;
+    }
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+    return p;
+}
+
+/* Value of a top-level key of the object in line, or NULL if absent or malformed */
+static const char* json_field(const char* p, const char* key) {
+    char name[32];
+    const char* value;
+
+    p = json_skip_ws(p);
+    if (*p++ != '{') {
+        return NULL;
+    }
+    while (1) {
+        p = json_skip_ws(p);
+        if (*p == '}') {
+            return NULL;
+        }
+        p = json_parse_string(p, name, sizeof(name));
+        if (!p) {
+            return NULL;
+        }
+        p = json_skip_ws(p);
+        if (*p++ != ':') {
+            return NULL;
+        }
+        value = json_skip_ws(p);
+        if (strcmp(name, key) == 0) {
+            return value;
+        }
+        p = json_skip_value(value);
+        if (!p) {
+            return NULL;
+        }
+        p = json_skip_ws(p);
+        if (*p == ',') {
+            p++;
+        } else if (*p != '}') {
+            return NULL;
+        }
+    }
+}
+
+static double json_number(const char* line, const char* key, double fallback) {
+    const char* value = json_field(line, key);
+    char* end;
+    double d;
+
+    if (!value) {
+        return fallback;
+    }
+    d = strtod(value, &end);
+    return end == value ? fallback : d;
+}
+
+static int json_bool(const char* line, const char* key) {
+    const char* value = json_field(line, key);
+    return value && strncmp(value, "true", 4) == 0;
+}
+
+/* Copy the request's "id" as JSON text: strings and numbers are echoed as sent */
+static void json_id(const char* line, char* id) {
+    const char* value = json_field(line, "id");
+    const char* end = value ? json_skip_value(value) : NULL;
+
+    if (!end || end - value >= SERVER_ID_MAX || (*value != '"' && *value != '-' && (*value < '0' || *value > '9'))) {
+        strcpy(id, "null");
+        return;
+    }
+    memcpy(id, value, end - value);
+    id[end - value] = '\0';
+}
+
+/* Append s as the body of a JSON string; out needs 6 bytes per input byte plus one */
+static size_t json_escape(char* out, const char* s) {
+    size_t n = 0;
+    unsigned char c;
+
+    for (; *s; s++) {
+        c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else if (c < 0x20) {
+            n += sprintf(out + n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* Connections */
+
+static void send_line(Server* s, ServerConnection* conn, const char* line, size_t len) {
+    ssize_t sent;
+
+    sysMutexLock(s->send_mutex, 0);
+    while (len > 0) {
+        sent = send(conn->fd, line, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            break;  /* the client went away; its requests still run to completion */
+        }
+        line += sent;
+        len -= sent;
+    }
+    sysMutexUnlock(s->send_mutex);
+}
+
+static void send_error(Server* s, ServerConnection* conn, const char* id, const char* message) {
+    char line[SERVER_ID_MAX + 128];
+    int len = snprintf(line, sizeof(line), "{\"id\":%s,\"error\":\"%s\"}\n", id, message);
+    send_line(s, conn, line, len);
+}
+
+/* Drop one reference; the last one closes the socket. Call with the server mutex held.
+ * close() doesn't wait for the peer, unlike send(), which never runs under the mutex. */
+static void conn_release(ServerConnection* conn) {
+    if (--conn->refs == 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static void send_stats(Server* s, ServerConnection* conn, const char* id) {
+    ServerStats st;
+    int queued, active;
+    char line[640];
+    int len;
+
+    sysMutexLock(s->mutex, 0);
+    st = s->stats;
+    queued = s->queue_count;
+    active = s->n_active;
+    sysMutexUnlock(s->mutex);
+
+    len = snprintf(line, sizeof(line),
+                   "{\"id\":%s,\"requests\":%lld,\"rejected\":%lld,\"prompt_tokens\":%lld,\"generated\":%lld,"
+                   "\"queued\":%d,\"in_flight\":%d,\"max_in_flight\":%d,\"avg_queue_ms\":%.1f,\"avg_ttft_ms\":%.1f,"
+                   "\"avg_batch\":%.2f,\"tok_s\":%.2f,\"shared_positions\":%lld,\"kv_blocks\":%d,"
+                   "\"kv_blocks_peak\":%d,\"kv_blocks_total\":%d}\n",
+                   id, st.n_requests, st.n_rejected, st.n_prompt, st.n_generated, queued, active, st.max_in_flight,
+                   st.n_requests > 0 ? st.queue_us / 1000.0 / st.n_requests : 0.0,
+                   st.n_requests > 0 ? st.ttft_us / 1000.0 / st.n_requests : 0.0,
+                   st.n_rounds > 0 ? st.slot_rounds / (double)st.n_rounds : 0.0,
+                   st.busy_us > 0 ? st.n_generated * 1e6 / (double)st.busy_us : 0.0, st.n_shared,
+                   s->kv_pool ? kv_pool_total_blocks(s->kv_pool) - kv_pool_free_blocks(s->kv_pool) : 0,
+                   s->kv_pool ? kv_pool_peak_blocks(s->kv_pool) : 0, s->kv_pool ? kv_pool_total_blocks(s->kv_pool) : 0);
+    send_line(s, conn, line, len);
+}
+
+static void free_request(ServerRequest* req) {
+    ps3_free(req->prompt);
+    ps3_free(req);
+}
+
+/* Parse one request line and queue it, or answer it right away for commands and errors */
+static void handle_line(Server* s, ServerConnection* conn, const char* line) {
+    ServerRequest* req;
+    const char* value;
+    const char* end;
+    char id[SERVER_ID_MAX];
+    char cmd[16];
+    char reply[SERVER_ID_MAX + 32];
+    double steps, temperature, topp;
+    const char* invalid;
+    int queued = 0;
+
+    line = json_skip_ws(line);
+    if (!*line) {
+        return;
+    }
+    json_id(line, id);
+
+    value = json_field(line, "cmd");
+    if (value) {
+        if (!json_parse_string(value, cmd, sizeof(cmd))) {
+            cmd[0] = '\0';
+        }
+        if (strcmp(cmd, "stats") == 0) {
+            send_stats(s, conn, id);
+        } else if (strcmp(cmd, "shutdown") == 0) {
+            sysMutexLock(s->mutex, 0);
+            s->shutdown = 1;
+            sysCondSignal(s->wake);
+            sysMutexUnlock(s->mutex);
+            send_line(s, conn, reply, snprintf(reply, sizeof(reply), "{\"id\":%s,\"ok\":true}\n", id));
+        } else {
+            send_error(s, conn, id, "unknown command");
+        }
+        return;
+    }
+
+    value = json_field(line, "prompt");
+    end = value ? json_skip_value(value) : NULL;
+    if (!end || *value != '"') {
+        sysMutexLock(s->mutex, 0);
+        s->stats.n_rejected++;
+        sysMutexUnlock(s->mutex);
+        send_error(s, conn, id, "expected a JSON object with a \\\"prompt\\\" string");
+        return;
+    }
+
+    /* written so that NaN fails too */
+    steps = json_number(line, "steps", SERVER_DEFAULT_STEPS);
+    temperature = json_number(line, "temperature", 1.0);
+    topp = json_number(line, "topp", 0.9);
+    invalid = NULL;
+    if (!(steps >= 1.0 && steps <= 1e9)) {
+        invalid = "\\\"steps\\\" must be a positive number";
+    } else if (!(temperature >= 0.0 && temperature <= 1e6)) {
+        invalid = "\\\"temperature\\\" must be 0 or more";
+    } else if (!(topp > 0.0 && topp <= 1.0)) {
+        invalid = "\\\"topp\\\" must be in (0, 1]";
+    }
+    if (invalid) {
+        sysMutexLock(s->mutex, 0);
+        s->stats.n_rejected++;
+        sysMutexUnlock(s->mutex);
+        send_error(s, conn, id, invalid);
+        return;
+    }
+
+    req = (ServerRequest*)ps3_malloc(sizeof(ServerRequest));
+    if (!req) {
+        fprintf(stderr, "Failed to allocate server request\n");
+        exit(EXIT_FAILURE);
+    }
+    req->prompt = (char*)ps3_malloc(end - value);
+    if (!req->prompt) {
+        fprintf(stderr, "Failed to allocate server request\n");
+        exit(EXIT_FAILURE);
+    }
+    json_parse_string(value, req->prompt, end - value);
+    strcpy(req->id, id);
+    req->conn = conn;
+    req->steps = (int)steps;
+    req->temperature = (float)temperature;
+    req->topp = (float)topp;
+    req->seed = (unsigned long long)json_number(line, "seed", 0);
+    req->stream = json_bool(line, "stream");
+    req->arrival_us = ps3_time_us();
+
+    sysMutexLock(s->mutex, 0);
+    if (!s->shutdown && s->queue_count < SERVER_QUEUE_SIZE) {
+        s->queue[(s->queue_head + s->queue_count) % SERVER_QUEUE_SIZE] = req;
+        s->queue_count++;
+        conn->refs++;
+        queued = 1;
+        sysCondSignal(s->wake);
+    } else {
+        s->stats.n_rejected++;
+    }
+    sysMutexUnlock(s->mutex);
+
+    if (!queued) {
+        send_error(s, conn, id, s->shutdown ? "server shutting down" : "queue full");
+        free_request(req);
+    }
+}
+
+/* One per connection: splits the byte stream into lines and hands them to handle_line */
+static void reader_thread(void* arg) {
+    ServerConnection* conn = (ServerConnection*)arg;
+    Server* s = conn->server;
+    char buffer[SERVER_LINE_MAX];
+    size_t used = 0, len;
+    ssize_t got;
+    char* nl;
+    int discarding = 0;
+
+    while (1) {
+        got = recv(conn->fd, buffer + used, sizeof(buffer) - 1 - used, 0);
+        if (got <= 0) {
+            break;
+        }
+        used += got;
+        while ((nl = (char*)memchr(buffer, '\n', used)) != NULL) {
+            *nl = '\0';
+            if (!discarding) {
+                handle_line(s, conn, buffer);
+            }
+            discarding = 0;
+            len = nl + 1 - buffer;
+            used -= len;
+            memmove(buffer, nl + 1, used);
+        }
+        if (used == sizeof(buffer) - 1) {
+            /* drop the rest of an oversized line */
+            if (!discarding) {
+                send_error(s, conn, "null", "request line too long");
+            }
+            discarding = 1;
+            used = 0;
+        }
+    }
+
+    sysMutexLock(s->mutex, 0);
+    conn_release(conn);
+    conn->reader_done = 1;
+    sysMutexUnlock(s->mutex);
+}
+
+/* Join the readers of connections nobody uses anymore. Call with the server mutex held. */
+static void reap_connections(Server* s) {
+    ServerConnection* conn;
+    int i;
+
+    for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        conn = &s->conns[i];
+        if (conn->in_use && conn->reader_done && conn->refs == 0) {
+            ps3_thread_join(conn->reader);
+            conn->in_use = 0;
+        }
+    }
+}
+
+static void accept_thread(void* arg) {
+    Server* s = (Server*)arg;
+    const char* busy = "{\"id\":null,\"error\":\"too many connections\"}\n";
+    ServerConnection* conn;
+    int fd, i;
+
+    while (!s->shutdown) {
+        fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            ps3_thread_yield();
+            continue;
+        }
+
+        sysMutexLock(s->mutex, 0);
+        reap_connections(s);
+        conn = NULL;
+        for (i = 0; i < SERVER_MAX_CLIENTS && !conn; i++) {
+            if (!s->conns[i].in_use) {
+                conn = &s->conns[i];
+            }
+        }
+        if (conn && !s->shutdown) {
+            conn->server = s;
+            conn->fd = fd;
+            conn->refs = 1;
+            conn->reader_done = 0;
+            conn->in_use = 1;
+            if (!ps3_thread_create(&conn->reader, reader_thread, conn, "llama_client")) {
+                conn->in_use = 0;
+                conn = NULL;
+            }
+        } else {
+            conn = NULL;
+        }
+        sysMutexUnlock(s->mutex);
+
+        if (!conn) {
+            send(fd, busy, strlen(busy), MSG_NOSIGNAL);
+            close(fd);
+        }
+    }
+}
+
+/* Sequences */
+
+static void slot_emit(Server* s, ServerSlot* slot, const char* piece) {
+    char* line = s->piece_line;
+    size_t len = strlen(piece);
+    int n;
+
+    if (slot->req->stream) {
+        n = sprintf(line, "{\"id\":%s,\"piece\":\"", slot->req->id);
+        n += json_escape(line + n, piece);
+        n += sprintf(line + n, "\"}\n");
+        send_line(s, slot->req->conn, line, n);
+    } else if (slot->text_len + len < SERVER_TEXT_MAX) {
+        memcpy(slot->text + slot->text_len, piece, len + 1);
+        slot->text_len += len;
+    }
+}
+
+/* Answer the slot's request, account for it and free the slot */
+static void slot_finish(Server* s, ServerSlot* slot, int finish) {
+    ServerRequest* req = slot->req;
+    uint64_t now = ps3_time_us();
+    uint64_t queue_us = slot->admit_us - req->arrival_us;
+    uint64_t ttft_us = (slot->first_us ? slot->first_us : now) - req->arrival_us;
+    uint64_t decode_us = now - slot->admit_us;
+    double tok_s = decode_us > 0 ? slot->n_generated * 1e6 / (double)decode_us : 0.0;
+    char* line;
+    char report[160];
+    int n;
+
+    line = (char*)ps3_malloc(6 * slot->text_len + SERVER_ID_MAX + 256);
+    if (!line) {
+        fprintf(stderr, "Failed to allocate server reply\n");
+        exit(EXIT_FAILURE);
+    }
+    n = sprintf(line, "{\"id\":%s,\"done\":true,", req->id);
+    if (!req->stream) {
+        n += sprintf(line + n, "\"text\":\"");
+        n += json_escape(line + n, slot->text);
+        n += sprintf(line + n, "\",");
+    }
+    n += sprintf(line + n, "\"finish\":\"%s\",\"prompt_tokens\":%d,\"shared_tokens\":%d,\"generated\":%d,"
+                 "\"queue_ms\":%.1f,\"ttft_ms\":%.1f,\"total_ms\":%.1f,\"tok_s\":%.2f}\n", finish_names[finish],
+                 slot->n_prompt, slot->n_shared, slot->n_generated, queue_us / 1000.0, ttft_us / 1000.0,
+                 (now - req->arrival_us) / 1000.0, tok_s);
+    /* counted before the reply goes out, so a stats query right after it includes this request */
+    sysMutexLock(s->mutex, 0);
+    s->stats.n_requests++;
+    s->stats.n_prompt += slot->n_prompt;
+    s->stats.n_generated += slot->n_generated;
+    s->stats.queue_us += queue_us;
+    s->stats.ttft_us += ttft_us;
+    s->stats.n_shared += slot->n_shared;
+    s->n_active--;
+    sysMutexUnlock(s->mutex);
+
+    send_line(s, req->conn, line, n);
+    ps3_free(line);
+
+    snprintf(report, sizeof(report), "\n[%s] %d+%d tokens, queue %llu ms, ttft %llu ms, %.2f tok/s",
+             req->id, slot->n_prompt, slot->n_generated, (unsigned long long)(queue_us / 1000),
+             (unsigned long long)(ttft_us / 1000), tok_s);
+    s->log(report, s->userdata);
+
+    sysMutexLock(s->mutex, 0);
+    conn_release(req->conn);
+    sysMutexUnlock(s->mutex);
+
+    /* the blocks go back to the pool unless another sequence still shares them */
+    kv_cache_reset(&slot->session.state);
+    ps3_free(slot->tokens);
+    slot->tokens = NULL;
+    free_request(req);
+    slot->req = NULL;
+}
+
+/* With the paged cache, start a new sequence on the blocks of the active one
+ * whose prompt shares the longest prefix with it (at least one block's worth),
+ * so those positions needn't be prefilled again. Only positions the other
+ * sequence has already computed from its prompt tokens qualify, and the last
+ * prompt token is always run to get the first logits. */
+static void share_prefix(Server* s, ServerSlot* slot) {
+    ServerSlot* other;
+    ServerSlot* best = NULL;
+    int best_len = KV_BLOCK_SIZE - 1;
+    int limit, n, i;
+
+    for (i = 0; i < s->n_slots; i++) {
+        other = &s->slots[i];
+        if (other == slot || !other->req || !other->tokens) {
+            continue;
+        }
+        limit = other->pos < other->n_prompt ? other->pos : other->n_prompt;
+        if (limit > slot->n_prompt - 1) {
+            limit = slot->n_prompt - 1;
+        }
+        for (n = 0; n < limit && other->tokens[n] == slot->tokens[n]; n++) {
+        }
+        if (n > best_len) {
+            best_len = n;
+            best = other;
+        }
+    }
+    if (best) {
+        kv_cache_share(&slot->session.state, &best->session.state, best_len);
+        slot->pos = best_len;
+        slot->n_shared = best_len;
+    }
+}
+
+/* Encode the prompt of a freshly admitted request. Returns 0 (after answering
+ * with an error and freeing the slot) if there is nothing to run. */
+static int slot_start(Server* s, ServerSlot* slot) {
+    ServerRequest* req = slot->req;
+
+    slot->admit_us = ps3_time_us();
+    slot->tokens = (int*)ps3_malloc((strlen(req->prompt) + 3) * sizeof(int));
+    if (!slot->tokens) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    encode(s->tokenizer, req->prompt, 1, 0, slot->tokens, &slot->n_prompt);
+    if (slot->n_prompt < 1) {
+        send_error(s, req->conn, req->id, "prompt encoded to nothing");
+        ps3_free(slot->tokens);
+        slot->tokens = NULL;
+        sysMutexLock(s->mutex, 0);
+        s->stats.n_rejected++;
+        conn_release(req->conn);
+        s->n_active--;
+        sysMutexUnlock(s->mutex);
+        free_request(req);
+        slot->req = NULL;
+        return 0;
+    }
+
+    /* same position budget as generate(): prompt plus reply, within the context */
+    slot->steps = req->steps;
+    if (slot->steps > s->transformer->model.config.seq_len) {
+        slot->steps = s->transformer->model.config.seq_len;
+    }
+    slot->pos = 0;
+    slot->n_shared = 0;
+    if (s->kv_pool) {
+        share_prefix(s, slot);
+    }
+    slot->token = slot->tokens[slot->pos];
+    slot->n_generated = 0;
+    slot->first_us = 0;
+    slot->text[0] = '\0';
+    slot->text_len = 0;
+    slot->session.sampler.temperature = req->temperature;
+    slot->session.sampler.topp = req->topp;
+    slot->session.sampler.rng_state = req->seed ? req->seed : s->next_seed++;
+    return 1;
+}
+
+/* Feed up to SERVER_PREFILL_CHUNK prompt tokens while the prompt lasts, so a
+ * long prompt doesn't stall the other sequences. A sequence past its prompt
+ * gets its next position reserved and *decode set instead: it joins this
+ * round's batched decoding step. Returns a FINISH_* reason once the sequence
+ * is complete, FINISH_NONE while it goes on. */
+static int slot_prefill(Server* s, ServerSlot* slot, int* decode) {
+    int chunk = 0;
+
+    *decode = 0;
+    while (slot->pos < slot->n_prompt - 1 && slot->pos < slot->steps && chunk < SERVER_PREFILL_CHUNK) {
+        if (!kv_cache_reserve(&slot->session.state, slot->pos)) {
+            return FINISH_KV_FULL;
+        }
+        model_forward_rows(&s->transformer->model, &slot->session, slot->token, slot->pos, NULL, 0);
+        slot->token = slot->tokens[++slot->pos];
+        chunk++;
+    }
+    if (chunk > 0 || slot->pos >= slot->steps) {
+        return slot->pos >= slot->steps ? FINISH_LENGTH : FINISH_NONE;
+    }
+
+    if (!kv_cache_reserve(&slot->session.state, slot->pos)) {
+        return FINISH_KV_FULL;
+    }
+    *decode = 1;
+    return FINISH_NONE;
+}
+
+/* Sample the next token from the logits of the slot's decoding step */
+static int slot_sample(Server* s, ServerSlot* slot, float* logits) {
+    char* piece;
+    int next;
+
+    next = sample(&slot->session.sampler, logits);
+    slot->pos++;
+    slot->n_generated++;
+    if (slot->n_generated == 1) {
+        slot->first_us = ps3_time_us();
+    }
+    if (next == 1 || next == 2) {  /* BOS or EOS */
+        return FINISH_STOP;
+    }
+    piece = decode(s->tokenizer, slot->token, next);
+    if (piece) {
+        slot_emit(s, slot, piece);
+    }
+    slot->token = next;
+    return slot->pos >= slot->steps ? FINISH_LENGTH : FINISH_NONE;
+}
+
+static int open_listener(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_MAX_CLIENTS) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int create_sync(Server* s) {
+    sys_mutex_attr_t mutex_attr;
+    sys_cond_attr_t cond_attr;
+
+    memset(&mutex_attr, 0, sizeof(mutex_attr));
+    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
+    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
+    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_PSHARED;
+    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_NOT_ADAPTIVE;
+    strcpy(mutex_attr.name, "server");
+    memset(&cond_attr, 0, sizeof(cond_attr));
+    cond_attr.attr_pshared = SYS_COND_ATTR_PSHARED;
+    strcpy(cond_attr.name, "server");
+    if (sysMutexCreate(&s->mutex, &mutex_attr) != 0) {
+        return 0;
+    }
+    strcpy(mutex_attr.name, "send");
+    if (sysMutexCreate(&s->send_mutex, &mutex_attr) != 0) {
+        sysMutexDestroy(s->mutex);
+        return 0;
+    }
+    if (sysCondCreate(&s->wake, s->mutex, &cond_attr) != 0) {
+        sysMutexDestroy(s->send_mutex);
+        sysMutexDestroy(s->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+static void init_slots(Server* s, int n_slots) {
+    Transformer* t = s->transformer;
+    ServerSlot* slot;
+    int i;
+
+    s->n_slots = n_slots;
+    for (i = 0; i < n_slots; i++) {
+        slot = &s->slots[i];
+        session_init(&slot->session, &t->model, s->kv_pool, 1.0f, 0.9f, 1ull);
+        /* slots prefill one after another, so they share the server's workers and tile engine */
+        slot->session.state.pool = t->state.pool;
+        slot->session.state.tiled = t->state.tiled;
+        slot->session.state.specialized = t->state.specialized;
+        slot->text = (char*)ps3_malloc(SERVER_TEXT_MAX);
+        if (!slot->text) {
+            fprintf(stderr, "Failed to allocate server slots\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* a piece is at most one vocabulary entry, or a single raw byte */
+    s->piece_line = (char*)ps3_malloc(SERVER_ID_MAX + 6 * (s->tokenizer->max_token_length + 1) + 32);
+    if (!s->piece_line) {
+        fprintf(stderr, "Failed to allocate server slots\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the decoding step runs the batch rows' attention one after another, so they share the workers too */
+    malloc_run_state_batch(s->batch, &t->model.config, NULL, n_slots);
+    for (i = 0; i < n_slots; i++) {
+        s->batch[i].pool = t->state.pool;
+    }
+}
+
+static void free_slots(Server* s) {
+    ServerSlot* slot;
+    int i;
+
+    for (i = 0; i < s->n_slots; i++) {
+        slot = &s->slots[i];
+        slot->session.state.pool = NULL;
+        slot->session.state.tiled = NULL;
+        session_free(&slot->session);
+        ps3_free(slot->text);
+        s->batch[i].pool = NULL;
+    }
+    free_run_state_batch(s->batch, s->n_slots);
+    ps3_free(s->piece_line);
+}
+
+/* Turn away requests already taken off the queue. Called without the server
+ * mutex, so a client that stops reading can't hold up the others. */
+static void reject_requests(Server* s, ServerRequest** reqs, int n, const char* message) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        send_error(s, reqs[i]->conn, reqs[i]->id, message);
+    }
+    sysMutexLock(s->mutex, 0);
+    for (i = 0; i < n; i++) {
+        conn_release(reqs[i]->conn);
+    }
+    sysMutexUnlock(s->mutex);
+    for (i = 0; i < n; i++) {
+        free_request(reqs[i]);
+    }
+}
+
+/* Upper bound on the blocks a request's prompt needs: it encodes to at most one
+ * token per byte plus BOS and the dummy prefix */
+static int prompt_blocks(Server* s, ServerRequest* req) {
+    int n = (int)strlen(req->prompt) + 2;
+    if (n > req->steps) {
+        n = req->steps;
+    }
+    if (n > s->transformer->model.config.seq_len) {
+        n = s->transformer->model.config.seq_len;
+    }
+    return (n + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+}
+
+/* The scheduler loop: admit, prefill or decode every active sequence once,
+ * retire finished ones. All sequences past their prompt decode together in one
+ * forward_impl_batch, each at its own position. */
+static void schedule(Server* s) {
+    Model* m = &s->transformer->model;
+    ServerRequest* rejected[SERVER_QUEUE_SIZE];
+    ServerSlot* slot;
+    int admitted[SERVER_MAX_SLOTS];
+    int rows[SERVER_MAX_SLOTS];       /* slot of each batch row */
+    int tokens[SERVER_MAX_SLOTS];
+    int positions[SERVER_MAX_SLOTS];
+    uint64_t round_start;
+    int i, n_batch, n_rejected, decode, finish;
+    int free_blocks, need, stop_admitting;
+
+    while (1) {
+        sysMutexLock(s->mutex, 0);
+        while (!s->shutdown && s->n_active == 0 && s->queue_count == 0) {
+            sysCondWait(s->wake, 0);
+        }
+        if (s->shutdown) {
+            /* in-flight sequences finish, waiting ones are turned away once the lock is dropped */
+            n_rejected = 0;
+            while (s->queue_count > 0) {
+                rejected[n_rejected++] = s->queue[s->queue_head];
+                s->queue_head = (s->queue_head + 1) % SERVER_QUEUE_SIZE;
+                s->queue_count--;
+                s->stats.n_rejected++;
+            }
+            if (n_rejected > 0) {
+                sysMutexUnlock(s->mutex);
+                reject_requests(s, rejected, n_rejected, "server shutting down");
+                continue;
+            }
+            if (s->n_active == 0) {
+                sysMutexUnlock(s->mutex);
+                break;
+            }
+        }
+        /* with the paged cache a request also waits until its prompt's blocks are free */
+        free_blocks = s->kv_pool ? kv_pool_free_blocks(s->kv_pool) : 0;
+        stop_admitting = 0;
+        for (i = 0; i < s->n_slots; i++) {
+            admitted[i] = 0;
+            if (stop_admitting) {
+                continue;
+            }
+            if (!s->slots[i].req && s->queue_count > 0 && s->kv_pool) {
+                need = prompt_blocks(s, s->queue[s->queue_head]);
+                if (need > free_blocks && s->n_active > 0) {
+                    /* first come first served: nobody overtakes the head of the queue */
+                    stop_admitting = 1;
+                    continue;
+                }
+                free_blocks -= need;
+            }
+            if (!s->slots[i].req && s->queue_count > 0) {
+                s->slots[i].req = s->queue[s->queue_head];
+                s->queue_head = (s->queue_head + 1) % SERVER_QUEUE_SIZE;
+                s->queue_count--;
+                s->n_active++;
+                admitted[i] = 1;
+            }
+        }
+        if (s->n_active > s->stats.max_in_flight) {
+            s->stats.max_in_flight = s->n_active;
+        }
+        sysMutexUnlock(s->mutex);
+
+        round_start = ps3_time_us();
+        n_batch = 0;
+        for (i = 0; i < s->n_slots; i++) {
+            slot = &s->slots[i];
+            if (admitted[i] && !slot_start(s, slot)) {
+                continue;
+            }
+            if (slot->req) {
+                ps3_mem_hot_begin();
+                finish = slot_prefill(s, slot, &decode);
+                ps3_mem_hot_end();
+                if (finish != FINISH_NONE) {
+                    slot_finish(s, slot, finish);
+                } else if (decode) {
+                    run_state_borrow_kv(&s->batch[n_batch], &slot->session.state);
+                    rows[n_batch] = i;
+                    tokens[n_batch] = slot->token;
+                    positions[n_batch] = slot->pos;
+                    n_batch++;
+                }
+            }
+        }
+
+        if (n_batch > 0) {
+            ps3_mem_hot_begin();
+            forward_impl_batch(&m->config, &m->weights, s->batch, tokens, positions, n_batch);
+            ps3_mem_hot_end();
+            for (i = 0; i < n_batch; i++) {
+                run_state_borrow_kv(&s->batch[i], NULL);
+                slot = &s->slots[rows[i]];
+                ps3_mem_hot_begin();
+                finish = slot_sample(s, slot, s->batch[i].logits);
+                ps3_mem_hot_end();
+                if (finish != FINISH_NONE) {
+                    slot_finish(s, slot, finish);
+                }
+            }
+        }
+
+        sysMutexLock(s->mutex, 0);
+        s->stats.busy_us += ps3_time_us() - round_start;
+        if (n_batch > 0) {
+            s->stats.n_rounds++;
+            s->stats.slot_rounds += n_batch;
+        }
+        sysMutexUnlock(s->mutex);
+    }
+}
+
+int run_server(Transformer* transformer, Tokenizer* tokenizer, int port, int max_slots, size_t kv_bytes,
+               EmitFn log, void* userdata, ServerStats* stats) {
+    Config* p = &transformer->model.config;
+    Server* s;
+    sys_ppu_thread_t acceptor;
+    char line[128];
+    int i;
+
+    memset(stats, 0, sizeof(ServerStats));
+    if (max_slots < 1) {
+        max_slots = 1;
+    }
+    if (max_slots > SERVER_MAX_SLOTS) {
+        max_slots = SERVER_MAX_SLOTS;
+    }
+
+    s = (Server*)ps3_malloc(sizeof(Server));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate server\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(s, 0, sizeof(Server));
+    s->transformer = transformer;
+    s->tokenizer = tokenizer;
+    s->log = log;
+    s->userdata = userdata;
+    s->next_seed = 1234ull;
+
+    netInitialize();
+    s->listen_fd = open_listener(port);
+    if (s->listen_fd < 0) {
+        fprintf(stderr, "couldn't listen on port %d\n", port);
+        netDeinitialize();
+        ps3_free(s);
+        return 0;
+    }
+    if (!create_sync(s)) {
+        fprintf(stderr, "Failed to create server sync objects\n");
+        close(s->listen_fd);
+        netDeinitialize();
+        ps3_free(s);
+        return 0;
+    }
+    if (kv_bytes > 0) {
+        s->kv_pool = kv_pool_create_bytes(p->n_layers, p->n_kv_heads, p->dim / p->n_heads, kv_bytes);
+        if (!s->kv_pool) {
+            fprintf(stderr, "couldn't allocate a %u KB KV pool, using a full cache per sequence\n",
+                    (unsigned int)(kv_bytes / 1024));
+        }
+    }
+    init_slots(s, max_slots);
+    if (!ps3_thread_create(&acceptor, accept_thread, s, "llama_accept")) {
+        free_slots(s);
+        kv_pool_destroy(s->kv_pool);
+        sysCondDestroy(s->wake);
+        sysMutexDestroy(s->send_mutex);
+        sysMutexDestroy(s->mutex);
+        close(s->listen_fd);
+        netDeinitialize();
+        ps3_free(s);
+        return 0;
+    }
+
+    if (s->kv_pool) {
+        snprintf(line, sizeof(line), "\nListening on port %d, %d sequences per batch, %d KV blocks of %d positions",
+                 port, max_slots, kv_pool_total_blocks(s->kv_pool), KV_BLOCK_SIZE);
+    } else {
+        snprintf(line, sizeof(line), "\nListening on port %d, %d sequences per batch", port, max_slots);
+    }
+    log(line, userdata);
+
+    schedule(s);
+
+    /* wake the acceptor and every reader, then wait for them */
+    shutdown(s->listen_fd, SHUT_RDWR);
+    ps3_thread_join(acceptor);
+    close(s->listen_fd);
+    sysMutexLock(s->mutex, 0);
+    for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (s->conns[i].in_use && !s->conns[i].reader_done) {
+            shutdown(s->conns[i].fd, SHUT_RDWR);
+        }
+    }
+    sysMutexUnlock(s->mutex);
+    for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (s->conns[i].in_use) {
+            ps3_thread_join(s->conns[i].reader);
+        }
+    }
+
+    *stats = s->stats;
+    free_slots(s);
+    kv_pool_destroy(s->kv_pool);
+    sysCondDestroy(s->wake);
+    sysMutexDestroy(s->send_mutex);
+    sysMutexDestroy(s->mutex);
+    netDeinitialize();
+    ps3_free(s);
+    return 1;
+}
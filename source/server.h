@@ -0,0 +1,65 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stdint.h>
+#include "transformer.h"
+#include "tokenizer.h"
+#include "generate.h"
+
+#define SERVER_PORT 5150
+#define SERVER_MAX_SLOTS 16       /* upper bound for max_slots */
+#define SERVER_QUEUE_SIZE 64      /* requests waiting for a slot; more are rejected */
+#define SERVER_MAX_CLIENTS 16     /* open connections */
+#define SERVER_LINE_MAX 4096      /* longest request line */
+#define SERVER_PREFILL_CHUNK 16   /* prompt tokens a slot may prefill per scheduler round */
+
+/* Totals since the server started */
+typedef struct {
+    long long n_requests;    /* requests completed */
+    long long n_rejected;    /* malformed, queue full or dropped at shutdown */
+    long long n_prompt;      /* prompt tokens prefilled */
+    long long n_generated;   /* tokens sampled */
+    long long n_shared;      /* prompt positions reused from another sequence's KV blocks */
+    uint64_t queue_us;       /* summed over completed requests: arrival until a slot took it */
+    uint64_t ttft_us;        /* summed: arrival until the first sampled token */
+    uint64_t busy_us;        /* time with at least one sequence in flight */
+    long long n_rounds;      /* batched decoding steps */
+    long long slot_rounds;   /* sequences in them, summed over steps */
+    int max_in_flight;
+} ServerStats;
+
+/* Serve generation requests over TCP until a client sends {"cmd":"shutdown"}.
+ *
+ * Clients send one JSON object per line:
+ *   {"id":7, "prompt":"Once upon a time", "steps":128, "temperature":1.0,
+ *    "topp":0.9, "seed":42, "stream":true}
+ * Only "prompt" is required. Every reply is one JSON object per line carrying
+ * the request's id: {"id":7,"piece":"..."} per token when streaming, then
+ * {"id":7,"done":true,...} with the text (unless streamed), why it ended
+ * ("stop", "length" or "kv_full"), token counts, queue wait, time to first
+ * token and tok/s. {"cmd":"stats"} returns the aggregate counters, errors
+ * come back as {"id":...,"error":"..."}.
+ *
+ * The model stays loaded and up to max_slots sequences are decoded together,
+ * each in its own Session over the shared Model. The scheduler works in
+ * rounds: waiting requests take free slots at every round, sequences still
+ * reading their prompt advance by one prefill chunk, every other active
+ * sequence advances by one token in a single batched forward pass (each at its
+ * own position, reading every weight matrix once for all of them), and
+ * finished sequences give their slot back immediately, so the batch changes at
+ * token boundaries instead of waiting for its slowest member. "avg_batch" in
+ * the stats is the mean number of sequences per batched step.
+ *
+ * With kv_bytes > 0 the slots share a paged KV cache of that size (see
+ * kv_cache.h) instead of holding a full seq_len cache each: a sequence only
+ * takes blocks as it grows, so more slots fit in the same memory, and a new
+ * request whose prompt starts like an active one's reuses its blocks for the
+ * common prefix. Requests wait in the queue until their prompt's blocks are
+ * free; a sequence that runs out of blocks mid-way ends with "kv_full".
+ *
+ * log receives one line per event for the UI. Returns 0 if the socket could
+ * not be set up. */
+int run_server(Transformer* transformer, Tokenizer* tokenizer, int port, int max_slots, size_t kv_bytes,
+               EmitFn log, void* userdata, ServerStats* stats);
+
+#endif /* __SERVER_H__ */
@@ -0,0 +1,110 @@
+#include "startup.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* step_names[STARTUP_STEPS] = {
+    "model", "tokenizer", "vocab index", "run state", "rope table"
+};
+
+static void run_step(Startup* s, int step) {
+    s->timeline.begin_us[step] = ps3_time_us() - s->start;
+    switch (step) {
+    case STARTUP_MODEL:
+        load_model(&s->transformer->model, s->model_path, s->weight_format);
+        break;
+    case STARTUP_TOKENIZER:
+        build_tokenizer(s->tokenizer, s->tokenizer_path, s->config.vocab_size);
+        break;
+    case STARTUP_INDEX:
+        build_vocab_index(s->tokenizer);
+        break;
+    case STARTUP_STATE:
+        malloc_run_state(&s->transformer->state, &s->config);
+        break;
+    case STARTUP_TABLES:
+        s->rope = rope_table_create(&s->config);
+        break;
+    }
+    s->timeline.end_us[step] = ps3_time_us() - s->start;
+}
+
+/* One entry per thread; each touches only its own part of the structs */
+static void model_thread(void* arg) {
+    run_step((Startup*)arg, STARTUP_MODEL);
+}
+
+static void tokenizer_thread(void* arg) {
+    run_step((Startup*)arg, STARTUP_TOKENIZER);
+    run_step((Startup*)arg, STARTUP_INDEX);
+}
+
+static void state_thread(void* arg) {
+    run_step((Startup*)arg, STARTUP_STATE);
+    run_step((Startup*)arg, STARTUP_TABLES);
+}
+
+static void (*const thread_entries[STARTUP_THREADS])(void*) = {
+    model_thread, tokenizer_thread, state_thread
+};
+
+void startup_begin(Startup* s, Transformer* transformer, Tokenizer* tokenizer, char* model_path,
+                   const char* tokenizer_path, int weight_format) {
+    size_t mapped_size;
+    char error[128];
+    int i;
+
+    memset(s, 0, sizeof(Startup));
+    memset(transformer, 0, sizeof(Transformer));
+    s->transformer = transformer;
+    s->tokenizer = tokenizer;
+    s->model_path = model_path;
+    s->tokenizer_path = tokenizer_path;
+    s->weight_format = weight_format;
+    s->start = ps3_time_us();
+
+    if (!read_ps3_checkpoint(model_path, &s->config, &mapped_size, error)) {
+        fprintf(stderr, "%s", error);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < STARTUP_THREADS; i++) {
+        s->started[i] = ps3_thread_create(&s->threads[i], thread_entries[i], s, "llama_startup");
+    }
+}
+
+void startup_wait(Startup* s) {
+    int i;
+
+    for (i = 0; i < STARTUP_THREADS; i++) {
+        if (s->started[i]) {
+            ps3_thread_join(s->threads[i]);
+        } else {
+            thread_entries[i](s);
+        }
+    }
+    s->transformer->model.weights.rope = s->rope;
+    s->timeline.ready_us = ps3_time_us() - s->start;
+}
+
+void startup_report(Startup* s, EmitFn emit, void* userdata) {
+    uint64_t serial_us = 0;
+    char line[96];
+    int i;
+
+    for (i = 0; i < STARTUP_STEPS; i++) {
+        serial_us += s->timeline.end_us[i] - s->timeline.begin_us[i];
+    }
+    snprintf(line, sizeof(line), "\nstartup: ready in %llu ms, steps add up to %llu ms",
+             (unsigned long long)(s->timeline.ready_us / 1000), (unsigned long long)(serial_us / 1000));
+    emit(line, userdata);
+    for (i = 0; i < STARTUP_STEPS; i++) {
+        snprintf(line, sizeof(line), "\n  %-12s %6llu - %6llu ms", step_names[i],
+                 (unsigned long long)(s->timeline.begin_us[i] / 1000),
+                 (unsigned long long)(s->timeline.end_us[i] / 1000));
+        emit(line, userdata);
+    }
+}
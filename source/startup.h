@@ -0,0 +1,61 @@
+#ifndef __STARTUP_H__
+#define __STARTUP_H__
+
+#include <stdint.h>
+#include <sys/thread.h>
+#include "transformer.h"
+#include "tokenizer.h"
+#include "generate.h"
+
+/* Steps of a cold start, in the order a serial start would run them */
+#define STARTUP_MODEL     0   /* read and convert the checkpoint */
+#define STARTUP_TOKENIZER 1   /* read tokenizer.bin */
+#define STARTUP_INDEX     2   /* sort the vocabulary for encode */
+#define STARTUP_STATE     3   /* allocate the run state */
+#define STARTUP_TABLES    4   /* the RoPE table */
+#define STARTUP_STEPS     5
+
+/* Threads next to the caller's: the model, the tokenizer and its index, the
+ * run state and the RoPE table */
+#define STARTUP_THREADS   3
+
+typedef struct {
+    uint64_t begin_us[STARTUP_STEPS];  /* since startup_begin */
+    uint64_t end_us[STARTUP_STEPS];
+    uint64_t ready_us;                 /* when startup_wait returned */
+} StartupTimeline;
+
+typedef struct {
+    Transformer* transformer;
+    Tokenizer* tokenizer;
+    char* model_path;
+    const char* tokenizer_path;
+    int weight_format;
+    Config config;           /* read from the checkpoint header before anything starts */
+    float* rope;
+    uint64_t start;
+    sys_ppu_thread_t threads[STARTUP_THREADS];
+    int started[STARTUP_THREADS];
+    StartupTimeline timeline;
+} Startup;
+
+/* Build transformer and tokenizer like build_transformer_format and
+ * build_tokenizer would, with the independent steps on their own threads: the
+ * checkpoint load on one, the tokenizer load followed by its vocabulary index
+ * on another, and the run state and RoPE table on a third. Only the
+ * checkpoint's config header is read before they start, since every step
+ * needs the sizes in it. Returns at once; neither struct may be touched until
+ * startup_wait. A step whose thread can't be started runs in startup_wait. */
+void startup_begin(Startup* s, Transformer* transformer, Tokenizer* tokenizer, char* model_path,
+                   const char* tokenizer_path, int weight_format);
+
+/* Readiness barrier: returns once every step is done and the transformer and
+ * tokenizer are ready for use. The wall time to here is bounded by the slowest
+ * thread rather than by the sum of the steps. */
+void startup_wait(Startup* s);
+
+/* When each step ran, as report lines passed to emit, with the time a serial
+ * start would have taken next to the real one */
+void startup_report(Startup* s, EmitFn emit, void* userdata);
+
+#endif /* __STARTUP_H__ */
@@ -0,0 +1,232 @@
+#include "thread_utils.h"
+#include "memory_utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/systime.h>
+
+/* lv2 threads must leave through sysThreadExit, so every entry point is
+ * wrapped in a small trampoline that owns the (entry, arg) pair */
+typedef struct {
+    void (*entry)(void*);
+    void* arg;
+} ThreadStart;
+
+static void thread_trampoline(void* arg) {
+    ThreadStart start = *(ThreadStart*)arg;
+    ps3_free(arg);
+    start.entry(start.arg);
+    sysThreadExit(0);
+}
+
+int ps3_thread_create(sys_ppu_thread_t* id, void (*entry)(void*), void* arg, const char* name) {
+    ThreadStart* start = (ThreadStart*)ps3_malloc(sizeof(ThreadStart));
+    char thread_name[32];
+    int ret;
+
+    if (!start) {
+        return 0;
+    }
+    start->entry = entry;
+    start->arg = arg;
+
+    /* sysThreadCreate takes a non-const name */
+    strncpy(thread_name, name, sizeof(thread_name) - 1);
+    thread_name[sizeof(thread_name) - 1] = '\0';
+
+    ret = sysThreadCreate(id, thread_trampoline, start, PS3_THREAD_PRIORITY,
+                          PS3_THREAD_STACK_SIZE, THREAD_JOINABLE, thread_name);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to create thread %s (error %d)\n", name, ret);
+        ps3_free(start);
+        return 0;
+    }
+    return 1;
+}
+
+void ps3_thread_join(sys_ppu_thread_t id) {
+    uint64_t retval;
+    sysThreadJoin(id, &retval);
+}
+
+void ps3_thread_yield(void) {
+    sysThreadYield();
+}
+
+sys_ppu_thread_t ps3_thread_self(void) {
+    sys_ppu_thread_t id = 0;
+    sysThreadGetId(&id);
+    return id;
+}
+
+struct ThreadPool {
+    int n_threads;                /* including the caller */
+    sys_ppu_thread_t* threads;    /* the n_threads - 1 workers */
+    sys_mutex_t mutex;
+    sys_cond_t wake;              /* a new job or shutdown, for the workers */
+    sys_cond_t done;              /* the last worker left the job, for the caller */
+    volatile int generation;      /* bumped under the mutex for every job */
+    volatile int shutdown;
+    /* current job */
+    ThreadPoolTask task;
+    void* ctx;
+    int n_tasks;
+    volatile int next_task;       /* next unclaimed item */
+    int busy;                     /* workers still inside the current job, under the mutex */
+};
+
+/* Claim and run items until the job is exhausted */
+static void pool_drain(ThreadPool* pool) {
+    int index;
+    while ((index = __sync_fetch_and_add(&pool->next_task, 1)) < pool->n_tasks) {
+        pool->task(pool->ctx, index);
+    }
+}
+
+static void pool_worker(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    int seen = 0;
+
+    while (1) {
+        sysMutexLock(pool->mutex, 0);
+        while (pool->generation == seen && !pool->shutdown) {
+            sysCondWait(pool->wake, 0);
+        }
+        seen = pool->generation;
+        sysMutexUnlock(pool->mutex);
+
+        if (pool->shutdown) {
+            break;
+        }
+        pool_drain(pool);
+        sysMutexLock(pool->mutex, 0);
+        if (--pool->busy == 0) {
+            sysCondSignal(pool->done);
+        }
+        sysMutexUnlock(pool->mutex);
+    }
+}
+
+ThreadPool* thread_pool_create(int n_threads) {
+    ThreadPool* pool;
+    sys_mutex_attr_t mutex_attr;
+    sys_cond_attr_t cond_attr;
+    int i;
+
+    if (n_threads < 2) {
+        return NULL;
+    }
+    pool = (ThreadPool*)ps3_malloc(sizeof(ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(ThreadPool));
+    pool->threads = (sys_ppu_thread_t*)ps3_malloc((n_threads - 1) * sizeof(sys_ppu_thread_t));
+    if (!pool->threads) {
+        ps3_free(pool);
+        return NULL;
+    }
+
+    memset(&mutex_attr, 0, sizeof(mutex_attr));
+    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
+    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
+    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_PSHARED;
+    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_NOT_ADAPTIVE;
+    strcpy(mutex_attr.name, "pool");
+    memset(&cond_attr, 0, sizeof(cond_attr));
+    cond_attr.attr_pshared = SYS_COND_ATTR_PSHARED;
+    strcpy(cond_attr.name, "pool");
+    if (sysMutexCreate(&pool->mutex, &mutex_attr) != 0) {
+        fprintf(stderr, "Failed to create thread pool sync objects\n");
+        ps3_free(pool->threads);
+        ps3_free(pool);
+        return NULL;
+    }
+    if (sysCondCreate(&pool->wake, pool->mutex, &cond_attr) != 0) {
+        fprintf(stderr, "Failed to create thread pool sync objects\n");
+        sysMutexDestroy(pool->mutex);
+        ps3_free(pool->threads);
+        ps3_free(pool);
+        return NULL;
+    }
+    if (sysCondCreate(&pool->done, pool->mutex, &cond_attr) != 0) {
+        fprintf(stderr, "Failed to create thread pool sync objects\n");
+        sysCondDestroy(pool->wake);
+        sysMutexDestroy(pool->mutex);
+        ps3_free(pool->threads);
+        ps3_free(pool);
+        return NULL;
+    }
+
+    /* keep however many workers actually started */
+    pool->n_threads = 1;
+    for (i = 0; i < n_threads - 1; i++) {
+        if (!ps3_thread_create(&pool->threads[i], pool_worker, pool, "llama_worker")) {
+            break;
+        }
+        pool->n_threads++;
+    }
+    if (pool->n_threads == 1) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void thread_pool_destroy(ThreadPool* pool) {
+    int i;
+    if (!pool) {
+        return;
+    }
+    sysMutexLock(pool->mutex, 0);
+    pool->shutdown = 1;
+    sysCondBroadcast(pool->wake);
+    sysMutexUnlock(pool->mutex);
+    for (i = 0; i < pool->n_threads - 1; i++) {
+        ps3_thread_join(pool->threads[i]);
+    }
+    sysCondDestroy(pool->done);
+    sysCondDestroy(pool->wake);
+    sysMutexDestroy(pool->mutex);
+    ps3_free(pool->threads);
+    ps3_free(pool);
+}
+
+int thread_pool_size(ThreadPool* pool) {
+    return pool ? pool->n_threads : 1;
+}
+
+void thread_pool_run(ThreadPool* pool, int n_tasks, ThreadPoolTask task, void* ctx) {
+    int i;
+
+    if (!pool || n_tasks < 2) {
+        for (i = 0; i < n_tasks; i++) {
+            task(ctx, i);
+        }
+        return;
+    }
+
+    sysMutexLock(pool->mutex, 0);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->n_tasks = n_tasks;
+    pool->next_task = 0;
+    pool->busy = pool->n_threads - 1;
+    pool->generation++;
+    sysCondBroadcast(pool->wake);
+    sysMutexUnlock(pool->mutex);
+
+    /* the caller works too, then sleeps until the stragglers are done; taking
+     * the mutex also makes their results visible here */
+    pool_drain(pool);
+    sysMutexLock(pool->mutex, 0);
+    while (pool->busy > 0) {
+        sysCondWait(pool->done, 0);
+    }
+    sysMutexUnlock(pool->mutex);
+}
+
+uint64_t ps3_time_us(void) {
+    u64 sec, nsec;
+    sysGetCurrentTime(&sec, &nsec);
+    return (uint64_t)sec * 1000000ull + nsec / 1000;
+}
@@ -0,0 +1,48 @@
+#ifndef __THREAD_UTILS_H__
+#define __THREAD_UTILS_H__
+
+#include <stdint.h>
+#include <sys/thread.h>
+#include <sys/mutex.h>
+#include <sys/cond.h>
+
+/* Default priority and stack for worker threads (lower value = higher priority) */
+#define PS3_THREAD_PRIORITY   1500
+#define PS3_THREAD_STACK_SIZE (64*1024)
+
+/* Full memory barrier, needed when publishing data between the two PPU hardware threads */
+#define ps3_memory_barrier() __sync_synchronize()
+
+/* Start a joinable PPU thread running entry(arg). Returns 1 on success, 0 on failure */
+int ps3_thread_create(sys_ppu_thread_t* id, void (*entry)(void*), void* arg, const char* name);
+
+/* Wait for a thread started with ps3_thread_create to finish */
+void ps3_thread_join(sys_ppu_thread_t id);
+
+/* Give up the rest of the time slice */
+void ps3_thread_yield(void);
+
+/* Id of the calling thread */
+sys_ppu_thread_t ps3_thread_self(void);
+
+/* Persistent worker pool for data-parallel kernels. The calling thread takes
+ * part in every job, so a pool of n threads starts n - 1 workers. */
+typedef struct ThreadPool ThreadPool;
+
+/* Task callback: process work item `index` of the current job */
+typedef void (*ThreadPoolTask)(void* ctx, int index);
+
+/* Returns NULL if no worker could be started; callers then run serially */
+ThreadPool* thread_pool_create(int n_threads);
+void thread_pool_destroy(ThreadPool* pool);
+int thread_pool_size(ThreadPool* pool);
+
+/* Run task(ctx, i) for every i < n_tasks across the pool and wait for all of
+ * them. Items are claimed dynamically, so uneven items balance out. A NULL
+ * pool runs everything on the calling thread. */
+void thread_pool_run(ThreadPool* pool, int n_tasks, ThreadPoolTask task, void* ctx);
+
+/* Monotonic wall clock in microseconds, used for timing and throughput reports */
+uint64_t ps3_time_us(void);
+
+#endif /* __THREAD_UTILS_H__ */
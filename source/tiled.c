@@ -0,0 +1,251 @@
+#include "tiled.h"
+#include "gemv.h"
+#include "math_utils.h"
+#include "memory_utils.h"
+#include "thread_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* One transfer slot per tile buffer, like an MFC tag group */
+#define TILED_BUFFERS 2
+
+#define SLOT_IDLE   0
+#define SLOT_QUEUED 1
+#define SLOT_DONE   2
+
+typedef struct {
+    void* dst;
+    const void* src;
+    size_t size;
+    int seq;                 /* issue order, transfers complete in it */
+    volatile int state;
+} TiledTransfer;
+
+struct TiledEngine {
+    int tile_bytes;
+    int double_buffer;
+    char* buffers[TILED_BUFFERS];
+    TiledTransfer transfers[TILED_BUFFERS];
+    int next_seq;
+    sys_ppu_thread_t copier;
+    sys_mutex_t mutex;
+    sys_cond_t wake;
+    volatile int shutdown;
+    TiledStats stats;
+};
+
+/* The stand-in for the DMA engine: performs queued transfers in issue order */
+static void copy_thread(void* arg) {
+    TiledEngine* e = (TiledEngine*)arg;
+    TiledTransfer* t;
+    int i;
+
+    while (1) {
+        sysMutexLock(e->mutex, 0);
+        t = NULL;
+        while (!e->shutdown) {
+            for (i = 0; i < TILED_BUFFERS; i++) {
+                if (e->transfers[i].state == SLOT_QUEUED && (!t || e->transfers[i].seq < t->seq)) {
+                    t = &e->transfers[i];
+                }
+            }
+            if (t) {
+                break;
+            }
+            sysCondWait(e->wake, 0);
+        }
+        sysMutexUnlock(e->mutex);
+        if (!t) {
+            break;
+        }
+        memcpy(t->dst, t->src, t->size);
+        ps3_memory_barrier();
+        t->state = SLOT_DONE;
+    }
+}
+
+/* mfc_get equivalent: start filling buffer `tag` */
+static void dma_get(TiledEngine* e, int tag, const void* src, size_t size) {
+    TiledTransfer* t = &e->transfers[tag];
+
+    sysMutexLock(e->mutex, 0);
+    t->dst = e->buffers[tag];
+    t->src = src;
+    t->size = size;
+    t->seq = e->next_seq++;
+    t->state = SLOT_QUEUED;
+    sysCondSignal(e->wake);
+    sysMutexUnlock(e->mutex);
+    e->stats.bytes_staged += size;
+}
+
+/* mfc_read_tag_status_all equivalent: wait until buffer `tag` is filled */
+static void dma_wait(TiledEngine* e, int tag) {
+    uint64_t start;
+
+    if (e->transfers[tag].state != SLOT_DONE) {
+        start = ps3_time_us();
+        while (e->transfers[tag].state != SLOT_DONE) {
+            ps3_thread_yield();
+        }
+        e->stats.wait_us += ps3_time_us() - start;
+    }
+    ps3_memory_barrier();
+    e->transfers[tag].state = SLOT_IDLE;
+}
+
+TiledEngine* tiled_engine_create(int tile_bytes, int double_buffer) {
+    TiledEngine* e;
+    sys_mutex_attr_t mutex_attr;
+    sys_cond_attr_t cond_attr;
+    int i;
+
+    e = (TiledEngine*)ps3_malloc(sizeof(TiledEngine));
+    if (!e) {
+        return NULL;
+    }
+    memset(e, 0, sizeof(TiledEngine));
+    e->tile_bytes = tile_bytes;
+    e->double_buffer = double_buffer;
+    for (i = 0; i < TILED_BUFFERS; i++) {
+        e->buffers[i] = (char*)ps3_malloc_tagged(tile_bytes, MEM_ACTIVATIONS);
+        if (!e->buffers[i]) {
+            fprintf(stderr, "Failed to allocate tile buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&mutex_attr, 0, sizeof(mutex_attr));
+    mutex_attr.attr_protocol = SYS_MUTEX_PROTOCOL_FIFO;
+    mutex_attr.attr_recursive = SYS_MUTEX_ATTR_NOT_RECURSIVE;
+    mutex_attr.attr_pshared = SYS_MUTEX_ATTR_PSHARED;
+    mutex_attr.attr_adaptive = SYS_MUTEX_ATTR_NOT_ADAPTIVE;
+    strcpy(mutex_attr.name, "tiled");
+    memset(&cond_attr, 0, sizeof(cond_attr));
+    cond_attr.attr_pshared = SYS_COND_ATTR_PSHARED;
+    strcpy(cond_attr.name, "tiled");
+    if (sysMutexCreate(&e->mutex, &mutex_attr) != 0 ||
+        sysCondCreate(&e->wake, e->mutex, &cond_attr) != 0) {
+        fprintf(stderr, "Failed to create tiled engine sync objects\n");
+        for (i = 0; i < TILED_BUFFERS; i++) {
+            ps3_free(e->buffers[i]);
+        }
+        ps3_free(e);
+        return NULL;
+    }
+    if (!ps3_thread_create(&e->copier, copy_thread, e, "llama_dma")) {
+        sysCondDestroy(e->wake);
+        sysMutexDestroy(e->mutex);
+        for (i = 0; i < TILED_BUFFERS; i++) {
+            ps3_free(e->buffers[i]);
+        }
+        ps3_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void tiled_engine_destroy(TiledEngine* e) {
+    int i;
+    if (!e) {
+        return;
+    }
+    sysMutexLock(e->mutex, 0);
+    e->shutdown = 1;
+    sysCondSignal(e->wake);
+    sysMutexUnlock(e->mutex);
+    ps3_thread_join(e->copier);
+    sysCondDestroy(e->wake);
+    sysMutexDestroy(e->mutex);
+    for (i = 0; i < TILED_BUFFERS; i++) {
+        ps3_free(e->buffers[i]);
+    }
+    ps3_free(e);
+}
+
+/* Rows of row_bytes per tile next to x (n floats) and per_row bytes of other
+ * data per row (the tile's output, and a scale for int8 rows) */
+static int rows_per_tile(TiledEngine* e, int row_bytes, int per_row, int n) {
+    /* local store: both tile buffers, x and the per-row data */
+    int budget = LOCAL_STORE_SIZE - LOCAL_STORE_RESERVED - n * (int)sizeof(float);
+    int rows = e->tile_bytes / row_bytes;
+
+    if (rows * (TILED_BUFFERS * row_bytes + per_row) > budget) {
+        rows = budget / (TILED_BUFFERS * row_bytes + per_row);
+    }
+    return rows;
+}
+
+int tiled_rows_per_tile(TiledEngine* e, int n, int format) {
+    return rows_per_tile(e, n * (format == GEMV_FP16 ? (int)sizeof(uint16_t) : (int)sizeof(float)),
+                         (int)sizeof(float), n);
+}
+
+/* Stream the d rows of w through the tile buffers and compute each tile with
+ * gemv in `format`, or with matmul_q8 when scales is set */
+static void tiled_run(TiledEngine* e, float* xout, const float* x, const void* w, const float* scales, int format,
+                      size_t row_bytes, int rows, int n, int d) {
+    int n_tiles, t, r0, r1, cur;
+
+    n_tiles = (d + rows - 1) / rows;
+    if (e->double_buffer) {
+        dma_get(e, 0, w, (size_t)(rows < d ? rows : d) * row_bytes);
+    }
+    for (t = 0; t < n_tiles; t++) {
+        r0 = t * rows;
+        r1 = r0 + rows < d ? r0 + rows : d;
+        cur = e->double_buffer ? t & 1 : 0;
+        if (e->double_buffer) {
+            /* issue the next tile before touching this one */
+            if (t + 1 < n_tiles) {
+                int n0 = r1, n1 = r1 + rows < d ? r1 + rows : d;
+                dma_get(e, cur ^ 1, (const char*)w + n0 * row_bytes, (size_t)(n1 - n0) * row_bytes);
+            }
+        } else {
+            dma_get(e, 0, (const char*)w + r0 * row_bytes, (size_t)(r1 - r0) * row_bytes);
+        }
+        dma_wait(e, cur);
+        if (scales) {
+            matmul_q8(xout + r0, (float*)x, (const int8_t*)e->buffers[cur], scales + r0, n, r1 - r0);
+        } else {
+            gemv(xout + r0, x, e->buffers[cur], format, n, r1 - r0);
+        }
+        e->stats.n_tiles++;
+    }
+}
+
+void tiled_gemv(TiledEngine* e, float* xout, const float* x, const void* w, int format, int n, int d) {
+    size_t row_bytes = (size_t)n * (format == GEMV_FP16 ? sizeof(uint16_t) : sizeof(float));
+    int rows = tiled_rows_per_tile(e, n, format);
+    uint64_t start = ps3_time_us();
+
+    if (rows < 1) {
+        /* a single row doesn't fit the local store; nothing to stage */
+        gemv(xout, x, w, format, n, d);
+    } else {
+        tiled_run(e, xout, x, w, NULL, format, row_bytes, rows, n, d);
+    }
+    e->stats.total_us += ps3_time_us() - start;
+}
+
+void tiled_matmul_q8(TiledEngine* e, float* xout, const float* x, const int8_t* w, const float* scales, int n, int d) {
+    /* the scales are read in place like x; the budget counts one per row */
+    int rows = rows_per_tile(e, n, 2 * (int)sizeof(float), n);
+    uint64_t start = ps3_time_us();
+
+    if (rows < 1) {
+        matmul_q8(xout, (float*)x, w, scales, n, d);
+    } else {
+        tiled_run(e, xout, x, w, scales, GEMV_FP32, (size_t)n, rows, n, d);
+    }
+    e->stats.total_us += ps3_time_us() - start;
+}
+
+void tiled_stats(TiledEngine* e, TiledStats* stats) {
+    *stats = e->stats;
+}
+
+void tiled_reset_stats(TiledEngine* e) {
+    memset(&e->stats, 0, sizeof(TiledStats));
+}
@@ -0,0 +1,47 @@
+#ifndef __TILED_H__
+#define __TILED_H__
+
+#include <stdint.h>
+
+/* An SPE sees 256 KB of local store for code, stack and data. Part of it is
+ * set aside for the program itself; the rest holds the weight tiles plus the
+ * input vector and the output rows of the tile being computed. */
+#define LOCAL_STORE_SIZE   (256*1024)
+#define LOCAL_STORE_RESERVED (48*1024)
+#define TILE_DEFAULT_BYTES (96*1024)
+
+/* Counters since the engine was created or last reset */
+typedef struct {
+    uint64_t n_tiles;        /* tiles computed */
+    uint64_t bytes_staged;   /* weight bytes copied into tile buffers */
+    uint64_t wait_us;        /* time the compute side spent waiting for a transfer */
+    uint64_t total_us;       /* time inside tiled_gemv */
+} TiledStats;
+
+/* Tiled matmul engine. Weights are streamed through tile buffers of
+ * tile_bytes each, the way an SPE would pull them in with DMA, and a copy
+ * thread stands in for the MFC. With double_buffer the transfer of tile i+1 is
+ * issued before tile i is computed; without it every transfer is waited for
+ * before its tile is used, which shows how much the overlap buys. */
+typedef struct TiledEngine TiledEngine;
+
+/* Returns NULL if the copy thread can't be started */
+TiledEngine* tiled_engine_create(int tile_bytes, int double_buffer);
+void tiled_engine_destroy(TiledEngine* engine);
+
+/* W (d,n) @ x (n,) -> xout (d,) over staged tiles of whole rows, with w in
+ * GEMV_FP32 or GEMV_FP16 format. Rows are computed by the tuned GEMV kernels. */
+void tiled_gemv(TiledEngine* engine, float* xout, const float* x, const void* w, int format, int n, int d);
+
+/* Same for the int8 classifier: W (d,n) int8 rows with one scale each, computed
+ * tile by tile by matmul_q8 */
+void tiled_matmul_q8(TiledEngine* engine, float* xout, const float* x, const int8_t* w, const float* scales,
+                     int n, int d);
+
+/* Rows per tile for a row length, within the tile size and the local store budget */
+int tiled_rows_per_tile(TiledEngine* engine, int n, int format);
+
+void tiled_stats(TiledEngine* engine, TiledStats* stats);
+void tiled_reset_stats(TiledEngine* engine);
+
+#endif /* __TILED_H__ */
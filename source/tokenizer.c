@@ -26,6 +26,8 @@ void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size) {
     int i;
     int fd;
     uint64_t bytes_read;
+    uint64_t file_size;
+    char* str;
     float score;
     int len;
     int ret;
@@ -35,9 +37,13 @@ void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size) {
     t->vocab_size = vocab_size;
 
     /* allocate space for vocabulary and scores */
-    t->vocab = (char**)malloc(vocab_size * sizeof(char*));
-    t->vocab_scores = (float*)malloc(vocab_size * sizeof(float));
+    t->vocab = (char**)ps3_malloc_tagged(vocab_size * sizeof(char*), MEM_TOKENIZER);
+    t->vocab_scores = (float*)ps3_malloc_tagged(vocab_size * sizeof(float), MEM_TOKENIZER);
     t->sorted_vocab = NULL; /* initialized lazily */
+    if (!t->vocab || !t->vocab_scores) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
 
     /* init individual byte pieces */
     for (i = 0; i < 256; i++) {
@@ -52,6 +58,17 @@ void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size) {
         exit(EXIT_FAILURE);
     }
 
+    /* every string is shorter than its score and length fields, so the file
+     * size bounds them all with their terminators */
+    sysLv2FsLSeek64(fd, 0, SEEK_END, &file_size);
+    sysLv2FsLSeek64(fd, 0, SEEK_SET, &bytes_read);
+    t->vocab_storage = (char*)ps3_malloc_tagged(file_size, MEM_TOKENIZER);
+    if (!t->vocab_storage) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    str = t->vocab_storage;
+
     /* read in max_token_length */
     ret = sysLv2FsRead(fd, &raw_len, sizeof(int), &bytes_read);
     if (ret != 0 || bytes_read != sizeof(int)) {
@@ -61,6 +78,13 @@ void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size) {
     /* convert from little-endian */
     t->max_token_length = (unsigned int)swap32((int32_t)raw_len);
 
+    /* *2 for concat, +1 for null terminator +2 for UTF8 */
+    t->str_buffer = (char*)ps3_malloc_tagged((t->max_token_length*2 + 1 + 2) * sizeof(char), MEM_TOKENIZER);
+    if (!t->str_buffer) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* read in all the vocabulary data */
     for (i = 0; i < vocab_size; i++) {
         /* read float score */
@@ -80,26 +104,47 @@ void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size) {
         len = swap32(len);
 
         /* read the token string data */
-        t->vocab[i] = (char*)malloc(len + 1);
+        if (len < 0 || str + len + 1 > t->vocab_storage + file_size) {
+            fprintf(stderr, "bad token length\n");
+            exit(EXIT_FAILURE);
+        }
+        t->vocab[i] = str;
         ret = sysLv2FsRead(fd, t->vocab[i], len, &bytes_read);
         if (ret != 0 || bytes_read != (uint64_t)len) {
             fprintf(stderr, "failed to read token string\n");
             exit(EXIT_FAILURE);
         }
         t->vocab[i][len] = '\0'; /* add null terminator */
+        str += len + 1;
     }
 
     sysLv2FsClose(fd);
 }
 
-void free_tokenizer(Tokenizer* t) {
+void build_vocab_index(Tokenizer* t) {
     int i;
-    if (t->vocab) {
-        for (i = 0; i < t->vocab_size; i++) free(t->vocab[i]);
-        free(t->vocab);
+
+    if (t->sorted_vocab) {
+        return;
+    }
+    t->sorted_vocab = (TokenIndex*)ps3_malloc_tagged(t->vocab_size * sizeof(TokenIndex), MEM_TOKENIZER);
+    if (!t->sorted_vocab) {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < t->vocab_size; i++) {
+        t->sorted_vocab[i].str = t->vocab[i];
+        t->sorted_vocab[i].id = i;
     }
-    if (t->vocab_scores) free(t->vocab_scores);
-    if (t->sorted_vocab) free(t->sorted_vocab);
+    qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+}
+
+void free_tokenizer(Tokenizer* t) {
+    ps3_free(t->vocab);
+    ps3_free(t->vocab_storage);
+    ps3_free(t->vocab_scores);
+    ps3_free(t->sorted_vocab);
+    ps3_free(t->str_buffer);
     memset(t, 0, sizeof(Tokenizer));
 }
 
@@ -160,17 +205,11 @@ void encode(Tokenizer* t, char *text, int8_t bos, int8_t eos, int *tokens, int *
 
     /* lazy initialize the sorted vocabulary */
     if (t->sorted_vocab == NULL) {
-        t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
-        for (i = 0; i < t->vocab_size; i++) {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+        build_vocab_index(t);
     }
 
-    /* create a temporary buffer that will store merged tokens */
-    /* *2 for concat, +1 for null terminator +2 for UTF8 */
-    str_buffer = malloc((t->max_token_length*2 + 1 + 2) * sizeof(char));
+    /* the buffer that will store merged tokens */
+    str_buffer = t->str_buffer;
     str_len = 0;
 
     /* start at 0 tokens */
@@ -246,6 +285,4 @@ void encode(Tokenizer* t, char *text, int8_t bos, int8_t eos, int *tokens, int *
 
     /* add optional EOS (=2) token */
     if (eos) tokens[(*n_tokens)++] = 2;
-
-    free(str_buffer);
 }
\ No newline at end of file
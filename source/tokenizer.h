@@ -12,10 +12,12 @@ typedef struct {
 /* the tokenizer struct */
 typedef struct {
     char** vocab;           /* vocabulary strings */
+    char* vocab_storage;    /* every string, back to back */
     float* vocab_scores;    /* vocabulary scores */
     TokenIndex* sorted_vocab; /* vocab sorted for binary search */
     int vocab_size;         /* vocabulary size */
     unsigned int max_token_length; /* max token length from tokenizer.bin */
+    char* str_buffer;       /* encode's merge candidates, so it allocates nothing */
     unsigned char byte_pieces[512]; /* individual byte tokens */
 } Tokenizer;
 
@@ -25,10 +27,15 @@ int compare_tokens(const void *a, const void *b);
 /* Build tokenizer from file with PS3 byte handling */
 void build_tokenizer(Tokenizer* t, const char* tokenizer_path, int vocab_size);
 
+/* Sort the vocabulary for encode's lookups. encode does it on first use if
+ * nobody did before; a loader can do it up front on another thread */
+void build_vocab_index(Tokenizer* t);
+
 /* Free the memory */
 void free_tokenizer(Tokenizer* t);
 
-/* BOS=1, EOS=2 token ids. Returns number of tokens encoded in tokens[] array */
+/* BOS=1, EOS=2 token ids. Returns number of tokens encoded in tokens[] array.
+ * Uses the tokenizer's scratch space, so one encode at a time per tokenizer */
 void encode(Tokenizer* t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens);
 
 /* Convert token id back to string */
@@ -1,99 +1,177 @@
 #include "transformer.h"
 #include "math_utils.h"
-#include <malloc.h>
+#include "memory_utils.h"
 #include <string.h>
 #include <stdio.h>
 #include <ppu-lv2.h>
 #include <sys/file.h>
 
-/* PS3-specific memory alignment requirement */
-static void* malloc_aligned(size_t size) {
-    return memalign(128, size); /* 128-byte alignment for PS3 */
-}
-
-static void free_aligned(void* ptr) {
-    free(ptr);
-}
-
-void malloc_run_state(RunState* s, Config* p) {
+/* rows > 1 sizes every activation buffer for that many sequences, row after row */
+static void alloc_run_state(RunState* s, Config* p, KVPool* kv_pool, int threaded, int rows) {
     /* Calculate dimensions */
     int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int n_table = (p->seq_len + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+    int i;
     
     /* Allocate all buffers with PS3 alignment */
-    s->x = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->xb = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->xb2 = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->hb = (float*)malloc_aligned(p->hidden_dim * sizeof(float));
-    s->hb2 = (float*)malloc_aligned(p->hidden_dim * sizeof(float));
-    s->q = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->k = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->v = (float*)malloc_aligned(p->dim * sizeof(float));
-    s->att = (float*)malloc_aligned(p->n_heads * p->seq_len * sizeof(float));
-    s->logits = (float*)malloc_aligned(p->vocab_size * sizeof(float));
-    s->key_cache = (float*)malloc_aligned(p->n_layers * p->seq_len * kv_dim * sizeof(float));
-    s->value_cache = (float*)malloc_aligned(p->n_layers * p->seq_len * kv_dim * sizeof(float));
-
-    /* Initialize key and value cache to zeros */
-    if (s->key_cache) {
-        memset(s->key_cache, 0, p->n_layers * p->seq_len * kv_dim * sizeof(float));
-    }
-    if (s->value_cache) {
-        memset(s->value_cache, 0, p->n_layers * p->seq_len * kv_dim * sizeof(float));
+    s->x = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->xb = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->xb2 = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->hb = (float*)ps3_malloc_tagged((size_t)rows * p->hidden_dim * sizeof(float), MEM_ACTIVATIONS);
+    s->hb2 = (float*)ps3_malloc_tagged((size_t)rows * p->hidden_dim * sizeof(float), MEM_ACTIVATIONS);
+    s->q = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->k = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->v = (float*)ps3_malloc_tagged((size_t)rows * p->dim * sizeof(float), MEM_ACTIVATIONS);
+    s->att_max = (float*)ps3_malloc_tagged((size_t)rows * p->n_heads * sizeof(float), MEM_ACTIVATIONS);
+    s->att_sum = (float*)ps3_malloc_tagged((size_t)rows * p->n_heads * sizeof(float), MEM_ACTIVATIONS);
+    s->logits = (float*)ps3_malloc_tagged((size_t)rows * p->vocab_size * sizeof(float), MEM_ACTIVATIONS);
+    s->kv_pool = kv_pool;
+    if (kv_pool) {
+        /* paged: blocks are mapped as positions are first written */
+        s->key_cache = NULL;
+        s->value_cache = NULL;
+        s->kv_blocks = (int*)ps3_malloc_tagged(n_table * sizeof(int), MEM_KV);
+        s->kv_n_table = n_table;
+        if (s->kv_blocks) {
+            for (i = 0; i < n_table; i++) {
+                s->kv_blocks[i] = -1;
+            }
+        }
+        s->kv_layout = KV_LAYOUT_PAGED;
+    } else if (rows > 1) {
+        /* batch rows without a pool have no cache of their own, see run_state_borrow_kv */
+        s->key_cache = NULL;
+        s->value_cache = NULL;
+        s->kv_blocks = NULL;
+        s->kv_n_table = 0;
+        s->kv_layout = KV_LAYOUT_HEAD_MAJOR;
+    } else {
+        s->key_cache = (float*)ps3_malloc_large(p->n_layers * p->seq_len * kv_dim * sizeof(float), MEM_KV);
+        s->value_cache = (float*)ps3_malloc_large(p->n_layers * p->seq_len * kv_dim * sizeof(float), MEM_KV);
+        s->kv_blocks = NULL;
+        s->kv_n_table = 0;
+
+        /* Initialize key and value cache to zeros */
+        if (s->key_cache) {
+            memset(s->key_cache, 0, p->n_layers * p->seq_len * kv_dim * sizeof(float));
+        }
+        if (s->value_cache) {
+            memset(s->value_cache, 0, p->n_layers * p->seq_len * kv_dim * sizeof(float));
+        }
+
+        /* Stream each head's keys and values contiguously in attention */
+        s->kv_layout = KV_LAYOUT_HEAD_MAJOR;
     }
 
+    /* Attention heads are spread over both PPU hardware threads; on failure we just run serially */
+    s->pool = threaded ? thread_pool_create(FORWARD_THREADS) : NULL;
+
+    /* weights are read in place unless a tiled engine is attached later */
+    s->tiled = NULL;
+
+    /* fixed-shape forward passes are used whenever the model matches one */
+    s->specialized = 1;
+
+    /* only attention is spread over the pool unless asked otherwise */
+    s->row_split = 0;
+
     /* Validate allocations */
     if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q || !s->k || !s->v ||
-        !s->att || !s->logits || !s->key_cache || !s->value_cache) {
+        !s->att_max || !s->att_sum || !s->logits ||
+        (kv_pool ? !s->kv_blocks : rows == 1 && (!s->key_cache || !s->value_cache))) {
         fprintf(stderr, "malloc failed!\n");
         exit(EXIT_FAILURE);
     }
 }
 
-void free_run_state(RunState* s) {
-    free_aligned(s->x);
-    free_aligned(s->xb);
-    free_aligned(s->xb2);
-    free_aligned(s->hb);
-    free_aligned(s->hb2);
-    free_aligned(s->q);
-    free_aligned(s->k);
-    free_aligned(s->v);
-    free_aligned(s->att);
-    free_aligned(s->logits);
-    free_aligned(s->key_cache);
-    free_aligned(s->value_cache);
-}
-
-/* Helper function for PS3 endianness handling */
-static int32_t swap32(int32_t value) {
-    return ((value & 0xFF000000) >> 24) |
-           ((value & 0x00FF0000) >> 8)  |
-           ((value & 0x0000FF00) << 8)  |
-           ((value & 0x000000FF) << 24);
-}
-
-static float swap_float(float value) {
-    uint32_t temp;
-    memcpy(&temp, &value, sizeof(float));
-    temp = swap32(temp);
-    float result;
-    memcpy(&result, &temp, sizeof(float));
-    return result;
+void malloc_run_state(RunState* s, Config* p) {
+    alloc_run_state(s, p, NULL, 1, 1);
 }
 
-void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights,
-                    int* fd, float** data, ssize_t* file_size) {
-    /* Open using PS3 syscall */
-    uint64_t bytes_read;
-    int ret = sysLv2FsOpen(checkpoint, SYS_O_RDONLY, fd, 0, NULL, 0);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to open checkpoint file\n");
-        exit(EXIT_FAILURE);
+void malloc_run_state_shared(RunState* s, Config* p, KVPool* kv_pool, ThreadPool* workers) {
+    alloc_run_state(s, p, kv_pool, 0, 1);
+    s->pool = workers;
+}
+
+void malloc_run_state_batch(RunState* states, Config* p, KVPool* pool, int batch) {
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    RunState* s;
+    int b, i;
+
+    alloc_run_state(&states[0], p, pool, 0, batch);
+    for (b = 1; b < batch; b++) {
+        s = &states[b];
+        *s = states[0];
+        s->x += b * p->dim;
+        s->xb += b * p->dim;
+        s->xb2 += b * p->dim;
+        s->hb += b * p->hidden_dim;
+        s->hb2 += b * p->hidden_dim;
+        s->q += b * p->dim;
+        s->k += b * kv_dim;
+        s->v += b * kv_dim;
+        s->att_max += b * p->n_heads;
+        s->att_sum += b * p->n_heads;
+        s->logits += b * p->vocab_size;
+        if (!pool) {
+            continue;
+        }
+        s->kv_blocks = (int*)ps3_malloc_tagged(s->kv_n_table * sizeof(int), MEM_KV);
+        if (!s->kv_blocks) {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < s->kv_n_table; i++) {
+            s->kv_blocks[i] = -1;
+        }
     }
+}
 
-    /* Read config with endianness conversion */
+void free_run_state_batch(RunState* states, int batch) {
+    int b;
+
+    for (b = 1; b < batch; b++) {
+        kv_cache_reset(&states[b]);
+        ps3_free(states[b].kv_blocks);
+    }
+    free_run_state(&states[0]);
+}
+
+void run_state_borrow_kv(RunState* s, const RunState* owner) {
+    s->key_cache = owner ? owner->key_cache : NULL;
+    s->value_cache = owner ? owner->value_cache : NULL;
+    s->kv_layout = owner ? owner->kv_layout : KV_LAYOUT_HEAD_MAJOR;
+    s->kv_pool = owner ? owner->kv_pool : NULL;
+    s->kv_blocks = owner ? owner->kv_blocks : NULL;
+    s->kv_n_table = owner ? owner->kv_n_table : 0;
+}
+
+void free_run_state(RunState* s) {
+    thread_pool_destroy(s->pool);
+    tiled_engine_destroy(s->tiled);
+    ps3_free(s->x);
+    ps3_free(s->xb);
+    ps3_free(s->xb2);
+    ps3_free(s->hb);
+    ps3_free(s->hb2);
+    ps3_free(s->q);
+    ps3_free(s->k);
+    ps3_free(s->v);
+    ps3_free(s->att_max);
+    ps3_free(s->att_sum);
+    ps3_free(s->logits);
+    ps3_free(s->key_cache);
+    ps3_free(s->value_cache);
+    if (s->kv_blocks) {
+        kv_cache_reset(s);
+        ps3_free(s->kv_blocks);
+    }
+}
+
+static void read_config(int fd, Config* config) {
+    uint64_t bytes_read;
     int32_t raw_values[7];
-    ret = sysLv2FsRead(*fd, raw_values, sizeof(raw_values), &bytes_read);
+    int ret = sysLv2FsRead(fd, raw_values, sizeof(raw_values), &bytes_read);
     if (ret == 0 && bytes_read == sizeof(raw_values)) {
         config->dim = swap32(raw_values[0]);
         config->hidden_dim = swap32(raw_values[1]);
@@ -106,6 +184,20 @@ void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weigh
         fprintf(stderr, "Failed to read config\n");
         exit(EXIT_FAILURE);
     }
+}
+
+void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights,
+                    int* fd, float** data, ssize_t* file_size) {
+    /* Open using PS3 syscall */
+    uint64_t bytes_read;
+    int ret = sysLv2FsOpen(checkpoint, SYS_O_RDONLY, fd, 0, NULL, 0);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to open checkpoint file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Read config with endianness conversion */
+    read_config(*fd, config);
 
     /* Calculate file size */
     uint64_t pos;
@@ -114,7 +206,7 @@ void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weigh
     sysLv2FsLSeek64(*fd, 0, SEEK_SET, &pos);
 
     /* Allocate memory for the entire file */
-    *data = (float*)malloc_aligned(*file_size);
+    *data = (float*)ps3_malloc_large(*file_size, MEM_WEIGHTS);
     if (!*data) {
         fprintf(stderr, "Failed to allocate memory for checkpoint\n");
         exit(EXIT_FAILURE);
@@ -163,6 +255,7 @@ void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weigh
     weights_ptr += config->n_layers * config->dim * config->hidden_dim;
     
     weights->rms_final_weight = weights_ptr;
+    weights->weight_format = WEIGHTS_FP32;
     
     /* Handle endianness for all float values */
     size_t float_count = *file_size / sizeof(float);
@@ -172,37 +265,318 @@ void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weigh
     }
 }
 
+/* Destination of one contiguous run of floats in the checkpoint */
+typedef struct {
+    size_t count;
+    float* f32;       /* kept in fp32, or */
+    uint16_t* f16;    /* narrowed to fp16, or */
+    int8_t* q8;       /* quantized to int8 per row of `row_len`, scales in q8_scale */
+    float* q8_scale;
+    int row_len;
+    const float* fold; /* (layer, row_len) norm weights to scale each row's columns by, or NULL */
+    size_t fold_layer; /* elements per layer of the matrix */
+} LoadRegion;
+
+#define LOAD_CHUNK_FLOATS (64*1024)
+
+/* Quantize one row to int8 with a single absmax scale */
+static void quantize_row_q8(int8_t* q, float* scale, const float* row, int n) {
+    float max_abs = 0.0f;
+    float inv;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        float a = row[i] < 0.0f ? -row[i] : row[i];
+        if (a > max_abs) max_abs = a;
+    }
+    *scale = max_abs / 127.0f;
+    inv = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+    for (i = 0; i < n; i++) {
+        float v = row[i] * inv;
+        q[i] = (int8_t)(v < 0.0f ? v - 0.5f : v + 0.5f);
+    }
+}
+
+void read_checkpoint_streamed(char* checkpoint, Config* config, TransformerWeights* weights, int weight_format,
+                              int* fd, float** data, uint16_t** data_f16, int8_t** data_q8, ssize_t* file_size) {
+    LoadRegion regions[12];
+    uint32_t* chunk;
+    float* row = NULL;
+    int row_fill = 0;
+    uint64_t bytes_read;
+    uint64_t pos;
+    size_t f32_count, f16_count, q8_count, remaining, n, i, e;
+    float* f32_ptr;
+    uint16_t* f16_ptr;
+    int8_t* q8_ptr;
+    int half = (weight_format & WEIGHTS_PRECISION_MASK) == WEIGHTS_FP16;
+    int embedding_q8 = (weight_format & WEIGHTS_EMBEDDING_Q8) != 0;
+    int fold = (weight_format & WEIGHTS_FOLD_NORMS) != 0;
+    int n_regions = 0;
+    int r, ret;
+
+    ret = sysLv2FsOpen(checkpoint, SYS_O_RDONLY, fd, 0, NULL, 0);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to open checkpoint file\n");
+        exit(EXIT_FAILURE);
+    }
+    read_config(*fd, config);
+
+    sysLv2FsLSeek64(*fd, 0, SEEK_END, &pos);
+    *file_size = pos;
+    sysLv2FsLSeek64(*fd, sizeof(Config), SEEK_SET, &pos);
+
+    int head_size = config->dim / config->n_heads;
+    size_t dim = config->dim;
+    size_t kv_dim = config->n_kv_heads * head_size;
+    size_t hidden_dim = config->hidden_dim;
+    size_t n_layers = config->n_layers;
+    size_t vocab_size = config->vocab_size;
+    size_t layer_matrices = n_layers * (2 * dim * dim + 2 * dim * kv_dim + 3 * dim * hidden_dim);
+
+    /* norms (and the int8 row scales) are always fp32 in *data; matrices go to
+     * *data as well or to *data_f16; an int8 embedding table lives in *data_q8 */
+    f32_count = 2 * n_layers * dim + dim + (half ? 0 : layer_matrices);
+    f16_count = half ? layer_matrices : 0;
+    q8_count = 0;
+    if (embedding_q8) {
+        f32_count += vocab_size;
+        q8_count = vocab_size * dim;
+    } else if (half) {
+        f16_count += vocab_size * dim;
+    } else {
+        f32_count += vocab_size * dim;
+    }
+    *data = (float*)ps3_malloc_large(f32_count * sizeof(float), MEM_WEIGHTS);
+    *data_f16 = f16_count ? (uint16_t*)ps3_malloc_large(f16_count * sizeof(uint16_t), MEM_WEIGHTS) : NULL;
+    *data_q8 = q8_count ? (int8_t*)ps3_malloc_large(q8_count, MEM_WEIGHTS) : NULL;
+    chunk = (uint32_t*)ps3_malloc_tagged(LOAD_CHUNK_FLOATS * sizeof(uint32_t), MEM_WEIGHTS);
+    if (embedding_q8) {
+        row = (float*)ps3_malloc_tagged(dim * sizeof(float), MEM_WEIGHTS);
+    }
+    if (!*data || (f16_count && !*data_f16) || (q8_count && !*data_q8) || !chunk || (embedding_q8 && !row)) {
+        fprintf(stderr, "Failed to allocate memory for checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    f32_ptr = *data;
+    f16_ptr = *data_f16;
+    q8_ptr = *data_q8;
+    memset(regions, 0, sizeof(regions));
+
+    /* same order as read_checkpoint maps them */
+#define FLOAT_REGION(field, n_elems) \
+    weights->field = f32_ptr; \
+    regions[n_regions].count = (n_elems); regions[n_regions].f32 = f32_ptr; \
+    f32_ptr += (n_elems); n_regions++;
+/* the norm weights are read before the matrices that follow them, so they can be
+ * folded in before narrowing; the final norm stays, as its matrix is the
+ * embedding table */
+#define FOLD_NORM(norm, rows) \
+    if (fold) { \
+        regions[n_regions - 1].fold = weights->norm; \
+        regions[n_regions - 1].row_len = dim; \
+        regions[n_regions - 1].fold_layer = (rows) * dim; \
+    }
+#define MATRIX_REGION(field, n_elems) \
+    if (half) { \
+        weights->field##_f16 = f16_ptr; \
+        regions[n_regions].count = (n_elems); regions[n_regions].f16 = f16_ptr; \
+        f16_ptr += (n_elems); n_regions++; \
+    } else { \
+        FLOAT_REGION(field, n_elems) \
+    }
+
+    if (embedding_q8) {
+        weights->token_embedding_q8 = q8_ptr;
+        weights->token_embedding_scale = f32_ptr;
+        regions[n_regions].count = vocab_size * dim;
+        regions[n_regions].q8 = q8_ptr;
+        regions[n_regions].q8_scale = f32_ptr;
+        regions[n_regions].row_len = dim;
+        f32_ptr += vocab_size;
+        n_regions++;
+    } else {
+        MATRIX_REGION(token_embedding_table, vocab_size * dim)
+    }
+    FLOAT_REGION(rms_att_weight, n_layers * dim)
+    MATRIX_REGION(wq, n_layers * dim * dim)
+    FOLD_NORM(rms_att_weight, dim)
+    MATRIX_REGION(wk, n_layers * dim * kv_dim)
+    FOLD_NORM(rms_att_weight, kv_dim)
+    MATRIX_REGION(wv, n_layers * dim * kv_dim)
+    FOLD_NORM(rms_att_weight, kv_dim)
+    MATRIX_REGION(wo, n_layers * dim * dim)
+    FLOAT_REGION(rms_ffn_weight, n_layers * dim)
+    MATRIX_REGION(w1, n_layers * dim * hidden_dim)
+    FOLD_NORM(rms_ffn_weight, hidden_dim)
+    MATRIX_REGION(w2, n_layers * hidden_dim * dim)
+    MATRIX_REGION(w3, n_layers * dim * hidden_dim)
+    FOLD_NORM(rms_ffn_weight, hidden_dim)
+    FLOAT_REGION(rms_final_weight, dim)
+#undef MATRIX_REGION
+#undef FOLD_NORM
+#undef FLOAT_REGION
+    weights->wcls = NULL;
+    weights->weight_format = weight_format;
+    weights->norms_folded = fold;
+
+    /* stream the file through a small staging buffer so the fp32 copy never
+     * has to fit in memory next to the converted one */
+    fp16_init();
+    q8_init();
+    for (r = 0; r < n_regions; r++) {
+        LoadRegion* region = &regions[r];
+        remaining = region->count;
+        while (remaining > 0) {
+            n = remaining < LOAD_CHUNK_FLOATS ? remaining : LOAD_CHUNK_FLOATS;
+            ret = sysLv2FsRead(*fd, chunk, n * sizeof(float), &bytes_read);
+            if (ret != 0 || bytes_read != n * sizeof(float)) {
+                fprintf(stderr, "Failed to read checkpoint data\n");
+                exit(EXIT_FAILURE);
+            }
+            for (i = 0; i < n; i++) {
+                uint32_t bits = (uint32_t)swap32((int32_t)chunk[i]);
+                float value;
+                memcpy(&value, &bits, sizeof(float));
+                if (region->fold) {
+                    e = region->count - remaining + i;
+                    value *= region->fold[(e / region->fold_layer) * region->row_len + e % region->row_len];
+                }
+                if (region->q8) {
+                    /* rows can straddle chunks, so collect a whole row before quantizing */
+                    row[row_fill++] = value;
+                    if (row_fill == region->row_len) {
+                        quantize_row_q8(region->q8, region->q8_scale++, row, row_fill);
+                        region->q8 += row_fill;
+                        row_fill = 0;
+                    }
+                } else if (region->f16) {
+                    *region->f16++ = fp32_to_fp16(value);
+                } else {
+                    *region->f32++ = value;
+                }
+            }
+            remaining -= n;
+        }
+    }
+    if (row) {
+        ps3_free(row);
+    }
+    ps3_free(chunk);
+}
+
 float* forward(Transformer* transformer, int token, int pos) {
     /* Call the core forward implementation */
-    forward_impl(&transformer->config, &transformer->weights, &transformer->state, token, pos);
+    forward_impl(&transformer->model.config, &transformer->model.weights, &transformer->state, token, pos);
+    return transformer->state.logits;
+}
+
+float* forward_rows(Transformer* transformer, int token, int pos, const int* rows, int n_rows) {
+    forward_impl_rows(&transformer->model.config, &transformer->model.weights, &transformer->state,
+                      token, pos, rows, n_rows);
     return transformer->state.logits;
 }
 
+float* classify_rows(Transformer* transformer, const int* rows, int n_rows) {
+    classifier_rows(&transformer->model.config, &transformer->model.weights, &transformer->state, rows, n_rows);
+    return transformer->state.logits;
+}
+
+float* model_forward(Model* m, Session* s, int token, int pos) {
+    forward_impl(&m->config, &m->weights, &s->state, token, pos);
+    return s->state.logits;
+}
+
+float* model_forward_rows(Model* m, Session* s, int token, int pos, const int* rows, int n_rows) {
+    forward_impl_rows(&m->config, &m->weights, &s->state, token, pos, rows, n_rows);
+    return s->state.logits;
+}
+
+void build_model(Model* m, char* checkpoint_path, int weight_format) {
+    load_model(m, checkpoint_path, weight_format);
+    m->weights.rope = rope_table_create(&m->config);
+}
+
+void load_model(Model* m, char* checkpoint_path, int weight_format) {
+    /* Zero out the model struct */
+    memset(m, 0, sizeof(Model));
+
+    /* Read in the config and weights; anything but plain fp32 is converted while streaming */
+    if (weight_format != WEIGHTS_FP32) {
+        read_checkpoint_streamed(checkpoint_path, &m->config, &m->weights, weight_format, &m->fd,
+                                 &m->data, &m->data_f16, &m->data_q8, &m->file_size);
+    } else {
+        read_checkpoint(checkpoint_path, &m->config, &m->weights, &m->fd, &m->data, &m->file_size);
+    }
+}
+
+void free_model(Model* m) {
+    /* Free the mapped data */
+    ps3_free(m->data);
+    ps3_free(m->data_f16);
+    ps3_free(m->data_q8);
+    ps3_free(m->weights.rope);
+
+    /* Close file descriptor */
+    if (m->fd != -1) {
+        sysLv2FsClose(m->fd);
+    }
+
+    /* Zero out the struct */
+    memset(m, 0, sizeof(Model));
+}
+
+void session_init(Session* s, Model* m, KVPool* kv_pool, float temperature, float topp, unsigned long long seed) {
+    alloc_run_state(&s->state, &m->config, kv_pool, 0, 1);
+    build_sampler(&s->sampler, m->config.vocab_size, temperature, topp, seed);
+}
+
+void session_free(Session* s) {
+    free_run_state(&s->state);
+    free_sampler(&s->sampler);
+}
+
+void session_memory(Model* m, Session* s, SessionMemory* mem) {
+    Config* p = &m->config;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t block_bytes;
+    int b;
+
+    mem->activations = (size_t)(6 * p->dim + 2 * p->hidden_dim + 2 * p->n_heads + p->vocab_size) * sizeof(float);
+    mem->kv_shared = 0;
+    if (s->state.kv_layout == KV_LAYOUT_PAGED) {
+        block_bytes = kv_block_bytes(p->n_layers, p->n_kv_heads, p->dim / p->n_heads);
+        mem->activations += s->state.kv_n_table * sizeof(int);
+        mem->kv_cache = kv_cache_blocks(&s->state) * block_bytes;
+        for (b = 0; b < s->state.kv_n_table; b++) {
+            if (s->state.kv_blocks[b] >= 0 && kv_block_refcount(s->state.kv_pool, s->state.kv_blocks[b]) > 1) {
+                mem->kv_shared += block_bytes;
+            }
+        }
+    } else {
+        mem->kv_cache = 2 * (size_t)p->n_layers * p->seq_len * kv_dim * sizeof(float);
+    }
+    mem->sampler = s->sampler.probindex ? (size_t)s->sampler.vocab_size * sizeof(ProbIndex) : 0;
+    mem->total = mem->activations + mem->kv_cache + mem->sampler;
+}
+
 void build_transformer(Transformer* t, char* checkpoint_path) {
-    /* Zero out the transformer struct */
+    build_transformer_format(t, checkpoint_path, WEIGHTS_FP32);
+}
+
+void build_transformer_format(Transformer* t, char* checkpoint_path, int weight_format) {
     memset(t, 0, sizeof(Transformer));
-    
-    /* Read in the config and weights */
-    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
-    
+    build_model(&t->model, checkpoint_path, weight_format);
+
     /* Allocate the run state buffers */
-    malloc_run_state(&t->state, &t->config);
+    malloc_run_state(&t->state, &t->model.config);
 }
 
 void free_transformer(Transformer* t) {
     /* Free the run state */
     free_run_state(&t->state);
-    
-    /* Free the mapped data */
-    if (t->data) {
-        free_aligned(t->data);
-    }
-    
-    /* Close file descriptor */
-    if (t->fd != -1) {
-        sysLv2FsClose(t->fd);
-    }
-    
+    free_model(&t->model);
+
     /* Zero out the struct */
     memset(t, 0, sizeof(Transformer));
-}
\ No newline at end of file
+}
@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include "thread_utils.h"
+#include "tiled.h"
+#include "kv_cache.h"
+#include "sampler.h"
 
 /* Configuration structure from run.c */
 typedef struct {
@@ -16,6 +20,16 @@ typedef struct {
     int seq_len;    /* max sequence length */
 } Config;
 
+/* Storage precision of the weight matrices */
+#define WEIGHTS_FP32 0 /* as in the checkpoint */
+#define WEIGHTS_FP16 1 /* IEEE half, widened to fp32 inside the kernels; norms stay fp32 */
+#define WEIGHTS_PRECISION_MASK 0x0f
+/* Flag: store the shared embedding/classifier table as int8 rows with one fp32 scale each */
+#define WEIGHTS_EMBEDDING_Q8 0x10
+/* Flag: multiply the attention/ffn rmsnorm weights into the columns of wq/wk/wv
+ * and w1/w3 while loading, so the forward pass only computes 1/rms */
+#define WEIGHTS_FOLD_NORMS 0x20
+
 /* Weights for the transformer */
 typedef struct {
     /* token embedding table */
@@ -36,8 +50,32 @@ typedef struct {
     float* rms_final_weight;        /* (dim,) */
     /* (optional) classifier weights for the logits, on the last layer */
     float* wcls;
+    /* fp16 matrices; with WEIGHTS_FP16 these replace the fp32 pointers above, which are NULL */
+    int weight_format;               /* WEIGHTS_FP32 or WEIGHTS_FP16, plus WEIGHTS_EMBEDDING_Q8 and WEIGHTS_FOLD_NORMS */
+    int norms_folded;                /* rms_att_weight/rms_ffn_weight are in the matrices; the final norm never is */
+    uint16_t* token_embedding_table_f16;
+    uint16_t* wq_f16;
+    uint16_t* wk_f16;
+    uint16_t* wv_f16;
+    uint16_t* wo_f16;
+    uint16_t* w1_f16;
+    uint16_t* w2_f16;
+    uint16_t* w3_f16;
+    /* int8 embedding/classifier table; with WEIGHTS_EMBEDDING_Q8 it replaces both table pointers above */
+    int8_t* token_embedding_q8;      /* (vocab_size, dim) */
+    float* token_embedding_scale;    /* (vocab_size,) dequantization scale per row */
+    /* RoPE cos/sin per position, see rope_table_create */
+    float* rope;                     /* (seq_len, head_size) */
 } TransformerWeights;
 
+/* KV cache layouts */
+#define KV_LAYOUT_POSITION_MAJOR 0 /* (layer, seq_len, kv_dim) as in run.c */
+#define KV_LAYOUT_HEAD_MAJOR     1 /* (layer, n_kv_heads, seq_len, head_size), each head's rows contiguous */
+#define KV_LAYOUT_PAGED          2 /* KV_BLOCK_SIZE positions per block from a shared KVPool, see kv_cache.h */
+
+/* Threads used by the forward pass, one per PPU hardware thread */
+#define FORWARD_THREADS 2
+
 /* RunState for the forward pass */
 typedef struct {
     /* current wave of activations */
@@ -47,35 +85,120 @@ typedef struct {
     float* hb;        /* buffer for hidden dimension in the ffn (hidden_dim,) */
     float* hb2;       /* buffer for hidden dimension in the ffn (hidden_dim,) */
     float* q;         /* query (dim,) */
-    float* k;         /* key (dim,) */
-    float* v;         /* value (dim,) */
-    float* att;       /* buffer for scores/attention values (n_heads, seq_len) */
+    float* k;         /* key for the current position (kv_dim,) */
+    float* v;         /* value for the current position (kv_dim,) */
+    float* att_max;   /* running max of the attention scores (n_heads,) */
+    float* att_sum;   /* running softmax denominator (n_heads,) */
     float* logits;    /* output logits */
     /* kv cache */
-    float* key_cache;   /* (layer, seq_len, dim) */
-    float* value_cache; /* (layer, seq_len, dim) */
+    float* key_cache;   /* (layer, seq_len, kv_dim) or (layer, n_kv_heads, seq_len, head_size) */
+    float* value_cache; /* same layout as key_cache */
+    int kv_layout;      /* KV_LAYOUT_*, head-major unless changed before the first forward */
+    KVPool* kv_pool;    /* KV_LAYOUT_PAGED: blocks come from here and key_cache/value_cache are NULL */
+    int* kv_blocks;     /* KV_LAYOUT_PAGED: pool block per KV_BLOCK_SIZE positions, -1 while unmapped */
+    int kv_n_table;     /* entries in kv_blocks, seq_len / KV_BLOCK_SIZE rounded up */
+    ThreadPool* pool;   /* workers for head-parallel attention, NULL runs serially */
+    TiledEngine* tiled; /* stages the weight matrices tile by tile when set, NULL reads them in place */
+    int specialized;    /* use the compile-time specialized forward for known shapes (default 1) */
+    int row_split;      /* spread every matmul's rows over pool as well (default 0) */
 } RunState;
 
-/* The transformer struct that combines everything */
+/* A loaded model: hyperparameters and weights. Nothing in it is written after
+ * build_model returns (the kernels' lookup tables are filled while loading), so
+ * any number of threads may run forward passes against one Model at once. */
 typedef struct {
     Config config;           /* the hyperparameters of the architecture */
     TransformerWeights weights; /* the weights of the model */
-    RunState state;         /* buffers for the "wave" of activations in the forward pass */
     /* some more state needed to properly clean up the memory mapping */
     int fd;                 /* file descriptor for memory mapping */
-    float* data;           /* memory mapped data pointer */
+    float* data;           /* memory mapped data pointer (just the norms with fp16 weights) */
+    uint16_t* data_f16;    /* fp16 matrices, NULL with fp32 weights */
+    int8_t* data_q8;       /* int8 embedding table, NULL unless WEIGHTS_EMBEDDING_Q8 */
     ssize_t file_size;     /* size of the checkpoint file in bytes */
+} Model;
+
+/* Everything one generation writes: activations, its KV cache and the sampler
+ * with its RNG. A session is used by one thread at a time; different sessions
+ * over the same Model can run on different threads. */
+typedef struct {
+    RunState state;
+    Sampler sampler;
+} Session;
+
+/* Bytes held by one session */
+typedef struct {
+    size_t activations;      /* RunState buffers, logits included */
+    size_t kv_cache;         /* full cache, or the blocks currently mapped when paged */
+    size_t kv_shared;        /* part of kv_cache in blocks other sessions also map */
+    size_t sampler;          /* top-p scratch */
+    size_t total;
+} SessionMemory;
+
+/* The transformer struct that combines everything: a model with a single
+ * run state, for the modes that generate one sequence at a time */
+typedef struct {
+    Model model;
+    RunState state;         /* buffers for the "wave" of activations in the forward pass */
 } Transformer;
 
 /* Core functions matching run.c signatures */
 void malloc_run_state(RunState* s, Config* p);
+/* Same without starting workers of its own: s runs on the caller's workers, or
+ * serially with NULL, and must have s->pool cleared again before free_run_state.
+ * With kv_pool the KV cache is paged: positions take blocks from it as the
+ * sequence grows and free_run_state gives them back; kv_pool stays the caller's. */
+void malloc_run_state_shared(RunState* s, Config* p, KVPool* kv_pool, ThreadPool* workers);
 void free_run_state(RunState* s);
+/* `batch` run states for forward_impl_batch, paged from pool when given, with
+ * their activation buffers laid out as consecutive rows of states[0]'s
+ * (x at stride dim, k and v at kv_dim, hb at hidden_dim, logits at vocab_size).
+ * With a pool each gets a block table of its own; with pool NULL they get no
+ * KV cache at all and must borrow one per forward (see run_state_borrow_kv).
+ * No worker pool is attached. Free them together with free_run_state_batch. */
+void malloc_run_state_batch(RunState* states, Config* p, KVPool* pool, int batch);
+void free_run_state_batch(RunState* states, int batch);
+/* Point s at owner's KV cache (contiguous or paged) so a forward on s reads
+ * and extends owner's sequence; NULL detaches it again. s must not own a cache
+ * itself, i.e. come from malloc_run_state_batch without a pool. */
+void run_state_borrow_kv(RunState* s, const RunState* owner);
 float* forward(Transformer* transformer, int token, int pos);
+/* Sparse classifier: logits[r] is the logit of token rows[r]. With n_rows == 0 the
+ * classifier is skipped entirely, e.g. for prompt tokens whose logits are unused. */
+float* forward_rows(Transformer* transformer, int token, int pos, const int* rows, int n_rows);
+/* Logits of the given rows for the hidden state of the last forward, e.g. after
+ * forward_rows(..., NULL, 0) once the candidate rows are known */
+float* classify_rows(Transformer* transformer, const int* rows, int n_rows);
 void build_transformer(Transformer* t, char* checkpoint_path);
+/* Same, storing the weight matrices as WEIGHTS_FP32 or WEIGHTS_FP16, optionally
+ * | WEIGHTS_EMBEDDING_Q8 and | WEIGHTS_FOLD_NORMS */
+void build_transformer_format(Transformer* t, char* checkpoint_path, int weight_format);
 void free_transformer(Transformer* t);
 
+/* Model and sessions */
+void build_model(Model* m, char* checkpoint_path, int weight_format);
+/* build_model without the RoPE table, for a loader that builds the table
+ * on another thread and sets weights.rope itself */
+void load_model(Model* m, char* checkpoint_path, int weight_format);
+void free_model(Model* m);
+/* A session with its own RunState and sampler. The KV cache is paged from
+ * kv_pool when given (the pool belongs to the caller), a full seq_len cache
+ * otherwise. Sessions get no attention workers of their own, as concurrency
+ * comes from running sessions side by side; a caller stepping a single
+ * session may attach a ThreadPool to state.pool and detach it before
+ * session_free. */
+void session_init(Session* s, Model* m, KVPool* kv_pool, float temperature, float topp, unsigned long long seed);
+void session_free(Session* s);
+void session_memory(Model* m, Session* s, SessionMemory* mem);
+/* forward and forward_rows for one session; only s is written */
+float* model_forward(Model* m, Session* s, int token, int pos);
+float* model_forward_rows(Model* m, Session* s, int token, int pos, const int* rows, int n_rows);
+
 /* Memory mapping functions */
 void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights,
                     int* fd, float** data, ssize_t* file_size);
+/* Streams an fp32 checkpoint into the storage picked by weight_format: fp32 tensors in
+ * *data, fp16 matrices in *data_f16 and an int8 embedding table in *data_q8 */
+void read_checkpoint_streamed(char* checkpoint, Config* config, TransformerWeights* weights, int weight_format,
+                              int* fd, float** data, uint16_t** data_f16, int8_t** data_q8, ssize_t* file_size);
 
 #endif /* __TRANSFORMER_H__ */
\ No newline at end of file
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Load generator for the llama2PS3 inference server (`server` mode).
+
+Opens --clients connections to the PS3 and has each send --requests prompts
+one after another, then prints per-request latency percentiles and the
+server's own aggregate counters.
+
+    python3 tools/loadgen.py 192.168.1.20 --clients 4 --requests 8 --steps 128
+"""
+import argparse
+import json
+import socket
+import threading
+import time
+
+PROMPTS = [
+    "Once upon a time",
+    "The little dog",
+    "Lily wanted to",
+    "One day, a big",
+    "Tom and his friend",
+    "There was a tree",
+]
+
+
+class Connection:
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.file = self.sock.makefile("r", encoding="utf-8", errors="replace")
+
+    def send(self, obj):
+        self.sock.sendall((json.dumps(obj) + "\n").encode("utf-8"))
+
+    def recv(self):
+        line = self.file.readline()
+        if not line:
+            raise ConnectionError("server closed the connection")
+        return json.loads(line)
+
+    def close(self):
+        self.file.close()
+        self.sock.close()
+
+
+def client(args, index, results, lock):
+    conn = Connection(args.host, args.port)
+    for r in range(args.requests):
+        rid = index * 1000 + r
+        start = time.time()
+        conn.send({"id": rid, "prompt": args.prefix + PROMPTS[rid % len(PROMPTS)], "steps": args.steps,
+                   "temperature": args.temperature, "seed": rid + 1, "stream": args.stream})
+        first = None
+        while True:
+            reply = conn.recv()
+            if "piece" in reply and first is None:
+                first = time.time()
+            if reply.get("done") or "error" in reply:
+                break
+        end = time.time()
+        reply["client_ms"] = (end - start) * 1000.0
+        reply["client_ttft_ms"] = ((first or end) - start) * 1000.0
+        with lock:
+            results.append(reply)
+            if args.verbose:
+                print(json.dumps(reply))
+    conn.close()
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=5150)
+    parser.add_argument("--clients", type=int, default=4, help="concurrent connections")
+    parser.add_argument("--requests", type=int, default=4, help="requests per connection")
+    parser.add_argument("--steps", type=int, default=128)
+    parser.add_argument("--temperature", type=float, default=1.0)
+    parser.add_argument("--prefix", default="", help="text put in front of every prompt, e.g. a shared instruction")
+    parser.add_argument("--stream", action="store_true", help="stream pieces")
+    parser.add_argument("--shutdown", action="store_true", help="stop the server afterwards")
+    parser.add_argument("--verbose", action="store_true", help="print every reply")
+    args = parser.parse_args()
+
+    results = []
+    lock = threading.Lock()
+    threads = [threading.Thread(target=client, args=(args, i, results, lock)) for i in range(args.clients)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    wall = time.time() - start
+
+    done = [r for r in results if r.get("done")]
+    errors = len(results) - len(done)
+    generated = sum(r["generated"] for r in done)
+    print("%d requests (%d errors) in %.1f s, %d tokens, %.2f tok/s end to end"
+          % (len(results), errors, wall, generated, generated / wall if wall > 0 else 0.0))
+    for key in ("queue_ms", "ttft_ms", "total_ms", "tok_s"):
+        values = [r[key] for r in done]
+        print("  %-9s p50 %8.1f  p90 %8.1f  max %8.1f" % (key, percentile(values, 50),
+                                                          percentile(values, 90), max(values or [0.0])))
+
+    conn = Connection(args.host, args.port)
+    conn.send({"cmd": "stats"})
+    print("server:", json.dumps(conn.recv()))
+    if args.shutdown:
+        conn.send({"cmd": "shutdown"})
+        conn.recv()
+    conn.close()
+
+
+if __name__ == "__main__":
+    main()